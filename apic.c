@@ -0,0 +1,634 @@
+#include "apic.h"
+
+#include "interrupts.h"
+#include "io.h"
+#include "log.h"
+#include "paging.h"
+#include "string.h"
+
+// # Discovery
+// The firmware describes the interrupt controllers in one of two ways:
+//   - ACPI: the RSDP (found by scanning the BIOS areas) points to the RSDT,
+//     which points to every other table, including the MADT ("APIC"). The MADT
+//     lists the local APICs, the IOAPICs, and the ISA IRQs that aren't wired
+//     to the IOAPIC pin of the same number.
+//   - The MP spec, which is older but says much the same thing: a floating
+//     pointer ("_MP_") points at a config table ("PCMP") with an entry for
+//     each processor, IOAPIC, and interrupt line.
+// Either way we end up with an ApicConfig. Only ISA IRQs are routed, since
+// there are no PCI drivers to want anything else.
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ENABLE (1 << 11)
+#define CPUID_EDX_APIC (1 << 9)
+
+// Local APIC registers, as offsets into its 4kb of MMIO.
+#define LAPIC_MMIO_SIZE 0x1000
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xB0
+#define LAPIC_SVR 0xF0
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_ICR_INIT 0x500
+#define LAPIC_ICR_STARTUP 0x600
+#define LAPIC_ICR_PENDING (1 << 12)
+#define LAPIC_ICR_ASSERT (1 << 14)
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+#define LAPIC_TIMER_DIVIDE_16 0x3
+#define LAPIC_LVT_MASKED (1 << 16)
+
+// IOAPIC registers are reached by writing their index to IOREGSEL and then
+// reading or writing IOWIN.
+#define IOAPIC_IOREGSEL 0x00
+#define IOAPIC_IOWIN 0x10
+#define IOAPIC_VER 0x01
+#define IOAPIC_REDTBL(pin) (0x10 + 2 * (pin))
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL_TRIGGERED (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+#define MAX_IOAPICS 8
+#define NUM_ISA_IRQS 16
+// MPS INTI flags, used by both the MADT and the MP tables.
+#define INTI_POLARITY_MASK 0x3
+#define INTI_ACTIVE_LOW 0x3
+#define INTI_TRIGGER_MASK 0xC
+#define INTI_LEVEL_TRIGGERED 0xC
+
+typedef struct {
+  unsigned int id;
+  unsigned int paddr;
+  unsigned int gsi_base;  // The global system interrupt of pin 0.
+  unsigned int num_pins;
+  volatile unsigned int* regs;
+} IoApic;
+
+// Where an ISA IRQ ends up.
+typedef struct {
+  unsigned int gsi;
+  unsigned int flags;  // INTI_*
+} IsaRoute;
+
+typedef struct {
+  unsigned int lapic_paddr;
+  volatile unsigned int* lapic;
+  ApicInfo info;
+  IoApic ioapics[MAX_IOAPICS];
+  IsaRoute isa_routes[NUM_ISA_IRQS];
+  // The MP tables say there's an IMCR, which connects the 8259 straight to
+  // the CPU until it's pointed at the APIC.
+  int has_imcr;
+} ApicConfig;
+
+ApicConfig apic_;
+
+typedef struct __attribute__((packed)) {
+  char signature[8];  // "RSD PTR "
+  unsigned char checksum;
+  char oem_id[6];
+  unsigned char revision;
+  unsigned int rsdt_paddr;
+} Rsdp;
+
+typedef struct __attribute__((packed)) {
+  char signature[4];
+  unsigned int length;  // Including this header.
+  unsigned char revision;
+  unsigned char checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  unsigned int oem_revision;
+  unsigned int creator_id;
+  unsigned int creator_revision;
+} AcpiHeader;
+
+typedef struct __attribute__((packed)) {
+  AcpiHeader header;
+  unsigned int lapic_paddr;
+  unsigned int flags;
+  // Followed by variable length entries, each starting with a type and a
+  // length.
+} Madt;
+
+#define MADT_LAPIC 0
+#define MADT_IOAPIC 1
+#define MADT_ISO 2  // Interrupt source override.
+
+typedef struct __attribute__((packed)) {
+  unsigned char type;
+  unsigned char length;
+  unsigned char acpi_id;
+  unsigned char apic_id;
+  unsigned int flags;  // Bit 0 is set if the CPU is usable.
+} MadtLapic;
+
+typedef struct __attribute__((packed)) {
+  unsigned char type;
+  unsigned char length;
+  unsigned char id;
+  unsigned char reserved;
+  unsigned int paddr;
+  unsigned int gsi_base;
+} MadtIoApic;
+
+typedef struct __attribute__((packed)) {
+  unsigned char type;
+  unsigned char length;
+  unsigned char bus;  // Always 0, for ISA.
+  unsigned char irq;
+  unsigned int gsi;
+  unsigned short flags;
+} MadtIso;
+
+typedef struct __attribute__((packed)) {
+  char signature[4];  // "_MP_"
+  unsigned int config_paddr;
+  unsigned char length;  // In 16 byte units.
+  unsigned char revision;
+  unsigned char checksum;
+  unsigned char default_config;  // Non-zero if there's no config table.
+  unsigned char features;  // Bit 7 is set if the IMCR is present.
+  unsigned char reserved[3];
+} MpFloatingPointer;
+
+typedef struct __attribute__((packed)) {
+  char signature[4];  // "PCMP"
+  unsigned short length;
+  unsigned char revision;
+  unsigned char checksum;
+  char oem_id[8];
+  char product_id[12];
+  unsigned int oem_table_paddr;
+  unsigned short oem_table_size;
+  unsigned short entry_count;
+  unsigned int lapic_paddr;
+  unsigned short extended_length;
+  unsigned char extended_checksum;
+  unsigned char reserved;
+} MpConfig;
+
+#define MP_PROCESSOR 0
+#define MP_BUS 1
+#define MP_IOAPIC 2
+#define MP_IO_INTERRUPT 3
+#define MP_PROCESSOR_SIZE 20
+#define MP_ENTRY_SIZE 8  // Everything else.
+
+typedef struct __attribute__((packed)) {
+  unsigned char type;
+  unsigned char apic_id;
+  unsigned char apic_version;
+  unsigned char flags;  // Bit 0 is set if usable, bit 1 for the boot CPU.
+  unsigned int signature;
+  unsigned int features;
+  unsigned int reserved[2];
+} MpProcessor;
+
+typedef struct __attribute__((packed)) {
+  unsigned char type;
+  unsigned char id;
+  char bus_type[6];  // Space padded, e.g. "ISA   ".
+} MpBus;
+
+typedef struct __attribute__((packed)) {
+  unsigned char type;
+  unsigned char id;
+  unsigned char version;
+  unsigned char flags;  // Bit 0 is set if usable.
+  unsigned int paddr;
+} MpIoApic;
+
+typedef struct __attribute__((packed)) {
+  unsigned char type;
+  unsigned char interrupt_type;  // 0 for a plain vectored interrupt.
+  unsigned short flags;
+  unsigned char bus;
+  unsigned char irq;
+  unsigned char ioapic_id;
+  unsigned char pin;
+} MpIoInterrupt;
+
+int checksum_ok(const void* mem, unsigned int size) {
+  const unsigned char* bytes = (const unsigned char*)mem;
+  unsigned char sum = 0;
+  for (unsigned int i = 0; i < size; ++i) {
+    sum += bytes[i];
+  }
+  return sum == 0;
+}
+
+// Looks for a structure that starts with signature on a 16 byte boundary in
+// [paddr, paddr + size) of low memory, returning its virtual address.
+const void* scan_for(const char* signature, unsigned int sig_size,
+                     unsigned int struct_size, unsigned int paddr,
+                     unsigned int size) {
+  const unsigned char* mem = (const unsigned char*)phys_to_virt(paddr);
+  if (!mem) {
+    return 0;
+  }
+  for (unsigned int offset = 0; offset + struct_size <= size; offset += 16) {
+    if (!memcmp(mem + offset, signature, sig_size) &&
+        checksum_ok(mem + offset, struct_size)) {
+      return mem + offset;
+    }
+  }
+  return 0;
+}
+
+// Both the RSDP and the MP floating pointer live in the first KB of the EBDA
+// (whose segment is stored at 0x40E) or in the BIOS ROM.
+const void* scan_bios_areas(const char* signature, unsigned int sig_size,
+                            unsigned int struct_size) {
+  unsigned int ebda = *(unsigned short*)phys_to_virt(0x40E) << 4;
+  const void* found = 0;
+  if (ebda) {
+    found = scan_for(signature, sig_size, struct_size, ebda, 1024);
+  }
+  if (!found) {
+    found = scan_for(signature, sig_size, struct_size, 0xE0000, 0x20000);
+  }
+  return found;
+}
+
+// Routes an ISA IRQ to a global system interrupt. Later overrides win.
+void set_isa_route(unsigned int irq, unsigned int gsi, unsigned int flags) {
+  if (irq < NUM_ISA_IRQS) {
+    apic_.isa_routes[irq].gsi = gsi;
+    apic_.isa_routes[irq].flags = flags;
+  }
+}
+
+void add_cpu(unsigned int apic_id) {
+  if (apic_.info.num_cpus == MAX_CPUS) {
+    LOG_INT(WARNING, "Ignoring a CPU past MAX_CPUS with APIC ID ", apic_id);
+    return;
+  }
+  apic_.info.cpu_apic_ids[apic_.info.num_cpus++] = apic_id;
+}
+
+void add_ioapic(unsigned int id, unsigned int paddr, unsigned int gsi_base) {
+  if (apic_.info.num_ioapics == MAX_IOAPICS) {
+    LOG_HEX(WARNING, "Ignoring an IOAPIC past MAX_IOAPICS at ", paddr);
+    return;
+  }
+  IoApic* ioapic = &apic_.ioapics[apic_.info.num_ioapics++];
+  ioapic->id = id;
+  ioapic->paddr = paddr;
+  ioapic->gsi_base = gsi_base;
+}
+
+void parse_madt(const Madt* madt) {
+  apic_.lapic_paddr = madt->lapic_paddr;
+  const unsigned char* entry = (const unsigned char*)(madt + 1);
+  const unsigned char* end = (const unsigned char*)madt + madt->header.length;
+  while (entry + 2 <= end && entry[1] >= 2) {
+    switch (entry[0]) {
+      case MADT_LAPIC: {
+        const MadtLapic* lapic = (const MadtLapic*)entry;
+        if (lapic->flags & 1) {
+          add_cpu(lapic->apic_id);
+        }
+        break;
+      }
+      case MADT_IOAPIC: {
+        const MadtIoApic* ioapic = (const MadtIoApic*)entry;
+        add_ioapic(ioapic->id, ioapic->paddr, ioapic->gsi_base);
+        break;
+      }
+      case MADT_ISO: {
+        const MadtIso* iso = (const MadtIso*)entry;
+        set_isa_route(iso->irq, iso->gsi, iso->flags);
+        break;
+      }
+    }
+    entry += entry[1];
+  }
+}
+
+// Finds the MADT through the RSDT and parses it. Returns 0 if there isn't one.
+int find_madt() {
+  const Rsdp* rsdp = (const Rsdp*)scan_bios_areas("RSD PTR ", 8, sizeof(Rsdp));
+  if (!rsdp) {
+    return 0;
+  }
+  AcpiHeader* rsdt_header =
+      (AcpiHeader*)map_physical(rsdp->rsdt_paddr, sizeof(AcpiHeader), 0);
+  if (!rsdt_header) {
+    return 0;
+  }
+  unsigned int rsdt_size = rsdt_header->length;
+  unmap_physical(rsdt_header, sizeof(AcpiHeader));
+  AcpiHeader* rsdt = (AcpiHeader*)map_physical(rsdp->rsdt_paddr, rsdt_size, 0);
+  if (!rsdt) {
+    return 0;
+  }
+  int found = 0;
+  if (!memcmp(rsdt->signature, "RSDT", 4) && checksum_ok(rsdt, rsdt_size)) {
+    unsigned int* tables = (unsigned int*)(rsdt + 1);
+    unsigned int num_tables = (rsdt_size - sizeof(AcpiHeader)) / 4;
+    for (unsigned int i = 0; i < num_tables && !found; ++i) {
+      AcpiHeader* header =
+          (AcpiHeader*)map_physical(tables[i], sizeof(AcpiHeader), 0);
+      if (!header) {
+        continue;
+      }
+      int is_madt = !memcmp(header->signature, "APIC", 4);
+      unsigned int size = header->length;
+      unmap_physical(header, sizeof(AcpiHeader));
+      if (!is_madt) {
+        continue;
+      }
+      Madt* madt = (Madt*)map_physical(tables[i], size, 0);
+      if (madt && checksum_ok(madt, size)) {
+        parse_madt(madt);
+        found = 1;
+      }
+      if (madt) {
+        unmap_physical(madt, size);
+      }
+    }
+  }
+  unmap_physical(rsdt, rsdt_size);
+  return found;
+}
+
+// Pins are numbered per IOAPIC in the MP tables, so the GSIs we route by are
+// only known once every IOAPIC's size has been read. This turns the pins
+// stashed in isa_routes by parse_mp_config() into GSIs.
+void resolve_mp_routes() {
+  unsigned int gsi_base = 0;
+  for (unsigned int i = 0; i < apic_.info.num_ioapics; ++i) {
+    apic_.ioapics[i].gsi_base = gsi_base;
+    gsi_base += apic_.ioapics[i].num_pins;
+  }
+  for (unsigned int irq = 0; irq < NUM_ISA_IRQS; ++irq) {
+    IsaRoute* route = &apic_.isa_routes[irq];
+    unsigned int ioapic_id = route->gsi >> 16;
+    unsigned int pin = route->gsi & 0xFFFF;
+    route->gsi = irq;
+    for (unsigned int i = 0; i < apic_.info.num_ioapics; ++i) {
+      if (apic_.ioapics[i].id == ioapic_id) {
+        route->gsi = apic_.ioapics[i].gsi_base + pin;
+      }
+    }
+  }
+}
+
+int parse_mp_config(const MpConfig* config) {
+  apic_.lapic_paddr = config->lapic_paddr;
+  const unsigned char* entry = (const unsigned char*)(config + 1);
+  const unsigned char* end = (const unsigned char*)config + config->length;
+  unsigned int isa_bus = 0xFFFFFFFF;
+  // Buses come before the interrupt entries that refer to them.
+  for (unsigned int i = 0; i < config->entry_count && entry < end; ++i) {
+    switch (entry[0]) {
+      case MP_PROCESSOR: {
+        const MpProcessor* cpu = (const MpProcessor*)entry;
+        if (cpu->flags & 1) {
+          // The boot CPU goes first, like it does in the MADT.
+          add_cpu(cpu->apic_id);
+          if ((cpu->flags & 2) && apic_.info.num_cpus > 1) {
+            unsigned char* ids = apic_.info.cpu_apic_ids;
+            ids[apic_.info.num_cpus - 1] = ids[0];
+            ids[0] = cpu->apic_id;
+          }
+        }
+        entry += MP_PROCESSOR_SIZE;
+        continue;
+      }
+      case MP_BUS: {
+        const MpBus* bus = (const MpBus*)entry;
+        if (!memcmp(bus->bus_type, "ISA", 3)) {
+          isa_bus = bus->id;
+        }
+        break;
+      }
+      case MP_IOAPIC: {
+        const MpIoApic* ioapic = (const MpIoApic*)entry;
+        if (ioapic->flags & 1) {
+          add_ioapic(ioapic->id, ioapic->paddr, 0);
+        }
+        break;
+      }
+      case MP_IO_INTERRUPT: {
+        const MpIoInterrupt* interrupt = (const MpIoInterrupt*)entry;
+        if (interrupt->interrupt_type == 0 && interrupt->bus == isa_bus) {
+          // Stash the IOAPIC and pin for resolve_mp_routes().
+          set_isa_route(interrupt->irq,
+                        (interrupt->ioapic_id << 16) | interrupt->pin,
+                        interrupt->flags);
+        }
+        break;
+      }
+    }
+    entry += MP_ENTRY_SIZE;
+  }
+  return 1;
+}
+
+// Finds the MP config table and parses it. Returns 0 if there isn't one.
+int find_mp_config() {
+  const MpFloatingPointer* mp = (const MpFloatingPointer*)scan_bios_areas(
+      "_MP_", 4, sizeof(MpFloatingPointer));
+  if (!mp) {
+    // The spec also allows the last KB of base memory.
+    mp = (const MpFloatingPointer*)scan_for("_MP_", 4,
+                                            sizeof(MpFloatingPointer),
+                                            0x9FC00, 1024);
+  }
+  if (!mp || mp->default_config || !mp->config_paddr) {
+    // The default configurations don't come with a table, and are too old to
+    // be worth supporting.
+    return 0;
+  }
+  const MpConfig* config = (const MpConfig*)phys_to_virt(mp->config_paddr);
+  if (!config || memcmp(config->signature, "PCMP", 4) ||
+      !checksum_ok(config, config->length)) {
+    return 0;
+  }
+  // Everything but ISA IRQs 0 and 2 is assumed to be identity mapped, since
+  // that's the norm, and the table may well not bother saying so.
+  for (unsigned int irq = 0; irq < NUM_ISA_IRQS; ++irq) {
+    set_isa_route(irq, irq, 0);
+  }
+  parse_mp_config(config);
+  apic_.has_imcr = (mp->features & 0x80) != 0;
+  return 1;
+}
+
+unsigned int ioapic_read(IoApic* ioapic, unsigned int reg) {
+  ioapic->regs[IOAPIC_IOREGSEL / 4] = reg;
+  return ioapic->regs[IOAPIC_IOWIN / 4];
+}
+
+void ioapic_write(IoApic* ioapic, unsigned int reg, unsigned int value) {
+  ioapic->regs[IOAPIC_IOREGSEL / 4] = reg;
+  ioapic->regs[IOAPIC_IOWIN / 4] = value;
+}
+
+unsigned int lapic_read(unsigned int reg) {
+  return apic_.lapic[reg / 4];
+}
+
+void lapic_write(unsigned int reg, unsigned int value) {
+  apic_.lapic[reg / 4] = value;
+}
+
+// Nothing to do, and spurious interrupts mustn't be acked.
+void spurious_interrupt(void* ctx) {
+  ctx = ctx;
+}
+
+void lapic_enable() {
+  // The firmware usually leaves it enabled, but make sure, then turn it on in
+  // software through the spurious interrupt vector register.
+  wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | IA32_APIC_BASE_ENABLE);
+  lapic_write(LAPIC_TPR, 0);
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+int init_apic() {
+  unsigned int regs[4];
+  cpuid(1, regs);
+  if (!(regs[3] & CPUID_EDX_APIC)) {
+    LOG(INFO, "No local APIC, sticking with the 8259.");
+    return 0;
+  }
+  // Routes default to the IRQ's own pin (with its default, ISA polarity and
+  // trigger mode), which overrides only sometimes change.
+  for (unsigned int irq = 0; irq < NUM_ISA_IRQS; ++irq) {
+    set_isa_route(irq, irq, 0);
+  }
+  int from_mp = 0;
+  if (!find_madt()) {
+    if (!find_mp_config()) {
+      LOG(INFO, "No MADT or MP tables, sticking with the 8259.");
+      return 0;
+    }
+    from_mp = 1;
+  }
+  if (!apic_.info.num_ioapics) {
+    LOG(INFO, "No IOAPIC, sticking with the 8259.");
+    return 0;
+  }
+
+  apic_.lapic = (volatile unsigned int*)map_physical(
+      apic_.lapic_paddr, LAPIC_MMIO_SIZE,
+      PAGE_WRITABLE | PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH);
+  if (!apic_.lapic) {
+    return 0;
+  }
+  for (unsigned int i = 0; i < apic_.info.num_ioapics; ++i) {
+    IoApic* ioapic = &apic_.ioapics[i];
+    ioapic->regs = (volatile unsigned int*)map_physical(
+        ioapic->paddr, IOAPIC_IOWIN + 4,
+        PAGE_WRITABLE | PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH);
+    if (!ioapic->regs) {
+      return 0;
+    }
+    ioapic->num_pins = ((ioapic_read(ioapic, IOAPIC_VER) >> 16) & 0xFF) + 1;
+    for (unsigned int pin = 0; pin < ioapic->num_pins; ++pin) {
+      ioapic_write(ioapic, IOAPIC_REDTBL(pin), IOAPIC_MASKED);
+    }
+  }
+  if (from_mp) {
+    resolve_mp_routes();
+  }
+  // Only now that nothing can fail, since failing leaves the 8259 in charge.
+  if (apic_.has_imcr) {
+    outb(0x22, 0x70);
+    outb(0x23, 0x01);
+  }
+
+  register_irq_handler(APIC_SPURIOUS_VECTOR, spurious_interrupt, 0);
+  lapic_enable();
+
+  LOG_INT(INFO, "Local APIC found, CPUs: ", apic_.info.num_cpus);
+  LOG_INT(INFO, "                IOAPICs: ", apic_.info.num_ioapics);
+  return 1;
+}
+
+ApicInfo apic_info() {
+  return apic_.info;
+}
+
+void ioapic_enable_irq(unsigned int irq, unsigned int vector) {
+  if (irq >= NUM_ISA_IRQS) {
+    LOG_INT(ERROR, "Tried to route an IRQ that isn't ISA: ", irq);
+    return;
+  }
+  IsaRoute* route = &apic_.isa_routes[irq];
+  for (unsigned int i = 0; i < apic_.info.num_ioapics; ++i) {
+    IoApic* ioapic = &apic_.ioapics[i];
+    if (route->gsi < ioapic->gsi_base ||
+        route->gsi - ioapic->gsi_base >= ioapic->num_pins) {
+      continue;
+    }
+    unsigned int pin = route->gsi - ioapic->gsi_base;
+    // Fixed delivery, physical destination mode.
+    unsigned int low = vector;
+    if ((route->flags & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW) {
+      low |= IOAPIC_ACTIVE_LOW;
+    }
+    if ((route->flags & INTI_TRIGGER_MASK) == INTI_LEVEL_TRIGGERED) {
+      low |= IOAPIC_LEVEL_TRIGGERED;
+    }
+    // The destination goes in first, so the pin is never unmasked with the
+    // wrong one.
+    ioapic_write(ioapic, IOAPIC_REDTBL(pin) + 1, lapic_id() << 24);
+    ioapic_write(ioapic, IOAPIC_REDTBL(pin), low);
+    return;
+  }
+  LOG_INT(ERROR, "No IOAPIC pin for IRQ ", irq);
+}
+
+void lapic_eoi() {
+  lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_timer_oneshot(unsigned int vector, unsigned int ticks) {
+  lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+  // Mode bits 0 are one-shot.
+  lapic_write(LAPIC_LVT_TIMER, vector);
+  lapic_write(LAPIC_TIMER_INITIAL, ticks);
+}
+
+unsigned int lapic_timer_remaining() {
+  return lapic_read(LAPIC_TIMER_CURRENT);
+}
+
+void lapic_timer_stop() {
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+unsigned int lapic_id() {
+  return lapic_read(LAPIC_ID) >> 24;
+}
+
+// Sends an IPI and waits for the local APIC to accept it.
+void lapic_send_ipi(unsigned int apic_id, unsigned int command) {
+  lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+  // Writing the low half is what sends it.
+  lapic_write(LAPIC_ICR_LOW, command);
+  while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+    cpu_relax();
+  }
+}
+
+void lapic_send_init(unsigned int apic_id) {
+  lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+}
+
+void lapic_send_interrupt(unsigned int apic_id, unsigned int vector) {
+  lapic_send_ipi(apic_id, LAPIC_ICR_ASSERT | vector);
+}
+
+void lapic_send_startup(unsigned int apic_id, unsigned int paddr) {
+  lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | (paddr >> 12));
+}
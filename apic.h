@@ -0,0 +1,60 @@
+#ifndef APIC_H
+#define APIC_H
+
+// The local APIC and IOAPIC interrupt controllers. Everything starts out on
+// the 8259 (see pic8259.h), and init_apic_interrupts() in interrupts.c moves
+// IRQs over to these if the firmware says they're there.
+
+#define MAX_CPUS 16
+// Where the local APIC sends interrupts it had to drop. They must not be acked.
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+typedef struct {
+  unsigned int num_cpus;
+  // Local APIC IDs of the usable CPUs, with the boot CPU's first.
+  unsigned char cpu_apic_ids[MAX_CPUS];
+  unsigned int num_ioapics;
+} ApicInfo;
+
+// Looks for the APICs in ACPI's MADT, or failing that the older MP tables,
+// then maps and enables the local APIC and masks every IOAPIC pin. Returns 0,
+// without touching anything, if there's no APIC to use. Needs paging.
+int init_apic();
+
+ApicInfo apic_info();
+
+// Routes a legacy ISA IRQ (as numbered on the 8259) to vector on the boot CPU,
+// following the firmware's overrides of its pin, polarity and trigger mode,
+// and unmasks it.
+void ioapic_enable_irq(unsigned int irq, unsigned int vector);
+
+// Turns on the running CPU's local APIC. init_apic() does this for the boot
+// CPU, and every other CPU has to do it for itself.
+void lapic_enable();
+
+// Raises vector on the CPU with the given local APIC ID.
+void lapic_send_interrupt(unsigned int apic_id, unsigned int vector);
+
+// Sends an INIT IPI to the CPU with the given local APIC ID, which resets it
+// into waiting for a startup IPI.
+void lapic_send_init(unsigned int apic_id);
+
+// Sends a startup IPI, which starts a CPU waiting after an INIT running real
+// mode code at paddr. paddr must be page aligned and below 1MB.
+void lapic_send_startup(unsigned int apic_id, unsigned int paddr);
+
+// Signals the end of the interrupt being handled. A single MMIO write, rather
+// than the 8259's port I/O.
+void lapic_eoi();
+
+// Starts the local APIC timer counting down from ticks, at the bus clock / 16,
+// and raises vector on this CPU once it reaches 0. The bus clock isn't known
+// ahead of time, so it has to be measured with lapic_timer_remaining().
+void lapic_timer_oneshot(unsigned int vector, unsigned int ticks);
+unsigned int lapic_timer_remaining();
+void lapic_timer_stop();
+
+// The local APIC ID of the running CPU.
+unsigned int lapic_id();
+
+#endif  // APIC_H
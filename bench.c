@@ -0,0 +1,185 @@
+#include "bench.h"
+
+#include "io.h"
+#include "log.h"
+#include "frames.h"
+#include "paging.h"
+#include "string.h"
+#include "tasks.h"
+#include "thread.h"
+
+#define PAGE_SIZE 4096
+// Kept a power of two so averaging is a shift (there's no 64-bit division
+// without libgcc).
+#define MAP_ITERATIONS_BITS 2
+#define SWITCH_ITERATIONS_BITS 12
+#define SCALING_ITERATIONS_BITS 2
+#define MAX_SCALING_CPUS 8
+// 64kb pieces of the 4MB buffer.
+#define SCALING_CHUNK_SIZE 0x10000
+#define SCALING_NUM_CHUNKS ((FRAME_SIZE << FRAME_MAX_ORDER) / SCALING_CHUNK_SIZE)
+
+// Maps npages pages at vaddr the way malloc() used to: one frame, one page
+// table lookup and one invlpg per page.
+void map_pages_one_at_a_time(unsigned int vaddr, unsigned int npages) {
+  for (unsigned int i = 0; i < npages; ++i) {
+    map_page(vaddr + i * PAGE_SIZE, alloc_frames(0));
+  }
+}
+
+// Unmaps npages pages at vaddr the way free() used to.
+void unmap_pages_one_at_a_time(unsigned int vaddr, unsigned int npages) {
+  for (unsigned int i = 0; i < npages; ++i) {
+    unsigned int paddr = translate_vaddr(vaddr + i * PAGE_SIZE);
+    if (paddr != 0xFFFFFFFF) {
+      unmap_page(vaddr + i * PAGE_SIZE);
+      free_frames(paddr, 0);
+    }
+  }
+}
+
+// Remaps a 4kb...4MB block over and over, page by page and then as a batch,
+// and logs the average cycles per map + unmap for each.
+void bench_map_range() {
+  LOG(INFO, "bench_map_range: cycles per map + unmap of a block");
+  for (unsigned int size = PAGE_SIZE; size <= 4 * 1024 * 1024; size <<= 2) {
+    unsigned int npages = size / PAGE_SIZE;
+    unsigned int mem = alloc_page_block(size, 0);
+    if (!mem) {
+      LOG_HEX(ERROR, "Couldn't allocate a block to benchmark: ", size);
+      return;
+    }
+    unmap_range(mem, npages);
+
+    unsigned long long start = rdtsc();
+    for (int i = 0; i < (1 << MAP_ITERATIONS_BITS); ++i) {
+      map_pages_one_at_a_time(mem, npages);
+      unmap_pages_one_at_a_time(mem, npages);
+    }
+    unsigned long long per_page = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < (1 << MAP_ITERATIONS_BITS); ++i) {
+      map_range(mem, npages, PAGE_WRITABLE);
+      unmap_range(mem, npages);
+    }
+    unsigned long long batched = rdtsc() - start;
+
+    LOG_HEX(INFO, "  block size: ", size);
+    LOG_INT(INFO, "    one page at a time: ",
+            (unsigned int)(per_page >> MAP_ITERATIONS_BITS));
+    LOG_INT(INFO, "    batched: ",
+            (unsigned int)(batched >> MAP_ITERATIONS_BITS));
+
+    // Leave it mapped again so free_page_block() has the frames to give back.
+    map_range(mem, npages, PAGE_WRITABLE);
+    free_page_block(mem, size);
+  }
+}
+
+int ping_pong_done = 0;
+
+void ping_pong(void* arg) {
+  arg = arg;
+  while (!ping_pong_done) {
+    yield();
+  }
+}
+
+// Bounces between this thread and another one of the same priority with
+// yield(), and logs the average cycles per switch.
+void bench_context_switch() {
+  unsigned int priority = current_thread()->priority;
+  ping_pong_done = 0;
+  if (!thread_create("ping_pong", priority, ping_pong, 0)) {
+    LOG(ERROR, "Couldn't start a thread to benchmark.");
+    return;
+  }
+  ThreadStats before = thread_stats();
+  unsigned long long start = rdtsc();
+  for (int i = 0; i < (1 << SWITCH_ITERATIONS_BITS); ++i) {
+    yield();
+  }
+  unsigned long long cycles = rdtsc() - start;
+  unsigned int switches = thread_stats().switches - before.switches;
+  ping_pong_done = 1;
+  yield();  // Let it exit.
+
+  // Each yield() is two switches: there and back.
+  LOG(INFO, "bench_context_switch: cycles per thread switch");
+  LOG_INT(INFO, "  switches: ", switches);
+  LOG_INT(INFO, "  cycles: ",
+          (unsigned int)(cycles >> (SWITCH_ITERATIONS_BITS + 1)));
+}
+
+typedef struct {
+  unsigned char* buffer;
+  unsigned int sums[SCALING_NUM_CHUNKS];
+} ScalingWork;
+
+void zero_chunks(unsigned int begin, unsigned int end, void* arg) {
+  ScalingWork* work = (ScalingWork*)arg;
+  memset(work->buffer + begin * SCALING_CHUNK_SIZE, 0,
+         (end - begin) * SCALING_CHUNK_SIZE);
+}
+
+// A Fletcher-style sum of each chunk, so the order of the words matters.
+void checksum_chunks(unsigned int begin, unsigned int end, void* arg) {
+  ScalingWork* work = (ScalingWork*)arg;
+  for (unsigned int chunk = begin; chunk < end; ++chunk) {
+    unsigned int* words =
+        (unsigned int*)(work->buffer + chunk * SCALING_CHUNK_SIZE);
+    unsigned int a = 0;
+    unsigned int b = 0;
+    for (unsigned int i = 0; i < SCALING_CHUNK_SIZE / 4; ++i) {
+      a += words[i];
+      b += a;
+    }
+    work->sums[chunk] = a ^ b;
+  }
+}
+
+// Cycles for parallel_for(fn) over the whole buffer, averaged.
+unsigned int time_parallel_for(ScalingWork* work, RangeFn fn) {
+  unsigned long long start = rdtsc();
+  for (int i = 0; i < (1 << SCALING_ITERATIONS_BITS); ++i) {
+    parallel_for(0, SCALING_NUM_CHUNKS, 1, fn, work);
+  }
+  return (rdtsc() - start) >> SCALING_ITERATIONS_BITS;
+}
+
+// Zeroes and then checksums a 4MB block of frames (through the direct map,
+// which the other CPUs can safely use) with 1 to 8 CPUs, and logs the cycles
+// each took.
+void bench_task_scaling() {
+  static ScalingWork work;
+  unsigned int paddr = alloc_frames(FRAME_MAX_ORDER);
+  work.buffer = paddr ? (unsigned char*)phys_to_virt(paddr) : 0;
+  if (!work.buffer) {
+    LOG(ERROR, "Couldn't get a block of frames to benchmark.");
+    if (paddr) {
+      free_frames(paddr, FRAME_MAX_ORDER);
+    }
+    return;
+  }
+  unsigned int all_cpus = task_workers();
+  unsigned int max_cpus = all_cpus;
+  if (max_cpus > MAX_SCALING_CPUS) {
+    max_cpus = MAX_SCALING_CPUS;
+  }
+  LOG(INFO, "bench_task_scaling: cycles to zero and checksum 4MB");
+  for (unsigned int cpus = 1; cpus <= max_cpus; ++cpus) {
+    set_task_workers(cpus);
+    LOG_INT(INFO, "  CPUs: ", cpus);
+    LOG_INT(INFO, "    zero: ", time_parallel_for(&work, zero_chunks));
+    LOG_INT(INFO, "    checksum: ", time_parallel_for(&work, checksum_chunks));
+  }
+  set_task_workers(all_cpus);
+  free_frames(paddr, FRAME_MAX_ORDER);
+}
+
+void run_benchmarks() {
+  bench_map_range();
+  bench_context_switch();
+  bench_task_scaling();
+}
@@ -0,0 +1,9 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Timing runs for kernel subsystems, measured with rdtsc and reported through
+// the log. Only called when the kernel is built with -DRUN_BENCHMARKS, since
+// they take a while and flood the serial port.
+void run_benchmarks();
+
+#endif  // BENCH_H
@@ -0,0 +1,203 @@
+#include "buddy.h"
+
+#include "log.h"
+#include "string.h"
+
+// # Virtual memory allocation
+// The tree is a heap of nodes, one bit each:
+//   { 0.0, 1.0, 1.1, 2.0, 2.1, 2.2, 2.3, 3.0, etc }
+// Index 0 is unused, the root (all 4GB) is at index 1, and the children of
+// node i are at 2i and 2i+1. Row r of the tree (starting at 1) holds blocks of
+// 2^(33-r) bytes, so the finest row (individual 4kb pages) is row 21 and has
+// 1024 * 1024 nodes. All rows together take 2^21 bits, or 256kb.
+//
+// A node's bit is set when it's a free block that isn't part of a larger free
+// block, which makes each row a bitmap of the free blocks of that size:
+//   - Claiming a block of a given size means finding any set bit in its row.
+//     If the row is empty, we take a larger block from a row above and split
+//     it, setting the bits of the unused halves on the way down.
+//   - A block is free exactly when it or one of its ancestors has its bit set,
+//     so a large claim automatically covers everything below it.
+//   - Freeing a block sets its bit, and then merges it with its buddy (i ^ 1)
+//     for as long as the buddy's bit is set too.
+//
+// To avoid scanning a row bit by bit (a million bits for the 4kb row) each
+// level above the tree summarizes the level below it with one bit per 32-bit
+// word, which is set if that word is non-zero:
+//   level 0: 2^21 bits (the tree)
+//   level 1: 2^16 bits
+//   level 2: 2^11 bits
+//   level 3: 2^6 bits
+//   level 4: 2 bits
+// Rows start at power of two indices, so a row's range of bits at any level is
+// either a single word or a run of whole words. Finding a set bit takes one
+// masked word at the top followed by a bsf per level on the way down, and
+// setting or clearing a bit only touches the levels above it when a word
+// changes between zero and non-zero.
+
+#define BUDDY_NUM_ROWS (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 2)
+// Number of 32-bit words in each level.
+#define BUDDY_LEVEL_WORDS(level) \
+  ((((1u << (BUDDY_NUM_ROWS)) >> (5 * (level))) + 31) >> 5)
+
+unsigned int buddy_tree_size() {
+  unsigned int words = 0;
+  for (int level = 0; level < BUDDY_NUM_LEVELS; ++level) {
+    words += BUDDY_LEVEL_WORDS(level);
+  }
+  return words * sizeof(unsigned int);
+}
+
+void buddy_set_bit(BuddyTree* tree, unsigned int index) {
+  for (int level = 0; level < BUDDY_NUM_LEVELS; ++level) {
+    unsigned int* word = &tree->levels[level][index >> 5];
+    unsigned int was_empty = !*word;
+    *word |= 1u << (index & 31);
+    if (!was_empty) {
+      return;
+    }
+    index >>= 5;
+  }
+}
+
+void buddy_clear_bit(BuddyTree* tree, unsigned int index) {
+  for (int level = 0; level < BUDDY_NUM_LEVELS; ++level) {
+    unsigned int* word = &tree->levels[level][index >> 5];
+    *word &= ~(1u << (index & 31));
+    if (*word) {
+      return;
+    }
+    index >>= 5;
+  }
+}
+
+int buddy_get_bit(BuddyTree* tree, unsigned int index) {
+  return (tree->levels[0][index >> 5] >> (index & 31)) & 1;
+}
+
+// Finds a set bit in [start, start + count) of the tree, where count is a power
+// of two and start is a multiple of count. Returns 0 if there isn't one.
+unsigned int buddy_find_set_bit(BuddyTree* tree, unsigned int start,
+                                unsigned int count) {
+  // Climb until the range fits in a single word.
+  int level = 0;
+  unsigned int first = start;
+  unsigned int last = start + count - 1;
+  while ((first >> 5) != (last >> 5)) {
+    first >>= 5;
+    last >>= 5;
+    ++level;
+  }
+  unsigned int mask = (0xFFFFFFFFu >> (31 - (last & 31))) &
+                      (0xFFFFFFFFu << (first & 31));
+  unsigned int word = tree->levels[level][first >> 5] & mask;
+  if (!word) {
+    return 0;
+  }
+  unsigned int index = (first & ~31u) + __builtin_ctz(word);
+  // The summary bits guarantee every word we descend into is non-zero.
+  while (level > 0) {
+    --level;
+    index = (index << 5) + __builtin_ctz(tree->levels[level][index]);
+  }
+  return index;
+}
+
+unsigned int buddy_row_root(unsigned int order) {
+  return 1u << (BUDDY_MAX_ORDER + 1 - order);
+}
+
+unsigned int buddy_index(unsigned int vaddr, unsigned int order) {
+  return buddy_row_root(order) + (vaddr >> order);
+}
+
+void buddy_init(BuddyTree* tree, void* mem) {
+  unsigned int* words = (unsigned int*)mem;
+  for (int level = 0; level < BUDDY_NUM_LEVELS; ++level) {
+    tree->levels[level] = words;
+    words += BUDDY_LEVEL_WORDS(level);
+  }
+  memset(mem, 0, buddy_tree_size());
+  // Everything starts out as one big free block.
+  buddy_set_bit(tree, 1);
+}
+
+unsigned int buddy_claim_block(BuddyTree* tree, unsigned int order) {
+  if (order < BUDDY_MIN_ORDER || order > BUDDY_MAX_ORDER) {
+    LOG_HEX(ERROR, "Tried to claim a vblock of unsupported order: ", order);
+    return 0;
+  }
+  unsigned int row_root = buddy_row_root(order);
+  // Look for a free block of the requested size, then successively larger
+  // ones.
+  unsigned int index = 0;
+  for (unsigned int root = row_root; root && !index; root >>= 1) {
+    index = buddy_find_set_bit(tree, root, root);
+  }
+  if (!index) {
+    return 0;  // Not available.
+  }
+  buddy_clear_bit(tree, index);
+  // Split the block down to the requested size, keeping the left halves and
+  // freeing the right ones.
+  while (index < row_root) {
+    index <<= 1;
+    buddy_set_bit(tree, index | 1);
+  }
+  return (index - row_root) << order;
+}
+
+int buddy_claim_vaddr(BuddyTree* tree, unsigned int vaddr, unsigned int order) {
+  if (order < BUDDY_MIN_ORDER || order > BUDDY_MAX_ORDER ||
+      (vaddr & ((1u << order) - 1))) {
+    LOG_HEX(ERROR, "Tried to claim an invalid vblock: ", vaddr);
+    return 0;
+  }
+  unsigned int index = buddy_index(vaddr, order);
+  // Find the free block that contains this one.
+  int depth = 0;
+  unsigned int free_index = index;
+  while (free_index && !buddy_get_bit(tree, free_index)) {
+    free_index >>= 1;
+    ++depth;
+  }
+  if (!free_index) {
+    return 0;
+  }
+  buddy_clear_bit(tree, free_index);
+  // Split it on the way down to index, freeing the halves we don't need.
+  while (depth > 0) {
+    --depth;
+    buddy_set_bit(tree, (index >> depth) ^ 1);
+  }
+  return 1;
+}
+
+int buddy_is_free(BuddyTree* tree, unsigned int vaddr, unsigned int order) {
+  for (unsigned int index = buddy_index(vaddr, order); index; index >>= 1) {
+    if (buddy_get_bit(tree, index)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void buddy_free_block(BuddyTree* tree, unsigned int vaddr,
+                      unsigned int order) {
+  if (order < BUDDY_MIN_ORDER || order > BUDDY_MAX_ORDER ||
+      (vaddr & ((1u << order) - 1))) {
+    LOG_HEX(ERROR, "Tried to free an invalid vblock: ", vaddr);
+    return;
+  }
+  if (buddy_is_free(tree, vaddr, order)) {
+    LOG_HEX(ERROR, "vblock was already freed: ", vaddr);
+    return;
+  }
+  unsigned int index = buddy_index(vaddr, order);
+  while (index > 1 && buddy_get_bit(tree, index ^ 1)) {
+    // The buddy is free too, so merge them into the parent block.
+    buddy_clear_bit(tree, index ^ 1);
+    index >>= 1;
+  }
+  buddy_set_bit(tree, index);
+}
@@ -0,0 +1,40 @@
+#ifndef BUDDY_H
+#define BUDDY_H
+
+// Smallest and largest blocks that can be claimed from the tree, as log2 of
+// their size in bytes.
+#define BUDDY_MIN_ORDER 12
+#define BUDDY_MAX_ORDER 31
+
+// Level 0 is the tree itself, one bit per node. Each level above it has one
+// bit per 32-bit word of the level below, set if that word is non-zero.
+#define BUDDY_NUM_LEVELS 5
+
+// A buddy allocator for the 4GB virtual address space. See buddy.c.
+typedef struct {
+  unsigned int* levels[BUDDY_NUM_LEVELS];
+} BuddyTree;
+
+// Number of bytes of memory buddy_init() needs for a tree.
+unsigned int buddy_tree_size();
+
+// Sets up a tree with the entire address space free, using the
+// buddy_tree_size() bytes at mem for bookkeeping.
+void buddy_init(BuddyTree* tree, void* mem);
+
+// Finds and claims a free block of exactly 2^order bytes, preferring low
+// addresses. Returns the address of the block, or 0 if there's no free block
+// that large (so callers should keep address 0 claimed).
+unsigned int buddy_claim_block(BuddyTree* tree, unsigned int order);
+
+// Claims the specific block of 2^order bytes at vaddr. Returns non-zero on
+// success, or 0 if any part of the block was already claimed.
+int buddy_claim_vaddr(BuddyTree* tree, unsigned int vaddr, unsigned int order);
+
+// Frees the block of 2^order bytes at vaddr, merging it with its buddies.
+void buddy_free_block(BuddyTree* tree, unsigned int vaddr, unsigned int order);
+
+// Returns non-zero if the block of 2^order bytes at vaddr is entirely free.
+int buddy_is_free(BuddyTree* tree, unsigned int vaddr, unsigned int order);
+
+#endif  // BUDDY_H
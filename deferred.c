@@ -0,0 +1,121 @@
+#include "deferred.h"
+
+#include "interrupts.h"
+
+// Each priority has a ring of work items with one producer and one consumer:
+//   - defer_work() only ever runs with interrupts disabled, so on one CPU two
+//     producers can't overlap. It only writes tail.
+//   - Items are only taken by run_queues(), which deferred_running keeps from
+//     overlapping with itself. It only writes head.
+// So neither side needs a lock, just release stores that publish an item (or a
+// free slot) after it's been written (or read).
+
+// Must be a power of two.
+#define DEFERRED_QUEUE_SIZE 256
+#define DEFERRED_QUEUE_MASK (DEFERRED_QUEUE_SIZE - 1)
+// How much work deferred_irq_exit() does before letting the interrupted code
+// carry on. Anything left over runs on the next IRQ or in the idle loop.
+#define DEFERRED_IRQ_EXIT_BATCH 16
+
+typedef struct {
+  DeferredFn fn;
+  unsigned int data;
+} DeferredWork;
+
+typedef struct {
+  DeferredWork items[DEFERRED_QUEUE_SIZE];
+  unsigned int head;  // The next item to run.
+  unsigned int tail;  // Where the next item goes.
+  DeferredWorkStats stats;
+} DeferredQueue;
+
+DeferredQueue deferred_queues[NUM_DEFERRED_PRIORITIES];
+int deferred_running = 0;
+
+int defer_work(DeferredPriority priority, DeferredFn fn, unsigned int data) {
+  DeferredQueue* queue = &deferred_queues[priority];
+  unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  unsigned int depth = queue->tail - head;
+  if (depth == DEFERRED_QUEUE_SIZE) {
+    ++queue->stats.dropped;
+    return 0;
+  }
+  DeferredWork* work = &queue->items[queue->tail & DEFERRED_QUEUE_MASK];
+  work->fn = fn;
+  work->data = data;
+  __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+  ++queue->stats.queued;
+  if (depth + 1 > queue->stats.max_depth) {
+    queue->stats.max_depth = depth + 1;
+  }
+  return 1;
+}
+
+int has_deferred_work() {
+  for (int priority = 0; priority < NUM_DEFERRED_PRIORITIES; ++priority) {
+    DeferredQueue* queue = &deferred_queues[priority];
+    if (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) != queue->head) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Pops and runs items until max_items have run or the queues are empty.
+// Rechecks from the highest priority after every item, since running one might
+// have let an IRQ queue something more urgent.
+unsigned int run_queues(unsigned int max_items) {
+  unsigned int ran = 0;
+  while (ran < max_items) {
+    DeferredQueue* queue = 0;
+    for (int priority = 0; priority < NUM_DEFERRED_PRIORITIES; ++priority) {
+      DeferredQueue* q = &deferred_queues[priority];
+      if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) != q->head) {
+        queue = q;
+        break;
+      }
+    }
+    if (!queue) {
+      break;
+    }
+    DeferredWork work = queue->items[queue->head & DEFERRED_QUEUE_MASK];
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+    work.fn(work.data);
+    ++queue->stats.run;
+    ++ran;
+  }
+  return ran;
+}
+
+unsigned int run_deferred_work(unsigned int max_items) {
+  // An IRQ between the check and the store would run its work to completion
+  // (and clear the flag again) before we get here, so this is safe on one CPU.
+  if (deferred_running) {
+    return 0;
+  }
+  deferred_running = 1;
+  unsigned int ran = run_queues(max_items);
+  deferred_running = 0;
+  return ran;
+}
+
+void deferred_irq_exit() {
+  if (deferred_running || !has_deferred_work()) {
+    return;
+  }
+  // Claimed before enabling interrupts, so a nested IRQ can't start running
+  // work too and the stack stays at most two IRQs deep.
+  deferred_running = 1;
+  sti();
+  run_queues(DEFERRED_IRQ_EXIT_BATCH);
+  cli();
+  deferred_running = 0;
+}
+
+int deferred_work_running() {
+  return deferred_running;
+}
+
+DeferredWorkStats deferred_work_stats(DeferredPriority priority) {
+  return deferred_queues[priority].stats;
+}
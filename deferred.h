@@ -0,0 +1,46 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+// Deferred work, so that interrupt handlers only have to grab whatever the
+// device needs read right away and can leave the rest for later, when
+// interrupts are enabled again.
+
+typedef void (*DeferredFn)(unsigned int data);
+
+// Work of higher priority (lower numbers) always runs first.
+typedef enum {
+  DEFERRED_HIGH = 0,
+  DEFERRED_LOW,
+  NUM_DEFERRED_PRIORITIES
+} DeferredPriority;
+
+// Queues fn(data) to run later. Must be called with interrupts disabled, which
+// IRQ handlers always are. Returns 0 (and drops the work) if the queue is full.
+int defer_work(DeferredPriority priority, DeferredFn fn, unsigned int data);
+
+int has_deferred_work();
+
+// Runs up to max_items queued items, highest priority first, with interrupts
+// enabled. Returns the number run. Does nothing if deferred work is already
+// running further up the stack.
+unsigned int run_deferred_work(unsigned int max_items);
+
+// Called on the way out of every IRQ, with interrupts disabled. Runs a bounded
+// batch of queued work with interrupts enabled, unless the IRQ came in while
+// work was already running.
+void deferred_irq_exit();
+
+// Returns 1 while deferred work is running further up the stack, which makes
+// it no place to switch threads from.
+int deferred_work_running();
+
+typedef struct {
+  unsigned int queued;     // defer_work() calls that made it into the queue.
+  unsigned int run;        // Items that have been run.
+  unsigned int dropped;    // defer_work() calls that found the queue full.
+  unsigned int max_depth;  // Most items ever waiting at once.
+} DeferredWorkStats;
+
+DeferredWorkStats deferred_work_stats(DeferredPriority priority);
+
+#endif  // DEFERRED_H
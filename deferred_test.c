@@ -0,0 +1,109 @@
+#include <stdio.h>
+
+#include "deferred.h"
+#include "test.h"
+
+// deferred.c enables interrupts around the work it runs from IRQs. On the host
+// we just note that it did.
+int interrupts_enabled = 0;
+void sti() { interrupts_enabled = 1; }
+void cli() { interrupts_enabled = 0; }
+
+unsigned int ran[1024];
+unsigned int num_ran = 0;
+
+void record(unsigned int data) {
+  ran[num_ran++] = data;
+}
+
+// Queues more work from inside a work item, like an IRQ arriving while
+// deferred work runs.
+void requeue(unsigned int data) {
+  record(data);
+  EXPECT_TRUE(defer_work(DEFERRED_HIGH, record, data + 1));
+}
+
+// Tries to run deferred work from inside deferred work, which must not
+// recurse.
+void nested_run(unsigned int data) {
+  record(data);
+  EXPECT_TRUE(run_deferred_work(100) == 0);
+}
+
+void test_priorities() {
+  num_ran = 0;
+  EXPECT_TRUE(!has_deferred_work());
+  EXPECT_TRUE(defer_work(DEFERRED_LOW, record, 3));
+  EXPECT_TRUE(defer_work(DEFERRED_HIGH, record, 1));
+  EXPECT_TRUE(defer_work(DEFERRED_LOW, record, 4));
+  EXPECT_TRUE(defer_work(DEFERRED_HIGH, record, 2));
+  EXPECT_TRUE(has_deferred_work());
+  EXPECT_TRUE(run_deferred_work(100) == 4);
+  EXPECT_TRUE(!has_deferred_work());
+  EXPECT_TRUE(num_ran == 4);
+  for (unsigned int i = 0; i < 4; ++i) {
+    EXPECT_TRUE(ran[i] == i + 1);
+  }
+}
+
+void test_urgent_work_jumps_the_queue() {
+  num_ran = 0;
+  defer_work(DEFERRED_LOW, requeue, 10);
+  defer_work(DEFERRED_LOW, record, 20);
+  EXPECT_TRUE(run_deferred_work(100) == 3);
+  EXPECT_TRUE(num_ran == 3);
+  EXPECT_TRUE(ran[0] == 10 && ran[1] == 11 && ran[2] == 20);
+}
+
+void test_bounded_batches() {
+  num_ran = 0;
+  for (unsigned int i = 0; i < 40; ++i) {
+    defer_work(DEFERRED_LOW, record, i);
+  }
+  EXPECT_TRUE(run_deferred_work(10) == 10);
+  EXPECT_TRUE(num_ran == 10);
+  // deferred_irq_exit() runs a bounded batch with interrupts enabled, and
+  // leaves them disabled again.
+  deferred_irq_exit();
+  EXPECT_TRUE(num_ran > 10 && num_ran < 40);
+  EXPECT_TRUE(!interrupts_enabled);
+  run_deferred_work(100);
+  EXPECT_TRUE(num_ran == 40);
+  for (unsigned int i = 0; i < 40; ++i) {
+    EXPECT_TRUE(ran[i] == i);
+  }
+}
+
+void test_no_recursion() {
+  num_ran = 0;
+  defer_work(DEFERRED_HIGH, nested_run, 1);
+  defer_work(DEFERRED_HIGH, record, 2);
+  EXPECT_TRUE(run_deferred_work(100) == 2);
+  EXPECT_TRUE(num_ran == 2);
+}
+
+void test_full_queue_drops() {
+  DeferredWorkStats before = deferred_work_stats(DEFERRED_HIGH);
+  unsigned int queued = 0;
+  while (defer_work(DEFERRED_HIGH, record, 0)) {
+    ++queued;
+  }
+  DeferredWorkStats after = deferred_work_stats(DEFERRED_HIGH);
+  EXPECT_TRUE(queued > 0);
+  EXPECT_TRUE(after.dropped == before.dropped + 1);
+  EXPECT_TRUE(after.queued == before.queued + queued);
+  EXPECT_TRUE(after.max_depth == queued);
+  num_ran = 0;
+  EXPECT_TRUE(run_deferred_work(queued + 1) == queued);
+  after = deferred_work_stats(DEFERRED_HIGH);
+  EXPECT_TRUE(after.run == after.queued);
+}
+
+int main() {
+  test_priorities();
+  test_urgent_work_jumps_the_queue();
+  test_bounded_batches();
+  test_no_recursion();
+  test_full_queue_drops();
+  return test_result();
+}
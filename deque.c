@@ -0,0 +1,67 @@
+#include "deque.h"
+
+// top and bottom are free-running counters, so sizes and comparisons are all
+// done on their (signed) difference, which stays right when they wrap around.
+//
+// The one subtle case is the last item, which the owner's pop and a thief can
+// both go for: pop publishes the smaller bottom before reading top (which
+// needs a full barrier, the only one on the owner's side), so that either the
+// thief sees the item gone or the owner sees the thief's top, and whichever
+// of them it comes down to settles it with a compare-and-swap on top.
+
+int deque_push(Deque* deque, void* item) {
+  unsigned int bottom = deque->bottom;
+  unsigned int top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  if ((int)(bottom - top) >= DEQUE_SIZE) {
+    return 0;
+  }
+  deque->items[bottom & DEQUE_MASK] = item;
+  // Publishes the item to thieves.
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void* deque_pop(Deque* deque) {
+  unsigned int bottom = deque->bottom - 1;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  unsigned int top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  int size = (int)(bottom - top);
+  if (size < 0) {
+    // Empty. Put bottom back where it was.
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  void* item = deque->items[bottom & DEQUE_MASK];
+  if (size > 0) {
+    return item;  // More than one left, so no thief can reach this one.
+  }
+  // The last item: race any thieves for it.
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    item = 0;
+  }
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return item;
+}
+
+void* deque_steal(Deque* deque) {
+  unsigned int top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  unsigned int bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if ((int)(bottom - top) <= 0) {
+    return 0;
+  }
+  void* item = deque->items[top & DEQUE_MASK];
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  return item;
+}
+
+int deque_is_empty(Deque* deque) {
+  unsigned int top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  unsigned int bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  return (int)(bottom - top) <= 0;
+}
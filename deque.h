@@ -0,0 +1,35 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+// A Chase-Lev work-stealing deque of pointers. Its owner pushes and pops at
+// the bottom like a stack, and any other CPU can steal from the top, with
+// neither needing a lock: the only contended operation is taking the last
+// item (or stealing), which is a single compare-and-swap on top.
+//
+// Fixed size, unlike the paper's, since there's no good way to free the old
+// array while thieves might still be reading it. Zero-initialised is empty.
+
+// Must be a power of two.
+#define DEQUE_SIZE 256
+#define DEQUE_MASK (DEQUE_SIZE - 1)
+
+typedef struct {
+  unsigned int top;     // The next item to steal. Only ever increases.
+  unsigned int bottom;  // Where the owner pushes next.
+  void* items[DEQUE_SIZE];
+} Deque;
+
+// Owner only. Returns 0 if the deque is full.
+int deque_push(Deque* deque, void* item);
+
+// Owner only. Returns the most recently pushed item, or 0 if it's empty.
+void* deque_pop(Deque* deque);
+
+// Any CPU. Returns the oldest item, or 0 if the deque is empty or another CPU
+// got to it first.
+void* deque_steal(Deque* deque);
+
+// Any CPU, and only a hint, since it can change as soon as it's read.
+int deque_is_empty(Deque* deque);
+
+#endif  // DEQUE_H
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "deque.h"
+#include "test.h"
+
+int values[DEQUE_SIZE + 1];
+
+void test_owner_is_lifo(Deque* deque) {
+  EXPECT_TRUE(deque_is_empty(deque));
+  EXPECT_TRUE(deque_pop(deque) == 0);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(deque_push(deque, &values[i]));
+  }
+  EXPECT_TRUE(!deque_is_empty(deque));
+  for (int i = 9; i >= 0; --i) {
+    EXPECT_TRUE(deque_pop(deque) == &values[i]);
+  }
+  EXPECT_TRUE(deque_pop(deque) == 0);
+  EXPECT_TRUE(deque_is_empty(deque));
+}
+
+void test_thieves_are_fifo(Deque* deque) {
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(deque_push(deque, &values[i]));
+  }
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_TRUE(deque_steal(deque) == &values[i]);
+  }
+  // The owner and thieves meet in the middle without handing anything out
+  // twice.
+  EXPECT_TRUE(deque_pop(deque) == &values[9]);
+  EXPECT_TRUE(deque_steal(deque) == &values[5]);
+  EXPECT_TRUE(deque_pop(deque) == &values[8]);
+  EXPECT_TRUE(deque_pop(deque) == &values[7]);
+  EXPECT_TRUE(deque_steal(deque) == &values[6]);
+  EXPECT_TRUE(deque_steal(deque) == 0);
+  EXPECT_TRUE(deque_pop(deque) == 0);
+}
+
+void test_full(Deque* deque) {
+  for (int i = 0; i < DEQUE_SIZE; ++i) {
+    EXPECT_TRUE(deque_push(deque, &values[i]));
+  }
+  EXPECT_TRUE(!deque_push(deque, &values[DEQUE_SIZE]));
+  // Stealing one frees up a slot.
+  EXPECT_TRUE(deque_steal(deque) == &values[0]);
+  EXPECT_TRUE(deque_push(deque, &values[DEQUE_SIZE]));
+  EXPECT_TRUE(deque_pop(deque) == &values[DEQUE_SIZE]);
+  for (int i = 1; i < DEQUE_SIZE; ++i) {
+    EXPECT_TRUE(deque_steal(deque) == &values[i]);
+  }
+  EXPECT_TRUE(deque_is_empty(deque));
+}
+
+// The counters only ever go up, so they eventually wrap.
+void test_wraparound() {
+  Deque deque;
+  memset(&deque, 0, sizeof(deque));
+  deque.top = deque.bottom = 0xFFFFFFF0;
+  for (int round = 0; round < 4; ++round) {
+    for (int i = 0; i < 20; ++i) {
+      EXPECT_TRUE(deque_push(&deque, &values[i]));
+    }
+    EXPECT_TRUE(deque_steal(&deque) == &values[0]);
+    for (int i = 19; i >= 1; --i) {
+      EXPECT_TRUE(deque_pop(&deque) == &values[i]);
+    }
+    EXPECT_TRUE(deque_pop(&deque) == 0);
+  }
+}
+
+int main() {
+  Deque deque;
+  memset(&deque, 0, sizeof(deque));
+  test_owner_is_lifo(&deque);
+  test_thieves_are_fifo(&deque);
+  test_full(&deque);
+  test_wraparound();
+  return test_result();
+}
@@ -1,6 +1,7 @@
 #include "fb.h"
 
 #include "io.h"
+#include "string.h"
 
 /* The I/O ports */
 #define FB_COMMAND_PORT         0x3D4
@@ -44,14 +45,9 @@ void fb_write_cell(unsigned short pos, char c, unsigned char fg, unsigned char b
 
 // Shift up one row. Does not change the cursor location.
 void shift_up() {
-  int row;
-  // First copy the first height - 1 rows from the next row.
-  for(row = 0; row < FB_HEIGHT - 1; ++row) {
-    // Since each cell is actually two bytes, col is half a cell.
-    for (int col = 0; col < FB_WIDTH * 2; ++col) {
-      fb[row * FB_WIDTH * 2 + col] = fb[(row + 1) * FB_WIDTH * 2 + col];
-    }
-  }
+  int row = FB_HEIGHT - 1;
+  // First move the last height - 1 rows up by one. Each cell is two bytes.
+  memmove(fb, fb + FB_WIDTH * 2, row * FB_WIDTH * 2);
   // Then clear the last row.
   for (int col = 0; col < FB_WIDTH; ++col) {
     int pos = row * FB_WIDTH + col;
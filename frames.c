@@ -0,0 +1,140 @@
+#include "frames.h"
+
+#include "log.h"
+
+// # Physical memory allocation
+// A binary buddy allocator over physical frames. Every frame has a Frame
+// struct in one big array, indexed by frame number. Free memory is kept as
+// blocks of 2^order frames that are aligned to their size, and the blocks of
+// each order are linked into a doubly linked free list through the Frame of
+// their first frame. The free memory itself is never touched, so nothing needs
+// to be mapped to manage it.
+//   - Allocating takes the head of the free list for the requested order, or
+//     else splits the smallest larger block, putting the unused halves on the
+//     lists below it.
+//   - Freeing checks whether the block's buddy (frame ^ (1 << order)) is the
+//     head of a free block of the same order, in which case the two are merged
+//     and the check repeats one order up.
+// All operations are O(FRAME_MAX_ORDER).
+
+#define FRAME_NONE 0xFFFFFFFF
+
+unsigned int frames_array_size(unsigned int num_frames) {
+  return num_frames * sizeof(Frame);
+}
+
+void frames_init(FrameAllocator* allocator, void* mem,
+                 unsigned int num_frames) {
+  allocator->frames = (Frame*)mem;
+  allocator->num_frames = num_frames;
+  allocator->num_free = 0;
+  for (int order = 0; order <= FRAME_MAX_ORDER; ++order) {
+    allocator->free_lists[order] = FRAME_NONE;
+  }
+  for (unsigned int i = 0; i < num_frames; ++i) {
+    allocator->frames[i].next = FRAME_NONE;
+    allocator->frames[i].prev = FRAME_NONE;
+    allocator->frames[i].order = 0;
+    allocator->frames[i].is_free = 0;
+    allocator->frames[i].reserved = 0;
+  }
+}
+
+void frames_list_push(FrameAllocator* allocator, unsigned int frame,
+                      unsigned int order) {
+  Frame* f = &allocator->frames[frame];
+  f->order = order;
+  f->is_free = 1;
+  f->prev = FRAME_NONE;
+  f->next = allocator->free_lists[order];
+  if (f->next != FRAME_NONE) {
+    allocator->frames[f->next].prev = frame;
+  }
+  allocator->free_lists[order] = frame;
+}
+
+void frames_list_remove(FrameAllocator* allocator, unsigned int frame) {
+  Frame* f = &allocator->frames[frame];
+  if (f->prev != FRAME_NONE) {
+    allocator->frames[f->prev].next = f->next;
+  } else {
+    allocator->free_lists[f->order] = f->next;
+  }
+  if (f->next != FRAME_NONE) {
+    allocator->frames[f->next].prev = f->prev;
+  }
+  f->next = FRAME_NONE;
+  f->prev = FRAME_NONE;
+  f->is_free = 0;
+}
+
+unsigned int frames_alloc(FrameAllocator* allocator, unsigned int order) {
+  if (order > FRAME_MAX_ORDER) {
+    LOG_HEX(ERROR, "Tried to allocate frames of unsupported order: ", order);
+    return 0;
+  }
+  unsigned int found_order = order;
+  while (found_order <= FRAME_MAX_ORDER &&
+         allocator->free_lists[found_order] == FRAME_NONE) {
+    ++found_order;
+  }
+  if (found_order > FRAME_MAX_ORDER) {
+    return 0;
+  }
+  unsigned int frame = allocator->free_lists[found_order];
+  frames_list_remove(allocator, frame);
+  // Give back the upper halves until the block is the right size.
+  while (found_order > order) {
+    --found_order;
+    frames_list_push(allocator, frame + (1u << found_order), found_order);
+  }
+  allocator->num_free -= 1u << order;
+  return frame << FRAME_BITS;
+}
+
+void frames_free(FrameAllocator* allocator, unsigned int paddr,
+                 unsigned int order) {
+  unsigned int frame = paddr >> FRAME_BITS;
+  if (order > FRAME_MAX_ORDER || (paddr & (FRAME_SIZE - 1)) ||
+      (frame & ((1u << order) - 1)) ||
+      frame + (1u << order) > allocator->num_frames) {
+    LOG_HEX(ERROR, "Tried to free an invalid block of frames: ", paddr);
+    return;
+  }
+  if (allocator->frames[frame].is_free) {
+    LOG_HEX(ERROR, "Frames were already freed: ", paddr);
+    return;
+  }
+  allocator->num_free += 1u << order;
+  while (order < FRAME_MAX_ORDER) {
+    unsigned int buddy = frame ^ (1u << order);
+    if (buddy >= allocator->num_frames || !allocator->frames[buddy].is_free ||
+        allocator->frames[buddy].order != order) {
+      break;
+    }
+    frames_list_remove(allocator, buddy);
+    frame &= ~(1u << order);
+    ++order;
+  }
+  frames_list_push(allocator, frame, order);
+}
+
+void frames_add_range(FrameAllocator* allocator, unsigned int start,
+                      unsigned int end) {
+  unsigned int frame = (start + FRAME_SIZE - 1) >> FRAME_BITS;
+  unsigned int end_frame = end >> FRAME_BITS;
+  if (end_frame > allocator->num_frames) {
+    end_frame = allocator->num_frames;
+  }
+  // Free the range as the largest aligned blocks that fit in it.
+  while (frame < end_frame) {
+    unsigned int order = 0;
+    while (order < FRAME_MAX_ORDER &&
+           !(frame & ((2u << order) - 1)) &&
+           frame + (2u << order) <= end_frame) {
+      ++order;
+    }
+    frames_free(allocator, frame << FRAME_BITS, order);
+    frame += 1u << order;
+  }
+}
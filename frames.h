@@ -0,0 +1,51 @@
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#define FRAME_SIZE 4096
+#define FRAME_BITS 12
+// Largest block of contiguous frames handed out at once, as log2 of the number
+// of frames. Order 10 blocks are 4MB, the size of a large page.
+#define FRAME_MAX_ORDER 10
+
+// Per-frame bookkeeping. Only meaningful for the first frame of a free block.
+// Frames are referred to by number (paddr >> FRAME_BITS) rather than pointer.
+typedef struct {
+  unsigned int next;
+  unsigned int prev;
+  unsigned char order;
+  unsigned char is_free;
+  unsigned short reserved;
+} Frame;
+
+// A buddy allocator for physical frames. See frames.c.
+typedef struct {
+  Frame* frames;
+  unsigned int num_frames;
+  unsigned int free_lists[FRAME_MAX_ORDER + 1];
+  unsigned int num_free;  // In frames.
+} FrameAllocator;
+
+// Number of bytes of memory frames_init() needs to manage num_frames frames.
+unsigned int frames_array_size(unsigned int num_frames);
+
+// Sets up an allocator for the physical frames [0, num_frames), all of which
+// start out in use, using the frames_array_size() bytes at mem for
+// bookkeeping.
+void frames_init(FrameAllocator* allocator, void* mem, unsigned int num_frames);
+
+// Frees all the frames in [start, end), which don't need to be aligned to
+// anything beyond a frame. Frame 0 must never be freed, since 0 is used to
+// signal allocation failure.
+void frames_add_range(FrameAllocator* allocator, unsigned int start,
+                      unsigned int end);
+
+// Allocates 2^order physically contiguous frames, aligned to their size.
+// Returns the physical address of the first frame, or 0 if no block of that
+// size is available.
+unsigned int frames_alloc(FrameAllocator* allocator, unsigned int order);
+
+// Frees a block returned by frames_alloc(), merging it with its neighbours.
+void frames_free(FrameAllocator* allocator, unsigned int paddr,
+                 unsigned int order);
+
+#endif  // FRAMES_H
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "frames.h"
+#include "log.h"
+#include "test.h"
+
+// frames.c logs errors through log.h, which on the host just goes to stdout.
+void log_message(int level, const char* filename, int line, const char* text) {
+  printf("%d:%s:%d:%s\n", level, filename, line, text);
+}
+
+void log_int(int level, const char* filename, int line, const char* text,
+             int i) {
+  printf("%d:%s:%d:%s%d\n", level, filename, line, text, i);
+}
+
+void log_hex(int level, const char* filename, int line, const char* text,
+             unsigned int i) {
+  printf("%d:%s:%d:%s0x%08X\n", level, filename, line, text, i);
+}
+
+// No rate limits on the host.
+int log_allow(LogLimit* limit, int level, const char* filename,
+              const char* text, unsigned int value) {
+  limit = limit;
+  level = level;
+  filename = filename;
+  text = text;
+  value = value;
+  return 1;
+}
+
+#define NUM_FRAMES 8192  // 32MB
+
+void test_alloc_and_coalesce(FrameAllocator* allocator) {
+  unsigned int before = allocator->num_free;
+  unsigned int a = frames_alloc(allocator, 0);
+  unsigned int b = frames_alloc(allocator, 0);
+  EXPECT_TRUE(a && b && a != b);
+  EXPECT_TRUE(allocator->num_free == before - 2);
+  frames_free(allocator, a, 0);
+  frames_free(allocator, b, 0);
+  EXPECT_TRUE(allocator->num_free == before);
+  // Freeing both should have merged everything back, so a 4MB block is still
+  // available from the same place.
+  unsigned int big = frames_alloc(allocator, FRAME_MAX_ORDER);
+  EXPECT_TRUE(big != 0);
+  EXPECT_TRUE((big & ((FRAME_SIZE << FRAME_MAX_ORDER) - 1)) == 0);
+  frames_free(allocator, big, FRAME_MAX_ORDER);
+}
+
+void test_contiguous_and_aligned(FrameAllocator* allocator) {
+  for (unsigned int order = 0; order <= FRAME_MAX_ORDER; ++order) {
+    unsigned int paddr = frames_alloc(allocator, order);
+    EXPECT_TRUE(paddr != 0);
+    EXPECT_TRUE((paddr & ((FRAME_SIZE << order) - 1)) == 0);
+    frames_free(allocator, paddr, order);
+  }
+}
+
+void test_exhaustion(FrameAllocator* allocator) {
+  unsigned int num_free = allocator->num_free;
+  unsigned int* frames = malloc(num_free * sizeof(unsigned int));
+  for (unsigned int i = 0; i < num_free; ++i) {
+    frames[i] = frames_alloc(allocator, 0);
+    EXPECT_TRUE(frames[i] != 0);
+  }
+  EXPECT_TRUE(frames_alloc(allocator, 0) == 0);
+  EXPECT_TRUE(allocator->num_free == 0);
+  // Free every other frame: nothing can merge, so no 8kb block exists.
+  for (unsigned int i = 0; i < num_free; i += 2) {
+    frames_free(allocator, frames[i], 0);
+  }
+  EXPECT_TRUE(frames_alloc(allocator, 1) == 0);
+  for (unsigned int i = 1; i < num_free; i += 2) {
+    frames_free(allocator, frames[i], 0);
+  }
+  EXPECT_TRUE(allocator->num_free == num_free);
+  unsigned int big = frames_alloc(allocator, FRAME_MAX_ORDER);
+  EXPECT_TRUE(big != 0);
+  frames_free(allocator, big, FRAME_MAX_ORDER);
+  free(frames);
+}
+
+int main() {
+  void* mem = malloc(frames_array_size(NUM_FRAMES));
+  FrameAllocator allocator;
+  frames_init(&allocator, mem, NUM_FRAMES);
+  // A memory map with a hole for the kernel, like the one built at boot.
+  frames_add_range(&allocator, 0x1000, 0x9F000);
+  frames_add_range(&allocator, 0x200000, NUM_FRAMES * FRAME_SIZE);
+  EXPECT_TRUE(allocator.num_free == (0x9F000 - 0x1000) / FRAME_SIZE +
+                                        NUM_FRAMES - 0x200000 / FRAME_SIZE);
+  // Nothing outside the ranges ever gets handed out.
+  unsigned int paddr = frames_alloc(&allocator, 0);
+  EXPECT_TRUE(paddr >= 0x1000);
+  EXPECT_TRUE(paddr < 0x9F000 || paddr >= 0x200000);
+  frames_free(&allocator, paddr, 0);
+
+  test_alloc_and_coalesce(&allocator);
+  test_contiguous_and_aligned(&allocator);
+  test_exhaustion(&allocator);
+  free(mem);
+  return test_result();
+}
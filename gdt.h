@@ -17,4 +17,7 @@ typedef struct __attribute__((packed)) {
 
 void lgdt(GDTSpec* gdt);
 
+// Loads the task register with tss and gs with per_cpu. See gdt.s.
+void load_cpu_selectors(unsigned short tss, unsigned short per_cpu);
+
 #endif  // GDT_H
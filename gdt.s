@@ -19,3 +19,16 @@ lgdt:
   jmp 0x08:flush_cs
   flush_cs:
   ret
+
+global load_cpu_selectors
+
+; load_cpu_selectors - loads the task register and points gs at the per-CPU
+; data, once the GDT with both of their descriptors is loaded.
+;   [esp+8] the per-CPU data segment selector
+;   [esp+4] the TSS selector
+load_cpu_selectors:
+  mov ax, [esp + 4]
+  ltr ax
+  mov ax, [esp + 8]
+  mov gs, ax
+  ret
@@ -0,0 +1,35 @@
+#include "idle.h"
+
+#include "deferred.h"
+#include "interrupts.h"
+#include "paging.h"
+#include "thread.h"
+
+// How much deferred work to run before checking whether we're done idling.
+#define IDLE_DEFERRED_BATCH 16
+
+// Does a small piece of background work, starting with whatever IRQ handlers
+// left behind. Returns 0 if there wasn't any left.
+int idle_work() {
+  return run_deferred_work(IDLE_DEFERRED_BATCH) != 0 ||
+         refill_zeroed_frames(1) != 0;
+}
+
+void idle_until(int (*ready)()) {
+  cli();
+  while (!ready()) {
+    sti();
+    int did_work = idle_work();
+    cli();
+    if (should_yield()) {
+      // Let another thread have the CPU while we wait, rather than halting
+      // until something preempts us.
+      yield();
+    } else if (!did_work) {
+      // Comes back with interrupts enabled once one has been handled.
+      halt_until_interrupt();
+      cli();
+    }
+  }
+  sti();
+}
@@ -0,0 +1,11 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+// Waits until ready() returns non-zero, doing background work (like deferred
+// work from IRQs, or zeroing frames for alloc_zeroed_frame()) in the meantime
+// and halting the CPU once there's none left. ready() is called with
+// interrupts disabled, so a wakeup can't slip in between checking it and
+// halting.
+void idle_until(int (*ready)());
+
+#endif  // IDLE_H
@@ -1,11 +1,17 @@
 #include "interrupts.h"
 
-#include "fb.h"
+#include "apic.h"
 #include "io.h"
-#include "keyboard.h"
 #include "log.h"
 #include "pic8259.h"
+#include "serial.h"
 #include "string.h"
+#include "trace.h"
+#include "user.h"
+
+#define NUM_VECTORS 256
+// Vectors below this are CPU exceptions.
+#define NUM_EXCEPTIONS 32
 
 typedef struct __attribute__((packed)) {
   unsigned short size;  // in bytes, not descriptors
@@ -19,164 +25,267 @@ typedef struct __attribute__((packed)) {
   unsigned short offset_high;
 } InterruptDescriptor;
 
-InterruptDescriptor idt[48];
+InterruptDescriptor idt[NUM_VECTORS];
 
-typedef struct __attribute__((packed)) {
-  unsigned int eax;
-  unsigned int ebx;
-  unsigned int ecx;
-  unsigned int edx;
-  unsigned int esi;
-  unsigned int edi;
-  unsigned int ebp;
-  unsigned int esp;
-} CpuState;
+// The stubs for every vector, see interrupts_asm.s.
+extern unsigned int interrupt_stub_table[NUM_VECTORS];
+extern unsigned int irq_stub_table[NUM_VECTORS];
 
-typedef struct __attribute__((packed)) {
-  unsigned int error_code;
-  unsigned int eip;
-  unsigned int cs;
-  unsigned int eflags;
-} StackState;
+typedef struct {
+  InterruptHandler fn;
+  void* ctx;
+} InterruptHandlerEntry;
+
+// The irq stubs call straight through this table, so its layout has to match
+// the offsets in interrupts_asm.s.
+typedef struct {
+  IrqHandler fn;
+  void* ctx;
+} IrqHandlerEntry;
+
+InterruptHandlerEntry interrupt_handlers[NUM_VECTORS];
+IrqHandlerEntry irq_handlers[NUM_VECTORS];
+
+#define LATENCY_BUCKETS 32
+
+typedef struct {
+  unsigned int count;
+  unsigned int max_cycles;
+  unsigned long long total_cycles;
+  // Bucket i counts the interrupts that took [2^i, 2^(i+1)) cycles, with
+  // anything over 2^32 cycles in the last one.
+  unsigned int latency_histogram[LATENCY_BUCKETS];
+} InterruptStats;
+
+InterruptStats interrupt_stats[NUM_VECTORS];
 
-void populate_interrupt_descriptor(InterruptDescriptor* id, unsigned int fn_addr) {
+// Legacy IRQs that have been enabled with enable_irq(), one bit each.
+unsigned int enabled_irqs = 0;
+// Set once init_apic_interrupts() has moved IRQs off the 8259.
+int using_apic = 0;
+
+// Vectors without a handler that have already been logged, one bit each. A
+// stuck or spurious interrupt would otherwise flood the serial port.
+unsigned int unhandled_logged[NUM_VECTORS / 32];
+
+void populate_interrupt_descriptor(InterruptDescriptor* id, unsigned int fn_addr,
+                                   unsigned int vector) {
   id->offset_low = fn_addr & 0xFFFF;
   id->offset_high = (fn_addr >> 16) & 0xFFFF;
   // 0b1000  Present in memory, 0 privilege, constant (0)
   // 0b1111  32 bit trap gate (doesn't prevent other interrupts by default)
+  //   or
+  // 0b1110  32 bit interrupt gate (disables interrupts until the iret)
   // 0b00000000  Constant/reserved
-  id->flags = 0x8F00;
+  // Exceptions are trap gates, but IRQ handlers shouldn't be interrupted by
+  // another IRQ halfway through, or by themselves before they've acked. Page
+  // faults are the exception, since CR2 has to be read before an IRQ can
+  // switch threads (and let another thread fault).
+  int trap = vector < NUM_EXCEPTIONS && vector != PAGE_FAULT_VECTOR;
+  id->flags = trap ? 0x8F00 : 0x8E00;
   id->segment = 0x0008;
 }
 
+// Points a vector's IDT entry at one of its stubs. The entry can't be written
+// in one go, so interrupts stay off until it's consistent again.
+void set_interrupt_stub(unsigned int vector, unsigned int fn_addr) {
+  unsigned int eflags = irq_save();
+  populate_interrupt_descriptor(&idt[vector], fn_addr, vector);
+  irq_restore(eflags);
+}
+
+void register_interrupt_handler(unsigned int vector, InterruptHandler handler,
+                                void* ctx) {
+  if (vector >= NUM_VECTORS) {
+    LOG_HEX(ERROR, "Tried to register a handler for invalid vector ", vector);
+    return;
+  }
+  interrupt_handlers[vector].fn = handler;
+  interrupt_handlers[vector].ctx = ctx;
+  set_interrupt_stub(vector, interrupt_stub_table[vector]);
+}
+
+void register_irq_handler(unsigned int vector, IrqHandler handler, void* ctx) {
+  if (vector >= NUM_VECTORS) {
+    LOG_HEX(ERROR, "Tried to register a handler for invalid vector ", vector);
+    return;
+  }
+  // Filled in before the stub that reads it is installed.
+  irq_handlers[vector].fn = handler;
+  irq_handlers[vector].ctx = ctx;
+  set_interrupt_stub(vector, irq_stub_table[vector]);
+}
+
+void set_interrupt_user_callable(unsigned int vector) {
+  if (vector >= NUM_VECTORS) {
+    LOG_HEX(ERROR, "Tried to open up invalid vector ", vector);
+    return;
+  }
+  // The gate's DPL, in bits 13-14 of the flags, is the least privileged ring
+  // that can use int on it.
+  idt[vector].flags |= 0x6000;
+}
+
+void enable_irq(unsigned int irq) {
+  if (irq >= 16) {
+    LOG_INT(ERROR, "Tried to enable an IRQ the 8259 doesn't have: ", irq);
+    return;
+  }
+  enabled_irqs |= 1u << irq;
+  if (using_apic) {
+    ioapic_enable_irq(irq, IRQ_VECTOR(irq));
+    return;
+  }
+  unsigned int mask = ~enabled_irqs;
+  if (enabled_irqs & 0xFF00) {
+    mask &= ~(1u << 2);  // The second 8259 is cascaded through IRQ 2.
+  }
+  PicSetMask(mask & 0xFF, (mask >> 8) & 0xFF);
+}
+
+int apic_interrupts_enabled() {
+  return using_apic;
+}
+
+void ack_irq(unsigned int vector) {
+  if (using_apic) {
+    lapic_eoi();
+  } else {
+    PicAck(vector);
+  }
+}
+
+void init_apic_interrupts() {
+  cli();
+  if (init_apic()) {
+    PicSetMask(0xFF, 0xFF);
+    using_apic = 1;
+    for (unsigned int irq = 0; irq < 16; ++irq) {
+      if (enabled_irqs & (1u << irq)) {
+        ioapic_enable_irq(irq, IRQ_VECTOR(irq));
+      }
+    }
+    LOG(INFO, "IRQs are now delivered through the IOAPIC.");
+  }
+  sti();
+}
+
 // See interrupts_asm.s
-extern void interrupt_handler_0();
-extern void interrupt_handler_1();
-extern void interrupt_handler_2();
-extern void interrupt_handler_3();
-extern void interrupt_handler_4();
-extern void interrupt_handler_5();
-extern void interrupt_handler_6();
-extern void interrupt_handler_7();
-extern void interrupt_handler_8();
-extern void interrupt_handler_9();
-extern void interrupt_handler_10();
-extern void interrupt_handler_11();
-extern void interrupt_handler_12();
-extern void interrupt_handler_13();
-extern void interrupt_handler_14();
-extern void interrupt_handler_15();
-extern void interrupt_handler_16();
-extern void interrupt_handler_17();
-extern void interrupt_handler_18();
-extern void interrupt_handler_19();
-extern void interrupt_handler_20();
-extern void interrupt_handler_21();
-extern void interrupt_handler_22();
-extern void interrupt_handler_23();
-extern void interrupt_handler_24();
-extern void interrupt_handler_25();
-extern void interrupt_handler_26();
-extern void interrupt_handler_27();
-extern void interrupt_handler_28();
-extern void interrupt_handler_29();
-extern void interrupt_handler_30();
-extern void interrupt_handler_31();
-extern void interrupt_handler_32();
-extern void interrupt_handler_33();
-extern void interrupt_handler_34();
-extern void interrupt_handler_35();
-extern void interrupt_handler_36();
-extern void interrupt_handler_37();
-extern void interrupt_handler_38();
-extern void interrupt_handler_39();
-extern void interrupt_handler_40();
-extern void interrupt_handler_41();
-extern void interrupt_handler_42();
-extern void interrupt_handler_43();
-extern void interrupt_handler_44();
-extern void interrupt_handler_45();
-extern void interrupt_handler_46();
-extern void interrupt_handler_47();
 extern void load_idt(IDTSpec* idt);
-extern int reg_cr2();
-
-void interrupt_handler(CpuState cpu, unsigned int interrupt, StackState stack) {
-  cpu.eax = cpu.eax;
-  stack.error_code = stack.error_code;
-  interrupt = interrupt;
-  switch (interrupt) {
-    case 0x0E:  // page fault
-      LOG_HEX(ERROR, "Page fault accessing ", reg_cr2());
-      LOG_HEX(ERROR, "Error codes: ", stack.error_code);
-      magic_bp();
-      break;
-    case 0x21:  // keyboard
-      PushScancode();
-      PicAck(0x21);
-      break;
-    default:
-      LOG_HEX(INFO, "interrupt#: ", interrupt);
+
+// Called on the way out of every interrupt with the rdtsc from when it came in.
+void record_interrupt(unsigned int interrupt, unsigned long long start) {
+  unsigned long long elapsed = rdtsc() - start;
+  unsigned int cycles = (elapsed >> 32) ? 0xFFFFFFFF : (unsigned int)elapsed;
+  InterruptStats* stats = &interrupt_stats[interrupt];
+  ++stats->count;
+  stats->total_cycles += elapsed;
+  if (cycles > stats->max_cycles) {
+    stats->max_cycles = cycles;
   }
+  ++stats->latency_histogram[cycles ? 31 - __builtin_clz(cycles) : 0];
+  trace(TRACE_IRQ, interrupt, cycles);
+}
+
+// The average of total / count, without the 64-bit division we don't have.
+// Drops precision from both until the total fits in 32 bits.
+unsigned int average_cycles(InterruptStats* stats) {
+  unsigned long long total = stats->total_cycles;
+  unsigned int count = stats->count;
+  while (total >> 32) {
+    total >>= 1;
+    count >>= 1;
+  }
+  return count ? (unsigned int)total / count : 0xFFFFFFFF;
+}
+
+void dump_interrupt_stats() {
+  LOG(INFO, "Interrupt stats (cycles):");
+  for (unsigned int vector = 0; vector < NUM_VECTORS; ++vector) {
+    // Snapshot it, since the vector might fire while we're logging.
+    InterruptStats stats = interrupt_stats[vector];
+    if (!stats.count) {
+      continue;
+    }
+    LOG_DUMP_HEX(INFO, "  vector: ", vector);
+    LOG_DUMP_INT(INFO, "    count: ", stats.count);
+    LOG_DUMP_INT(INFO, "    average: ", average_cycles(&stats));
+    LOG_DUMP_HEX(INFO, "    max: ", stats.max_cycles);
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+      if (stats.latency_histogram[bucket]) {
+        // "    < 2^NN: "
+        char label[24] = "    < 2^";
+        int_to_dec(bucket + 1, label + 8);
+        unsigned int end = strlen(label);
+        label[end] = ':';
+        label[end + 1] = ' ';
+        label[end + 2] = 0;
+        LOG_DUMP_INT(INFO, label, stats.latency_histogram[bucket]);
+      }
+    }
+  }
+}
+
+int from_user_mode(InterruptFrame* frame) {
+  return (frame->cs & 3) == 3;
+}
+
+void unhandled_interrupt(InterruptFrame* frame) {
+  unsigned int interrupt = frame->interrupt;
+  if (interrupt < NUM_EXCEPTIONS && from_user_mode(frame)) {
+    user_fault(frame);
+  }
+  if (interrupt < NUM_EXCEPTIONS) {
+    // Returning would just run into the same exception again.
+    serial_panic();
+    LOG_HEX(ERROR, "Unhandled exception#: ", interrupt);
+    LOG_HEX(ERROR, "Error code: ", frame->error_code);
+    LOG_HEX(ERROR, "eip: ", frame->eip);
+    trace_dump();
+    magic_bp();
+    return;
+  }
+  if (!(unhandled_logged[interrupt >> 5] & (1u << (interrupt & 31)))) {
+    unhandled_logged[interrupt >> 5] |= 1u << (interrupt & 31);
+    LOG_HEX(INFO, "Unhandled interrupt#: ", interrupt);
+  }
+  // The interrupt controller won't send anything else at or below this
+  // priority until it's acked, so ack it even though nobody wanted it.
+  if (interrupt != APIC_SPURIOUS_VECTOR) {
+    ack_irq(interrupt);
+  }
+}
+
+void interrupt_handler(InterruptFrame* frame) {
+  unsigned long long start = rdtsc();
+  // Saved up front, since a handler is allowed to change the frame.
+  unsigned int interrupt = frame->interrupt;
+  InterruptHandlerEntry* entry = &interrupt_handlers[interrupt];
+  if (entry->fn) {
+    entry->fn(frame, entry->ctx);
+  } else {
+    unhandled_interrupt(frame);
+  }
+  record_interrupt(interrupt, start);
 }
 
 void init_interrupts() {
   cli();  // disable interrupts
   PicInit();
-  PicSetMask(0xFD, 0xFF);
-
-  populate_interrupt_descriptor(&idt[0], (unsigned int)interrupt_handler_0);
-  populate_interrupt_descriptor(&idt[1], (unsigned int)interrupt_handler_1);
-  populate_interrupt_descriptor(&idt[2], (unsigned int)interrupt_handler_2);
-  populate_interrupt_descriptor(&idt[3], (unsigned int)interrupt_handler_3);
-  populate_interrupt_descriptor(&idt[4], (unsigned int)interrupt_handler_4);
-  populate_interrupt_descriptor(&idt[5], (unsigned int)interrupt_handler_5);
-  populate_interrupt_descriptor(&idt[6], (unsigned int)interrupt_handler_6);
-  populate_interrupt_descriptor(&idt[7], (unsigned int)interrupt_handler_7);
-  populate_interrupt_descriptor(&idt[8], (unsigned int)interrupt_handler_8);
-  populate_interrupt_descriptor(&idt[9], (unsigned int)interrupt_handler_9);
-  populate_interrupt_descriptor(&idt[10], (unsigned int)interrupt_handler_10);
-  populate_interrupt_descriptor(&idt[11], (unsigned int)interrupt_handler_11);
-  populate_interrupt_descriptor(&idt[12], (unsigned int)interrupt_handler_12);
-  populate_interrupt_descriptor(&idt[13], (unsigned int)interrupt_handler_13);
-  populate_interrupt_descriptor(&idt[14], (unsigned int)interrupt_handler_14);
-  populate_interrupt_descriptor(&idt[15], (unsigned int)interrupt_handler_15);
-  populate_interrupt_descriptor(&idt[16], (unsigned int)interrupt_handler_16);
-  populate_interrupt_descriptor(&idt[17], (unsigned int)interrupt_handler_17);
-  populate_interrupt_descriptor(&idt[18], (unsigned int)interrupt_handler_18);
-  populate_interrupt_descriptor(&idt[19], (unsigned int)interrupt_handler_19);
-  populate_interrupt_descriptor(&idt[20], (unsigned int)interrupt_handler_20);
-  populate_interrupt_descriptor(&idt[21], (unsigned int)interrupt_handler_21);
-  populate_interrupt_descriptor(&idt[22], (unsigned int)interrupt_handler_22);
-  populate_interrupt_descriptor(&idt[23], (unsigned int)interrupt_handler_23);
-  populate_interrupt_descriptor(&idt[24], (unsigned int)interrupt_handler_24);
-  populate_interrupt_descriptor(&idt[25], (unsigned int)interrupt_handler_25);
-  populate_interrupt_descriptor(&idt[26], (unsigned int)interrupt_handler_26);
-  populate_interrupt_descriptor(&idt[27], (unsigned int)interrupt_handler_27);
-  populate_interrupt_descriptor(&idt[28], (unsigned int)interrupt_handler_28);
-  populate_interrupt_descriptor(&idt[29], (unsigned int)interrupt_handler_29);
-  populate_interrupt_descriptor(&idt[30], (unsigned int)interrupt_handler_30);
-  populate_interrupt_descriptor(&idt[31], (unsigned int)interrupt_handler_31);
-  populate_interrupt_descriptor(&idt[32], (unsigned int)interrupt_handler_32);
-  populate_interrupt_descriptor(&idt[33], (unsigned int)interrupt_handler_33);
-  populate_interrupt_descriptor(&idt[34], (unsigned int)interrupt_handler_34);
-  populate_interrupt_descriptor(&idt[35], (unsigned int)interrupt_handler_35);
-  populate_interrupt_descriptor(&idt[36], (unsigned int)interrupt_handler_36);
-  populate_interrupt_descriptor(&idt[37], (unsigned int)interrupt_handler_37);
-  populate_interrupt_descriptor(&idt[38], (unsigned int)interrupt_handler_38);
-  populate_interrupt_descriptor(&idt[39], (unsigned int)interrupt_handler_39);
-  populate_interrupt_descriptor(&idt[40], (unsigned int)interrupt_handler_40);
-  populate_interrupt_descriptor(&idt[41], (unsigned int)interrupt_handler_41);
-  populate_interrupt_descriptor(&idt[42], (unsigned int)interrupt_handler_42);
-  populate_interrupt_descriptor(&idt[43], (unsigned int)interrupt_handler_43);
-  populate_interrupt_descriptor(&idt[44], (unsigned int)interrupt_handler_44);
-  populate_interrupt_descriptor(&idt[45], (unsigned int)interrupt_handler_45);
-  populate_interrupt_descriptor(&idt[46], (unsigned int)interrupt_handler_46);
-  populate_interrupt_descriptor(&idt[47], (unsigned int)interrupt_handler_47);
+  PicSetMask(0xFF, 0xFF);  // Until somebody calls enable_irq().
+
+  for (unsigned int vector = 0; vector < NUM_VECTORS; ++vector) {
+    populate_interrupt_descriptor(&idt[vector], interrupt_stub_table[vector],
+                                  vector);
+  }
 
+  load_interrupt_table();
+  sti();  // enable interrupts
+}
+
+void load_interrupt_table() {
   IDTSpec idt_spec;
   idt_spec.address = (unsigned int)idt;
   idt_spec.size = sizeof(idt);
   load_idt(&idt_spec);
-  sti();  // enable interrupts
 }
@@ -1,9 +1,105 @@
 #ifndef INTERRUPTS_H
 #define INTERRUPTS_H
 
+// The registers saved by the full interrupt stub, see interrupts_asm.s.
+typedef struct __attribute__((packed)) {
+  unsigned int eax;
+  unsigned int ebx;
+  unsigned int ecx;
+  unsigned int edx;
+  unsigned int esi;
+  unsigned int edi;
+  unsigned int ebp;
+  unsigned int esp;
+} CpuState;
+
+// Everything on the stack when a full interrupt handler runs: the saved
+// registers, what the stub pushed, and what the CPU pushed. Changes made here
+// are restored when the handler returns.
+typedef struct __attribute__((packed)) {
+  CpuState cpu;
+  unsigned int gs;
+  unsigned int es;
+  unsigned int ds;
+  unsigned int interrupt;
+  unsigned int error_code;
+  unsigned int eip;
+  unsigned int cs;
+  unsigned int eflags;
+  // Only there for interrupts from ring 3 (when cs & 3 is 3).
+  unsigned int user_esp;
+  unsigned int user_ss;
+} InterruptFrame;
+
+// Gets the interrupted state. For exceptions, syscalls and the like.
+typedef void (*InterruptHandler)(InterruptFrame* frame, void* ctx);
+
+// Doesn't get the interrupted state, which lets the stub skip saving most of
+// it. For device interrupts. IRQ handlers are responsible for calling
+// ack_irq().
+typedef void (*IrqHandler)(void* ctx);
+
+// Its handler starts with interrupts disabled, unlike other exceptions'.
+#define PAGE_FAULT_VECTOR 0x0E
+
+// Legacy IRQs are delivered on these vectors by both the 8259 and the IOAPIC.
+#define IRQ_VECTOR(irq) (0x20 + (irq))
+
+// Starts out with every IRQ masked on the 8259.
 void init_interrupts();
 
+// Points the running CPU at the IDT that init_interrupts() filled in, which
+// every CPU shares.
+void load_interrupt_table();
+
+// Moves IRQ delivery from the 8259 over to the local APIC and IOAPIC, if the
+// machine has them. Handlers don't need to know which is in use, as long as
+// they ack with ack_irq(). Needs paging, to reach the APICs' registers.
+void init_apic_interrupts();
+
+// Returns 1 once init_apic_interrupts() has switched to the APIC.
+int apic_interrupts_enabled();
+
+// Unmasks a legacy IRQ (numbered as on the 8259, e.g. 1 for the keyboard),
+// which is delivered on IRQ_VECTOR(irq).
+void enable_irq(unsigned int irq);
+
+// Tells the interrupt controller that the IRQ on this vector has been handled.
+// Nothing of the same or lower priority is delivered until it is.
+void ack_irq(unsigned int vector);
+
+// Installs the handler for a vector, replacing whatever was there. ctx is
+// passed back to the handler on every call. Vectors without a handler just
+// get logged the first time they fire, or halt if they're exceptions.
+void register_interrupt_handler(unsigned int vector, InterruptHandler handler,
+                                void* ctx);
+void register_irq_handler(unsigned int vector, IrqHandler handler, void* ctx);
+
+// Lets ring 3 raise vector with int, e.g. for system calls. Call it after
+// registering the handler, which resets it.
+void set_interrupt_user_callable(unsigned int vector);
+
+// Returns 1 if the interrupt came in from ring 3.
+int from_user_mode(InterruptFrame* frame);
+
+// Logs how many times each vector has fired and how long its handlers took,
+// in rdtsc cycles: the average, the max and a log2 histogram.
+void dump_interrupt_stats();
+
 void sti();
 void cli();
 
+// Disables interrupts, returning the old EFLAGS for irq_restore(), which puts
+// them back the way they were. Unlike cli()/sti() these nest.
+unsigned int irq_save();
+void irq_restore(unsigned int eflags);
+
+// Enables interrupts and halts until the next one arrives. Interrupts can't
+// be taken in between the two, so checking for work with interrupts disabled
+// and then calling this can't miss a wakeup.
+void halt_until_interrupt();
+
+// The address that caused the last page fault.
+unsigned int reg_cr2();
+
 #endif  // INTERRUPTS_H
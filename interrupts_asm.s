@@ -1,21 +1,48 @@
-%macro no_error_code_interrupt_handler 1
-global interrupt_handler_%1
-interrupt_handler_%1:
-  push    dword 0                     ; push 0 as error code
-  push    dword %1                    ; push the interrupt number
-  jmp     common_interrupt_handler    ; jump to the common handler
-%endmacro
+; Every vector gets two stubs, both of which push the same (interrupt number,
+; error code) pair so the stack looks the same whichever one runs:
+;   - The full stub saves every register in a CpuState and hands the C
+;     dispatcher a pointer to the whole InterruptFrame (see interrupts.h).
+;     Exceptions and anything else that needs the interrupted state use it.
+;   - The irq stub only saves the registers C functions are allowed to clobber
+;     and calls the vector's IrqHandler straight out of irq_handlers, so a
+;     device interrupt is a single indirect call with no frame to build.
+; Every interrupt is timed with rdtsc and counted by record_interrupt(): the irq
+; stubs do it here, and interrupt_handler() does it for the full stubs. The irq
+; stubs then call deferred_irq_exit() to run whatever work the handler queued,
+; and thread_irq_exit() to switch threads if that made a more important one
+; runnable (or the time slice ran out).
+; init_interrupts() points every IDT entry at its full stub, and
+; register_irq_handler() switches a vector over to its irq stub.
+; Both kinds of stub save ds, es and gs, point ds and es at the kernel's data
+; segment and gs at the per-CPU data (see smp.h), since an interrupt from ring 3
+; arrives with whatever the user left in them.
 
-%macro error_code_interrupt_handler 1
-global interrupt_handler_%1
-interrupt_handler_%1:
-  push    dword %1                    ; push the interrupt number
-  jmp     common_interrupt_handler    ; jump to the common handler
-%endmacro
+; The CPU pushes an error code for these vectors, and we push a dummy 0 for
+; all the others.
+%define HAS_ERROR_CODE(v) ((v) == 8 || ((v) >= 10 && (v) <= 14) || (v) == 17 || (v) == 21 || (v) == 29 || (v) == 30)
 
 extern interrupt_handler
+extern irq_handlers
+extern record_interrupt
+extern deferred_irq_exit
+extern thread_irq_exit
+
+KERNEL_DATA_SELECTOR equ 0x10           ; see segmentation.h
+PER_CPU_SELECTOR     equ 0x30
 
 common_interrupt_handler:               ; the common parts of the generic interrupt handler
+  push    ds
+  push    es
+  push    gs
+  push    eax
+  mov     ax, KERNEL_DATA_SELECTOR
+  mov     ds, ax
+  mov     es, ax
+  mov     ax, PER_CPU_SELECTOR
+  mov     gs, ax
+  cld                                   ; C code assumes it, and iret restores it
+  pop     eax
+
   ; save the registers in a CpuState struct, see interrupts.h
   push    esp
   push    ebp
@@ -26,8 +53,10 @@ common_interrupt_handler:               ; the common parts of the generic interr
   push    ebx
   push    eax
 
-  ; call the C function
+  ; call the C function with a pointer to the InterruptFrame we just built
+  push    esp
   call    interrupt_handler
+  add     esp, 4
 
   ; restore the registers
   pop     eax
@@ -37,62 +66,88 @@ common_interrupt_handler:               ; the common parts of the generic interr
   pop     esi
   pop     edi
   pop     ebp
-  ; Don't need to pop esp, that's done below.
+  add     esp, 4                        ; Don't need to pop esp.
+  pop     gs
+  pop     es
+  pop     ds
 
-  ; pop esp, interrupt_number, and error_code
-  add     esp, 12
+  ; pop interrupt_number and error_code
+  add     esp, 8
 
   ; return to the code that got interrupted
   iret
 
-no_error_code_interrupt_handler 0
-no_error_code_interrupt_handler 1
-no_error_code_interrupt_handler 2
-no_error_code_interrupt_handler 3
-no_error_code_interrupt_handler 4
-no_error_code_interrupt_handler 5
-no_error_code_interrupt_handler 6
-no_error_code_interrupt_handler 7
-error_code_interrupt_handler    8
-no_error_code_interrupt_handler 9
-error_code_interrupt_handler    10
-error_code_interrupt_handler    11
-error_code_interrupt_handler    12
-error_code_interrupt_handler    13
-error_code_interrupt_handler    14
-no_error_code_interrupt_handler 15
-no_error_code_interrupt_handler 16
-error_code_interrupt_handler    17
-no_error_code_interrupt_handler 18
-no_error_code_interrupt_handler 19
-no_error_code_interrupt_handler 20
-no_error_code_interrupt_handler 21
-no_error_code_interrupt_handler 22
-no_error_code_interrupt_handler 23
-no_error_code_interrupt_handler 24
-no_error_code_interrupt_handler 25
-no_error_code_interrupt_handler 26
-no_error_code_interrupt_handler 27
-no_error_code_interrupt_handler 28
-no_error_code_interrupt_handler 29
-no_error_code_interrupt_handler 30
-no_error_code_interrupt_handler 31
-no_error_code_interrupt_handler 32
-no_error_code_interrupt_handler 33
-no_error_code_interrupt_handler 34
-no_error_code_interrupt_handler 35
-no_error_code_interrupt_handler 36
-no_error_code_interrupt_handler 37
-no_error_code_interrupt_handler 38
-no_error_code_interrupt_handler 39
-no_error_code_interrupt_handler 40
-no_error_code_interrupt_handler 41
-no_error_code_interrupt_handler 42
-no_error_code_interrupt_handler 43
-no_error_code_interrupt_handler 44
-no_error_code_interrupt_handler 45
-no_error_code_interrupt_handler 46
-no_error_code_interrupt_handler 47
+irq_return:                             ; the common tail of the irq stubs
+  add     esp, 4                        ; pop ctx
+  push    dword [esp + 32]              ; the interrupt number
+  call    record_interrupt              ; (interrupt number, entry time)
+  add     esp, 12                       ; pop both of those
+  call    deferred_irq_exit             ; run any work the handler queued
+  call    thread_irq_exit               ; maybe switch threads
+  pop     gs
+  pop     es
+  pop     ds
+  pop     edx
+  pop     ecx
+  pop     eax
+  add     esp, 8                        ; pop interrupt_number and error_code
+  iret
+
+%assign vector 0
+%rep 256
+interrupt_stub_ %+ vector:
+%if !HAS_ERROR_CODE(vector)
+  push    dword 0                     ; push 0 as error code
+%endif
+  push    dword vector                ; push the interrupt number
+  jmp     common_interrupt_handler    ; jump to the common handler
+
+irq_stub_ %+ vector:
+%if !HAS_ERROR_CODE(vector)
+  push    dword 0
+%endif
+  push    dword vector
+  push    eax                         ; the caller-saved registers
+  push    ecx
+  push    edx
+  push    ds
+  push    es
+  push    gs
+  mov     ax, KERNEL_DATA_SELECTOR
+  mov     ds, ax
+  mov     es, ax
+  mov     ax, PER_CPU_SELECTOR
+  mov     gs, ax
+  cld                                 ; C code assumes it, and iret restores it
+  rdtsc                               ; the entry time, for record_interrupt
+  push    edx
+  push    eax
+  push    dword [irq_handlers + vector * 8 + 4]  ; ctx
+  call    [irq_handlers + vector * 8]            ; fn
+  jmp     irq_return
+%assign vector vector + 1
+%endrep
+
+; Tables of the stub addresses, indexed by vector, that init_interrupts()
+; builds the IDT from.
+section .rodata
+global interrupt_stub_table
+interrupt_stub_table:
+%assign vector 0
+%rep 256
+  dd      interrupt_stub_ %+ vector
+%assign vector vector + 1
+%endrep
+
+global irq_stub_table
+irq_stub_table:
+%assign vector 0
+%rep 256
+  dd      irq_stub_ %+ vector
+%assign vector vector + 1
+%endrep
+
+section .text
 
 global  load_idt
 ; load_idt - Loads the interrupt descriptor table (IDT).
@@ -113,6 +168,25 @@ sti:
   sti ; enable interrupts
   ret
 
+global irq_save
+irq_save:
+  pushf       ; return the old eflags
+  pop eax
+  cli         ; and disable interrupts
+  ret
+
+global irq_restore
+irq_restore:
+  push dword [esp + 4]
+  popf        ; only re-enables interrupts if they were enabled before
+  ret
+
+global halt_until_interrupt
+halt_until_interrupt:
+  sti ; enable interrupts, which only takes effect after the next instruction
+  hlt ; so nothing can sneak in before we halt
+  ret
+
 global reg_cr2
 reg_cr2:
   mov eax, cr2
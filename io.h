@@ -14,4 +14,28 @@ void magic_bp();
 
 void invlpg(unsigned int vaddr);
 
+// Flushes all (non-global) TLB entries by reloading CR3.
+void flush_tlb();
+
+// Turns on SSE (without any support for saving its registers) if the CPU has
+// SSE2. Returns 1 if it did, 0 otherwise.
+int enable_sse();
+
+// Returns the CPU's time stamp counter.
+unsigned long long rdtsc();
+
+// Runs cpuid for the given leaf (with ecx = 0), storing eax, ebx, ecx and edx
+// in regs.
+void cpuid(unsigned int leaf, unsigned int regs[4]);
+
+unsigned long long rdmsr(unsigned int msr);
+void wrmsr(unsigned int msr, unsigned long long value);
+
+// For the body of spin-wait loops.
+void cpu_relax();
+
+unsigned int reg_cr0();
+unsigned int reg_cr3();
+unsigned int reg_cr4();
+
 #endif  // IO_H
@@ -29,3 +29,108 @@ invlpg:
     mov eax, [esp + 4]
     invlpg [eax]
     ret
+
+global flush_tlb
+
+flush_tlb:
+    mov eax, cr3
+    mov cr3, eax
+    ret
+
+global enable_sse
+
+; enable_sse - turns on SSE if the CPU has SSE2, returning 1 if it did and 0
+; otherwise.
+enable_sse:
+    push ebx            ; cpuid clobbers ebx, which is callee saved
+    mov eax, 1
+    cpuid
+    pop ebx
+    xor eax, eax
+    test edx, 1 << 26   ; SSE2
+    jz .done
+    mov ecx, cr0
+    and ecx, ~(1 << 2)  ; clear EM, no x87 emulation
+    or  ecx, 1 << 1     ; set MP
+    mov cr0, ecx
+    mov ecx, cr4
+    or  ecx, (1 << 9) | (1 << 10)  ; set OSFXSR and OSXMMEXCPT
+    mov cr4, ecx
+    mov eax, 1
+.done:
+    ret
+
+global rdtsc
+
+; rdtsc - returns the time stamp counter in edx:eax, which is where a 64-bit
+; return value goes anyway.
+rdtsc:
+    rdtsc
+    ret
+
+global cpuid
+
+; cpuid - runs cpuid for a leaf and stores eax, ebx, ecx and edx in that order.
+; stack: [esp + 8] pointer to 4 unsigned ints
+;        [esp + 4] the leaf
+;        [esp    ] return address
+cpuid:
+    push ebx
+    push edi
+    mov eax, [esp + 12]
+    mov edi, [esp + 16]
+    xor ecx, ecx
+    cpuid
+    mov [edi], eax
+    mov [edi + 4], ebx
+    mov [edi + 8], ecx
+    mov [edi + 12], edx
+    pop edi
+    pop ebx
+    ret
+
+global rdmsr
+
+; rdmsr - returns the model specific register in edx:eax.
+rdmsr:
+    mov ecx, [esp + 4]
+    rdmsr
+    ret
+
+global wrmsr
+
+; wrmsr - writes a 64-bit value to a model specific register.
+; stack: [esp + 12] the high 32 bits
+;        [esp + 8] the low 32 bits
+;        [esp + 4] the register
+;        [esp    ] return address
+wrmsr:
+    mov ecx, [esp + 4]
+    mov eax, [esp + 8]
+    mov edx, [esp + 12]
+    wrmsr
+    ret
+
+global cpu_relax
+
+; cpu_relax - hints to the CPU that we're in a spin-wait loop, which saves
+; power and gets out of the loop faster once the memory it's watching changes.
+cpu_relax:
+    pause
+    ret
+
+global reg_cr0
+global reg_cr3
+global reg_cr4
+
+reg_cr0:
+    mov eax, cr0
+    ret
+
+reg_cr3:
+    mov eax, cr3
+    ret
+
+reg_cr4:
+    mov eax, cr4
+    ret
@@ -1,7 +1,11 @@
-#include "io.h"
 #include "keyboard.h"
 
+#include "deferred.h"
+#include "interrupts.h"
+#include "io.h"
+
 #define KBD_DATA_PORT   0x60
+#define KEYBOARD_IRQ 1
 
 #define SCANCODE_BUFLEN 1024
 #define SCANCODE_BUFLEN_MASK (SCANCODE_BUFLEN-1)
@@ -374,11 +378,6 @@ char ShiftedScancodeToAscii(Scancode scancode) {
   }
 }
 
-void InitKeyboard() {
-  scancode_buffer_front = 0;
-  scancode_buffer_back = 0;
-}
-
 /** read_scan_code:
  *  Reads a scan code from the keyboard
  *
@@ -389,16 +388,32 @@ Scancode ReadScancode()
   return inb(KBD_DATA_PORT);
 }
 
-void PushScancode() {
+void PushScancode(unsigned int scancode) {
   // Check to see if we're going to overflow. If so, throw away a character.
   if (((scancode_buffer_back + 1) & SCANCODE_BUFLEN_MASK) ==
       scancode_buffer_front) {
     scancode_buffer_front = (scancode_buffer_front + 1) & SCANCODE_BUFLEN_MASK;
   }
-  scancode_ringbuffer[scancode_buffer_back] = ReadScancode();
+  scancode_ringbuffer[scancode_buffer_back] = scancode;
   scancode_buffer_back = (scancode_buffer_back + 1) & SCANCODE_BUFLEN_MASK;
 }
 
+// The controller only needs the scancode read. Putting it in the ring buffer
+// waits until interrupts are back on.
+void KeyboardInterrupt(void* ctx) {
+  ctx = ctx;
+  Scancode scancode = ReadScancode();
+  ack_irq(IRQ_VECTOR(KEYBOARD_IRQ));
+  defer_work(DEFERRED_HIGH, PushScancode, scancode);
+}
+
+void InitKeyboard() {
+  scancode_buffer_front = 0;
+  scancode_buffer_back = 0;
+  register_irq_handler(IRQ_VECTOR(KEYBOARD_IRQ), KeyboardInterrupt, 0);
+  enable_irq(KEYBOARD_IRQ);
+}
+
 Scancode PopScancode() {
   if (!HasScancode()) {
     return SCANCODE_NONE;
@@ -6,12 +6,13 @@
 // The data type used to store a scancode.
 typedef unsigned char Scancode;
 
-// Must be called before PushKey, PopKey, or HasKey.
+// Must be called before PushKey, PopKey, or HasKey. Installs the keyboard
+// interrupt handler and unmasks its IRQ.
 void InitKeyboard();
 
-// Pushes the current scancode into the ringbuf. Should only be called inside
-// the keyboard interrupt handler.
-void PushScancode();
+// Pushes a scancode read by the keyboard interrupt handler into the ringbuf.
+// Runs as deferred work, which is the ringbuf's only producer.
+void PushScancode(unsigned int scancode);
 Scancode PopScancode();
 int HasScancode();
 
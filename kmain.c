@@ -1,13 +1,23 @@
+#include "bench.h"
+#include "deferred.h"
 #include "fb.h"
+#include "idle.h"
 #include "interrupts.h"
 #include "io.h"
 #include "keyboard.h"
 #include "log.h"
 #include "multiboot.h"
 #include "paging.h"
-#include "segmentation.h"
+#include "profile.h"
 #include "serial.h"
+#include "smp.h"
 #include "stdio.h"
+#include "string.h"
+#include "syscall.h"
+#include "tasks.h"
+#include "thread.h"
+#include "timer.h"
+#include "user.h"
 
 void logo() {
   const char* logo_str =
@@ -50,15 +60,16 @@ void log_multiboot(multiboot_info_t* multiboot) {
   if (multiboot->flags & 0x40) {
     LOG_HEX(INFO, "MMAP_LENGTH: ", multiboot->mmap_length);
     LOG_HEX(INFO, "MMAP_ADDR: ", multiboot->mmap_addr);
+    char* mmap = (char*)phys_to_virt(multiboot->mmap_addr);
     unsigned int i = 0;
     while (i < multiboot->mmap_length) {
-      memory_map_t* addr = (memory_map_t*)(multiboot->mmap_addr + 0xC0000000 + i);
-      LOG_HEX(INFO, "size: ", addr->size);
-      LOG_HEX(INFO, "base_addr_low: ", addr->base_addr_low);
-      LOG_HEX(INFO, "base_addr_high: ", addr->base_addr_high);
-      LOG_HEX(INFO, "length_low: ", addr->length_low);
-      LOG_HEX(INFO, "length_high: ", addr->length_high);
-      LOG_HEX(INFO, "type: ", addr->type);
+      memory_map_t* addr = (memory_map_t*)(mmap + i);
+      LOG_DUMP_HEX(INFO, "size: ", addr->size);
+      LOG_DUMP_HEX(INFO, "base_addr_low: ", addr->base_addr_low);
+      LOG_DUMP_HEX(INFO, "base_addr_high: ", addr->base_addr_high);
+      LOG_DUMP_HEX(INFO, "length_low: ", addr->length_low);
+      LOG_DUMP_HEX(INFO, "length_high: ", addr->length_high);
+      LOG_DUMP_HEX(INFO, "type: ", addr->type);
       i += addr->size + 4;  // +4 because the size field does not include itself.
     }
   }
@@ -74,6 +85,16 @@ void log_kernel_location(KernelLocation kernel_location) {
 void test_malloc() {
   unsigned int* a = (unsigned int*)malloc(4096 * 20);
   LOG_HEX(INFO, "malloc'd vaddr a = ", a);
+  // Big blocks are demand paged: only the first page (touched by malloc's
+  // bookkeeping) should have a frame until we write to the others.
+  unsigned int a_page = (unsigned int)a & 0xFFFFF000;
+  if (translate_vaddr(a_page + 4096 * 10) != 0xFFFFFFFF) {
+    LOG(ERROR, "Expected an untouched malloc'd page to have no frame.");
+  }
+  a[4096 * 10 / sizeof(unsigned int)] = 0xC0FFEE;
+  if (translate_vaddr(a_page + 4096 * 10) == 0xFFFFFFFF) {
+    LOG(ERROR, "Expected a touched malloc'd page to have been faulted in.");
+  }
   unsigned int* b = (unsigned int*)malloc(2 * sizeof(unsigned int));
   LOG_HEX(INFO, "malloc'd vaddr b = ", b);
   free(a);
@@ -84,15 +105,131 @@ void test_malloc() {
   LOG(INFO, "free'd c");
   free(b);
   LOG(INFO, "free'd b");
+  // Small allocations are carved out of shared slab pages, so an object that
+  // was just freed should be handed straight back out.
+  unsigned int* d = (unsigned int*)malloc(100);
+  free(d);
+  unsigned int* e = (unsigned int*)malloc(100);
+  if (d != e) {
+    LOG(ERROR, "Expected the slab allocator to reuse a free'd object.");
+  }
+  free(e);
+
+  // Resizing keeps the contents, whether the block grows in place, moves or
+  // shrinks.
+  unsigned char* f = (unsigned char*)malloc(5000);
+  f[0] = 0xAB;
+  f[4999] = 0xCD;
+  f = (unsigned char*)realloc(f, 100000);
+  f[99999] = 0xEF;
+  f = (unsigned char*)realloc(f, 1000000);
+  if (f[0] != 0xAB || f[4999] != 0xCD || f[99999] != 0xEF) {
+    LOG(ERROR, "Expected realloc() to keep the contents of a growing block.");
+  }
+  f = (unsigned char*)realloc(f, 6000);
+  if (f[0] != 0xAB || f[4999] != 0xCD) {
+    LOG(ERROR, "Expected realloc() to keep the contents of a shrinking block.");
+  }
+  free(f);
+}
+
+Timer test_timer;
+int test_timer_fired = 0;
+
+void on_test_timer(void* ctx) {
+  *(int*)ctx = 1;
+}
+
+int has_test_timer_fired() {
+  return test_timer_fired;
+}
+
+void test_timers() {
+  unsigned long long start = now_ns();
+  start_timer(&test_timer, start + 10000000, on_test_timer, &test_timer_fired);
+  idle_until(has_test_timer_fired);
+  LOG_INT(INFO, "10ms timer fired after (ns): ",
+          (unsigned int)(now_ns() - start));
+}
+
+int test_thread_done = 0;
+
+void test_thread(void* arg) {
+  sleep_ns(5000000);
+  *(int*)arg = 1;
+}
+
+int has_test_thread_finished() {
+  return test_thread_done;
+}
+
+void test_threads() {
+  unsigned long long start = now_ns();
+  if (!thread_create("test", THREAD_PRIORITY_DEFAULT - 1, test_thread,
+                     &test_thread_done)) {
+    LOG(ERROR, "Couldn't start the test thread.");
+    return;
+  }
+  idle_until(has_test_thread_finished);
+  LOG_INT(INFO, "Thread that slept 5ms finished after (ns): ",
+          (unsigned int)(now_ns() - start));
+}
+
+unsigned int test_cpu_apic_ids[MAX_CPUS];
+
+// Runs on an AP. Reads its own ID through its per-CPU data.
+void record_cpu(void* arg) {
+  arg = arg;
+  Cpu* cpu = this_cpu();
+  test_cpu_apic_ids[cpu->index] = cpu->apic_id == lapic_id() ? cpu->apic_id
+                                                            : 0xFFFFFFFF;
+}
+
+void test_smp() {
+  for (unsigned int i = 1; i < num_cpus(); ++i) {
+    run_on_cpu(i, record_cpu, 0);
+  }
+  for (unsigned int i = 1; i < num_cpus(); ++i) {
+    while (!cpu_is_idle(i)) {
+      cpu_relax();
+    }
+    LOG_INT(INFO, "CPU ran work, index: ", i);
+    LOG_HEX(INFO, "       its APIC ID: ", test_cpu_apic_ids[i]);
+  }
+}
+
+void add_range(unsigned int begin, unsigned int end, void* arg) {
+  unsigned int sum = 0;
+  for (unsigned int i = begin; i < end; ++i) {
+    sum += i;
+  }
+  __atomic_add_fetch((unsigned int*)arg, sum, __ATOMIC_RELAXED);
+}
+
+void test_tasks() {
+  unsigned int sum = 0;
+  parallel_for(0, 100000, 1000, add_range, &sum);
+  if (sum != 100000u * 99999u / 2) {
+    LOG_INT(ERROR, "parallel_for got the wrong sum: ", sum);
+  } else {
+    LOG(INFO, "parallel_for got the right sum.");
+  }
 }
 
 int kmain(multiboot_info_t* multiboot, KernelLocation kernel_location) {
   serial_init();
-  init_segmentation();
+  string_use_sse(enable_sse());
+  init_boot_cpu();
   init_interrupts();
+  serial_init_interrupts();
   log_multiboot(multiboot);
   log_kernel_location(kernel_location);
   init_paging(multiboot, kernel_location);
+  init_apic_interrupts();
+  init_timers();
+  init_threads();
+  init_syscalls();
+  init_smp();
   InitKeyboard();
   fb_set_color(15, 0);
   fb_clear();
@@ -102,23 +239,60 @@ int kmain(multiboot_info_t* multiboot, KernelLocation kernel_location) {
 
   LOG(INFO, "help I'm trapped in a log factory.");
 
+#ifdef RUN_PROFILER
+  // Enough for about a minute of boot.
+  profile_start(60 * PROFILE_HZ);
+#endif
   test_malloc();
+  test_timers();
+  test_threads();
+  test_smp();
+  init_tasks();
+  test_tasks();
+#ifdef RUN_BENCHMARKS
+  run_benchmarks();
+#endif
+#ifdef RUN_PROFILER
+  profile_stop();
+  profile_dump();
+#endif
 
   if (multiboot->mods_count != 1) {
     LOG_HEX(ERROR, "Unexpected number of modules: ", multiboot->mods_count);
     return -1;
   }
 
-  module_t* module = (module_t*)(multiboot->mods_addr + 0xC0000000);
+  module_t* module = (module_t*)phys_to_virt(multiboot->mods_addr);
 
-  unsigned int (*program)(void) = (unsigned int (*)(void))map_module(module);
-  LOG_HEX(INFO, "HERE WE GO, INTO YONDER USER PROGRAM! ",
-          (unsigned int)program);
+  LOG_HEX(INFO, "HERE WE GO, INTO YONDER USER PROGRAM! ", module->mod_start);
   if (module->string) {
-    LOG(INFO, (char*)(module->string + 0xC0000000));
+    LOG(INFO, (char*)phys_to_virt(module->string));
+  }
+  unsigned int result;
+  if (run_user_program(module, &result)) {
+    LOG_HEX(INFO, "program result = ", result);
+  }
+
+  ZeroedFrameStats zeroed_stats = zeroed_frame_stats();
+  LOG_INT(INFO, "Zeroed frame pool hits: ", zeroed_stats.hits);
+  LOG_INT(INFO, "                misses: ", zeroed_stats.misses);
+  for (int priority = 0; priority < NUM_DEFERRED_PRIORITIES; ++priority) {
+    DeferredWorkStats deferred_stats = deferred_work_stats(priority);
+    LOG_INT(INFO, "Deferred work priority: ", priority);
+    LOG_INT(INFO, "  queued: ", deferred_stats.queued);
+    LOG_INT(INFO, "  run: ", deferred_stats.run);
+    LOG_INT(INFO, "  dropped: ", deferred_stats.dropped);
+    LOG_INT(INFO, "  max depth: ", deferred_stats.max_depth);
   }
-  unsigned int result = program();
-  LOG_HEX(INFO, "program result = ", result);
+  ThreadStats stats = thread_stats();
+  LOG_INT(INFO, "Thread switches: ", stats.switches);
+  LOG_INT(INFO, "    preemptions: ", stats.preemptions);
+  TaskStats spawn_stats = task_stats();
+  LOG_INT(INFO, "Tasks spawned: ", spawn_stats.spawned);
+  LOG_INT(INFO, "       stolen: ", spawn_stats.steals);
+  LOG_INT(INFO, "        parks: ", spawn_stats.parks);
+  LOG_INT(INFO, "      wakeups: ", spawn_stats.wakeups);
+  dump_interrupt_stats();
 
   while (1) {
     putc(getc());
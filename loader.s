@@ -2,7 +2,6 @@ global _start                   ; the entry symbol for ELF
 
 extern kmain           ; in kmain.c
 extern page_directory  ; in paging_asm.s
-extern os_page_table   ; in paging_asm.s
 
 extern kernel_physical_start  ; from link.ld
 extern kernel_physical_end
@@ -20,6 +19,7 @@ UPPER_HALF_OFFSET equ 0xC0000000
 LARGE_PAGE_SIZE   equ 0x400000
 PAGE_SIZE         equ 0x1000
 UPPER_HALF_INDEX  equ UPPER_HALF_OFFSET/LARGE_PAGE_SIZE
+LARGE_PAGE_PDE    equ 0x00000083     ; 0x83 makes it a present r/w 4MB page at physical 0
 
 section .bss
 align 4
@@ -34,28 +34,13 @@ align 4                         ; the code must be 4 byte aligned
 
 _start:                              ; the loader label (defined as entry point in linker script)
     ; First set up bare bones paging, where the 0th and the upper half page frames are pointed at 0.
-    lea eax, [os_page_table]         ; First we need to create the page table
-    sub eax, UPPER_HALF_OFFSET       ; [os_page_table] is the virtual addr so we need to subtract the virtual offset
-    mov ecx, 0x00000003              ; ecx will hold the physical address and PTE options
-                                     ; 0x03 makes it a 4kb read/write page
-    populate_page_table:
-        mov [eax], ecx               ; Add the entry to the page table
-        add eax, 4                   ; Increment our page table entry pointer to the next page table entry
-        add ecx, PAGE_SIZE           ; ... and our physical memory pointer/options by 4kb
-        cmp ecx, kernel_physical_end ; Continue until we've mapped through the kernel
-                                     ; The kernel is aligned to pages, so the 12 config bits shouldn't interfere with the CMP
-                                     ; TODO: This'll need to change if the kernel goes over 4MB (unlikely :P)
-        jl populate_page_table
-
-    lea ecx, [os_page_table]         ; Load the page table address so we can add it to the page directory
-    sub ecx, UPPER_HALF_OFFSET
-    or  ecx, 0x00000003              ; Set the config bits to say we're pointing at a r/w PTE
-
-    lea eax, [page_directory]        ; Now for the page directory
-    sub eax, UPPER_HALF_OFFSET       ; Same thing as the page table, still virtual
-    mov [eax], ecx                   ; Load the address of the page table + options
+    ; Both are single 4MB pages (PSE), so no page table is needed.
+    ; TODO: This'll need to change if the kernel goes over 4MB (unlikely :P)
+    lea eax, [page_directory]        ; Load the page directory
+    sub eax, UPPER_HALF_OFFSET       ; [page_directory] is the virtual addr so we need to subtract the virtual offset
+    mov [eax], dword LARGE_PAGE_PDE  ; Map the first 4MB of physical memory at 0
     add eax, (4 * UPPER_HALF_INDEX)  ; Also for the page frame that the kernel is in
-    mov [eax], ecx             
+    mov [eax], dword LARGE_PAGE_PDE
 
     lea eax, [page_directory]        ; Now put the physical address of the PD into cr3
     sub eax, UPPER_HALF_OFFSET
@@ -1,8 +1,11 @@
 #include "log.h"
 
 #include "fb.h"
+#include "io.h"
 #include "serial.h"
 #include "string.h"
+#include "timer.h"
+#include "trace.h"
 
 #ifdef LOG_TO_SCREEN
 void (*log_puts)(const char*) = &fb_puts;
@@ -57,3 +60,140 @@ void log_hex(int level, const char* filename, int line, const char* text,
   log_puts(hex);
   log_puts("\n");
 }
+
+#ifdef LOG_BINARY
+// # Binary messages
+// Each message is written as one record, all little endian:
+//   u8  LOG_RECORD_SYNC
+//   u16 the site's index in .log_sites
+//   u32 now_ns() / 1024, roughly microseconds since the timers started
+//   u32 the value, for LOG_INT and LOG_HEX sites
+//   u8  the length of the text, then the text itself, for sites whose text
+//       isn't a literal (and so isn't in kernel.elf)
+// A typical message comes to 11 bytes, instead of 50 to 100 of text. The sync
+// byte lets logdecode find its way back after garbage.
+
+#define LOG_RECORD_SYNC 0xA5
+#define LOG_MAX_TEXT 255
+
+// See link.ld.
+extern const LogSite log_sites_start[];
+
+void put_u32(unsigned char* out, unsigned int value) {
+  out[0] = value & 0xFF;
+  out[1] = (value >> 8) & 0xFF;
+  out[2] = (value >> 16) & 0xFF;
+  out[3] = (value >> 24) & 0xFF;
+}
+
+void log_binary(const LogSite* site, const char* text, unsigned int value) {
+  unsigned char record[1 + 2 + 4 + 4 + 1 + LOG_MAX_TEXT];
+  unsigned int id = site - log_sites_start;
+  unsigned int length = 0;
+  record[length++] = LOG_RECORD_SYNC;
+  record[length++] = id & 0xFF;
+  record[length++] = (id >> 8) & 0xFF;
+  put_u32(record + length, (unsigned int)(now_ns() >> 10));
+  length += 4;
+  if (site->kind != LOG_KIND_MESSAGE) {
+    put_u32(record + length, value);
+    length += 4;
+  }
+  if (!site->text) {
+    unsigned int text_length = strlen(text);
+    if (text_length > LOG_MAX_TEXT) {
+      text_length = LOG_MAX_TEXT;
+    }
+    record[length++] = text_length;
+    memcpy(record + length, text, text_length);
+    length += text_length;
+  }
+  // In one write, so messages from different CPUs don't get mixed up.
+  serial_write((const char*)record, length);
+}
+#endif  // LOG_BINARY
+
+// # Levels and rate limits
+// Each site looks its file's level up in log_levels_ the first time it logs,
+// and again whenever set_log_level() has bumped log_levels_generation_ since,
+// so the usual check is a couple of compares.
+
+#define MAX_FILE_LOG_LEVELS 16
+
+typedef struct {
+  const char* filename;
+  int level;
+} FileLogLevel;
+
+FileLogLevel log_levels_[MAX_FILE_LOG_LEVELS];
+unsigned int num_log_levels_ = 0;
+int default_log_level_ = LOG_LEVEL;
+// Starts at 1, so that zeroed LogLimits always look the level up.
+unsigned int log_levels_generation_ = 1;
+
+int file_log_level(const char* filename) {
+  for (unsigned int i = 0; i < num_log_levels_; ++i) {
+    if (!strcmp(log_levels_[i].filename, filename)) {
+      return log_levels_[i].level;
+    }
+  }
+  return default_log_level_;
+}
+
+void set_log_level(const char* filename, int level) {
+  if (!filename) {
+    default_log_level_ = level;
+  } else {
+    unsigned int i = 0;
+    while (i < num_log_levels_ && strcmp(log_levels_[i].filename, filename)) {
+      ++i;
+    }
+    if (i == MAX_FILE_LOG_LEVELS) {
+      LOG(ERROR, "Too many per-file log levels.");
+      return;
+    }
+    log_levels_[i].filename = filename;
+    log_levels_[i].level = level;
+    if (i == num_log_levels_) {
+      ++num_log_levels_;
+    }
+  }
+  ++log_levels_generation_;
+}
+
+int log_allow(LogLimit* limit, int level, const char* filename,
+              const char* text, unsigned int value) {
+  trace(TRACE_LOG, (unsigned int)text, value);
+  if (limit->generation != log_levels_generation_) {
+    if (!limit->generation) {
+      limit->tokens = LOG_BURST;
+      limit->last_refill = rdtsc() >> LOG_REFILL_SHIFT;
+    }
+    limit->level = file_log_level(filename);
+    limit->generation = log_levels_generation_;
+  }
+  if (level > limit->level) {
+    return 0;
+  }
+  if (limit->unlimited) {
+    return 1;
+  }
+  if (limit->tokens < LOG_BURST) {
+    unsigned int now = rdtsc() >> LOG_REFILL_SHIFT;
+    unsigned int refill = now - limit->last_refill;
+    limit->last_refill = now;
+    limit->tokens = refill >= LOG_BURST - limit->tokens ?
+        LOG_BURST : limit->tokens + refill;
+  }
+  if (!limit->tokens) {
+    ++limit->suppressed;
+    return 0;
+  }
+  --limit->tokens;
+  unsigned int suppressed = limit->suppressed;
+  if (suppressed) {
+    limit->suppressed = 0;
+    LOG_INT(WARNING, "Messages suppressed before the next one: ", suppressed);
+  }
+  return 1;
+}
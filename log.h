@@ -5,13 +5,150 @@
 #define WARNING 1
 #define ERROR 0
 
-#define LOG(level, text) log_message(level, __FILE__, __LINE__, text)
+// Sites less important than LOG_LEVEL (`make LOG_LEVEL=WARNING`) are compiled
+// out entirely. The rest can be turned down at runtime with set_log_level(),
+// and each site is rate limited on its own: it can log LOG_BURST messages in a
+// row, then gets one back roughly every 2^LOG_REFILL_SHIFT cycles. What it
+// drops is counted and logged as a summary once it's allowed to log again.
+// Dumps that log a whole table from a few sites in a loop use LOG_DUMP and
+// friends, which skip the rate limit (but not the level), so nothing in the
+// middle of the table goes missing.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL INFO
+#endif
 
-#define LOG_INT(level, text, i) \
+#define LOG_BURST 16
+#define LOG_REFILL_SHIFT 26
+
+// The runtime state of a call site, zero-initialised. Updated without any
+// locking, so with several CPUs logging from the same place the counts are
+// approximate.
+typedef struct {
+  unsigned int generation;  // Of the level table, when level was looked up.
+  int level;
+  unsigned int tokens;
+  unsigned int last_refill;
+  unsigned int suppressed;
+  int unlimited;  // Set for LOG_DUMP sites.
+} LogLimit;
+
+// Returns 1 if a message at level from this site should go out. Records it in
+// the trace (see trace.h) either way, with text if it's a literal (0 if not).
+int log_allow(LogLimit* limit, int level, const char* filename,
+              const char* text, unsigned int value);
+
+// Sets the least important level logged from filename (as in __FILE__), or
+// from files without a level of their own if filename is 0. It can't go past
+// LOG_LEVEL, since those sites aren't there. For the boot CPU.
+void set_log_level(const char* filename, int level);
+
+// LOG_AT_<level>(code, plain) is code for the levels LOG_LEVEL keeps. For the
+// rest it's plain (the text logging call, with the same arguments) behind an
+// if (0), so the arguments still count as used but nothing is left behind,
+// not even the site's LogLimit or LogSite. level has to be INFO, WARNING or
+// ERROR, which this gets as the number they expand to.
+#define LOG_AT(level, code, plain) LOG_AT_##level(code, plain)
+#define LOG_DISABLED(plain) do { if (0) { plain; } } while (0)
+#if LOG_LEVEL >= INFO
+#define LOG_AT_2(code, plain) code
+#else
+#define LOG_AT_2(code, plain) LOG_DISABLED(plain)
+#endif
+#if LOG_LEVEL >= WARNING
+#define LOG_AT_1(code, plain) code
+#else
+#define LOG_AT_1(code, plain) LOG_DISABLED(plain)
+#endif
+#define LOG_AT_0(code, plain) code
+
+// emit gets the value (evaluated once) as log_value_.
+#define LOG_LIMITED(level, dump, text, value, emit, plain)                  \
+  LOG_AT(level, do {                                                        \
+    static LogLimit log_limit_ = {.unlimited = (dump)};                     \
+    unsigned int log_value_ = (value);                                      \
+    if (log_allow(&log_limit_, level, __FILE__,                             \
+                  __builtin_constant_p(text) ? (text) : 0, log_value_)) {   \
+      emit;                                                                 \
+    }                                                                       \
+  } while (0), plain)
+
+#define LOG_PLAIN(level, text) log_message(level, __FILE__, __LINE__, text)
+#define LOG_PLAIN_INT(level, text, i) \
     log_int(level, __FILE__, __LINE__, text, (int)(i))
-#define LOG_HEX(level, text, i) \
+#define LOG_PLAIN_HEX(level, text, i) \
     log_hex(level, __FILE__, __LINE__, text, (unsigned int)(i))
 
+// Built with LOG_BINARY (`make LOG_BINARY=1`), each LOG call site gets a
+// LogSite in the .log_sites section, and a message is just the site's index,
+// a timestamp and the value, which takes a fraction of the bytes (and time) of
+// the text. logdecode turns that back into the text using kernel.elf, which
+// has all the sites and the strings they point to. See log.c for the format.
+#ifdef LOG_BINARY
+
+#define LOG_KIND_MESSAGE 0
+#define LOG_KIND_INT 1
+#define LOG_KIND_HEX 2
+
+typedef struct {
+  const char* filename;
+  // 0 if the text isn't a string literal, in which case every message has
+  // to carry it.
+  const char* text;
+  unsigned short line;
+  unsigned char level;
+  unsigned char kind;
+} LogSite;
+
+#define LOG_SITE(level, text, kind)                                          \
+  ({                                                                         \
+    static const LogSite log_site_                                           \
+        __attribute__((section(".log_sites"))) = {                           \
+      __FILE__, __builtin_constant_p(text) ? (text) : 0, __LINE__, level,    \
+      kind};                                                                 \
+    &log_site_;                                                              \
+  })
+
+#define LOG_IMPL(level, dump, text)                                       \
+    LOG_LIMITED(level, dump, text, 0,                                     \
+                log_binary(LOG_SITE(level, text, LOG_KIND_MESSAGE), text, \
+                           0),                                            \
+                LOG_PLAIN(level, text))
+#define LOG_INT_IMPL(level, dump, text, i)                              \
+    LOG_LIMITED(level, dump, text, (int)(i),                            \
+                log_binary(LOG_SITE(level, text, LOG_KIND_INT), text,   \
+                           log_value_),                                 \
+                LOG_PLAIN_INT(level, text, i))
+#define LOG_HEX_IMPL(level, dump, text, i)                              \
+    LOG_LIMITED(level, dump, text, (unsigned int)(i),                   \
+                log_binary(LOG_SITE(level, text, LOG_KIND_HEX), text,   \
+                           log_value_),                                 \
+                LOG_PLAIN_HEX(level, text, i))
+
+void log_binary(const LogSite* site, const char* text, unsigned int value);
+
+#else
+
+#define LOG_IMPL(level, dump, text)                           \
+    LOG_LIMITED(level, dump, text, 0, LOG_PLAIN(level, text), \
+                LOG_PLAIN(level, text))
+#define LOG_INT_IMPL(level, dump, text, i)                  \
+    LOG_LIMITED(level, dump, text, (int)(i),                \
+                LOG_PLAIN_INT(level, text, log_value_),     \
+                LOG_PLAIN_INT(level, text, i))
+#define LOG_HEX_IMPL(level, dump, text, i)                           \
+    LOG_LIMITED(level, dump, text, (unsigned int)(i),                \
+                LOG_PLAIN_HEX(level, text, log_value_),              \
+                LOG_PLAIN_HEX(level, text, i))
+
+#endif  // LOG_BINARY
+
+#define LOG(level, text) LOG_IMPL(level, 0, text)
+#define LOG_INT(level, text, i) LOG_INT_IMPL(level, 0, text, i)
+#define LOG_HEX(level, text, i) LOG_HEX_IMPL(level, 0, text, i)
+#define LOG_DUMP(level, text) LOG_IMPL(level, 1, text)
+#define LOG_DUMP_INT(level, text, i) LOG_INT_IMPL(level, 1, text, i)
+#define LOG_DUMP_HEX(level, text, i) LOG_HEX_IMPL(level, 1, text, i)
+
 // Must call serial_init() before calling any of these functions.
 void log_message(int level, const char* filename, int line, const char* text);
 
@@ -0,0 +1,176 @@
+// Turns the output of a kernel built with LOG_BINARY back into the text log,
+// using the LOG call sites and strings in its kernel.elf. See log.h and log.c.
+//
+//   ./logdecode kernel.elf < com1.out
+//
+// Built for the host, like the tests.
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Must match log.h and log.c.
+#define LOG_KIND_MESSAGE 0
+#define LOG_KIND_INT 1
+#define LOG_KIND_HEX 2
+#define LOG_RECORD_SYNC 0xA5
+#define LOG_SITE_SIZE 12
+
+typedef struct {
+  unsigned char* data;
+  long size;
+  Elf32_Shdr* sections;
+  unsigned int num_sections;
+  const unsigned char* sites;
+  unsigned int num_sites;
+} Kernel;
+
+unsigned int get_u16(const unsigned char* in) {
+  return in[0] | (in[1] << 8);
+}
+
+unsigned int get_u32(const unsigned char* in) {
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int)in[3] << 24);
+}
+
+int load_kernel(const char* path, Kernel* kernel) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return 0;
+  }
+  fseek(file, 0, SEEK_END);
+  kernel->size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  kernel->data = malloc(kernel->size);
+  if (fread(kernel->data, 1, kernel->size, file) != (size_t)kernel->size) {
+    fprintf(stderr, "Couldn't read %s\n", path);
+    fclose(file);
+    return 0;
+  }
+  fclose(file);
+
+  Elf32_Ehdr* header = (Elf32_Ehdr*)kernel->data;
+  if (kernel->size < (long)sizeof(Elf32_Ehdr) ||
+      memcmp(header->e_ident, ELFMAG, SELFMAG) ||
+      header->e_ident[EI_CLASS] != ELFCLASS32) {
+    fprintf(stderr, "%s isn't a 32-bit ELF file\n", path);
+    return 0;
+  }
+  kernel->sections = (Elf32_Shdr*)(kernel->data + header->e_shoff);
+  kernel->num_sections = header->e_shnum;
+  const char* names =
+      (const char*)kernel->data + kernel->sections[header->e_shstrndx].sh_offset;
+  for (unsigned int i = 0; i < kernel->num_sections; ++i) {
+    if (!strcmp(names + kernel->sections[i].sh_name, ".log_sites")) {
+      kernel->sites = kernel->data + kernel->sections[i].sh_offset;
+      kernel->num_sites = kernel->sections[i].sh_size / LOG_SITE_SIZE;
+      return 1;
+    }
+  }
+  fprintf(stderr, "%s has no .log_sites, was it built with LOG_BINARY=1?\n",
+          path);
+  return 0;
+}
+
+// Finds the string at a kernel virtual address in whichever section has it.
+const char* kernel_string(Kernel* kernel, unsigned int vaddr) {
+  for (unsigned int i = 0; i < kernel->num_sections; ++i) {
+    Elf32_Shdr* section = &kernel->sections[i];
+    if (section->sh_type == SHT_PROGBITS && section->sh_addr <= vaddr &&
+        vaddr < section->sh_addr + section->sh_size) {
+      return (const char*)kernel->data + section->sh_offset +
+             (vaddr - section->sh_addr);
+    }
+  }
+  return "?";
+}
+
+const char* level_name(unsigned int level) {
+  switch (level) {
+    case 2:
+      return "INFO";
+    case 1:
+      return "WARNING";
+    case 0:
+      return "ERROR";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+// Reads exactly size bytes, returning 0 at the end of the input.
+int read_bytes(unsigned char* out, size_t size) {
+  return fread(out, 1, size, stdin) == size;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s kernel.elf < log\n", argv[0]);
+    return 1;
+  }
+  Kernel kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  if (!load_kernel(argv[1], &kernel)) {
+    return 1;
+  }
+
+  unsigned int skipped = 0;
+  int c;
+  while ((c = getchar()) != EOF) {
+    if (c != LOG_RECORD_SYNC) {
+      // Text that went straight to the UART, like trace_dump()'s, passes
+      // through as it is.
+      putchar(c);
+      continue;
+    }
+    unsigned char header[6];
+    if (!read_bytes(header, sizeof(header))) {
+      break;
+    }
+    unsigned int id = get_u16(header);
+    if (id >= kernel.num_sites) {
+      // Not really a record, so look for the next sync byte.
+      ++skipped;
+      continue;
+    }
+    const unsigned char* site = kernel.sites + id * LOG_SITE_SIZE;
+    unsigned int filename = get_u32(site);
+    unsigned int text = get_u32(site + 4);
+    unsigned int line = get_u16(site + 8);
+    unsigned int level = site[10];
+    unsigned int kind = site[11];
+
+    unsigned char value_bytes[4];
+    if (kind != LOG_KIND_MESSAGE && !read_bytes(value_bytes, 4)) {
+      break;
+    }
+    char inline_text[256];
+    if (!text) {
+      unsigned char length;
+      if (!read_bytes(&length, 1) ||
+          !read_bytes((unsigned char*)inline_text, length)) {
+        break;
+      }
+      inline_text[length] = 0;
+    }
+
+    // now_ns() / 1024, printed as seconds.
+    unsigned long long ns = (unsigned long long)get_u32(header + 2) << 10;
+    printf("[%5llu.%06llu] %s:%s:%u:%s", ns / 1000000000,
+           ns / 1000 % 1000000, level_name(level),
+           kernel_string(&kernel, filename), line,
+           text ? kernel_string(&kernel, text) : inline_text);
+    if (kind == LOG_KIND_INT) {
+      printf("%d", (int)get_u32(value_bytes));
+    } else if (kind == LOG_KIND_HEX) {
+      printf("0x%08X", get_u32(value_bytes));
+    }
+    printf("\n");
+  }
+  if (skipped) {
+    fprintf(stderr, "Skipped %u records from unknown sites.\n", skipped);
+  }
+  return 0;
+}
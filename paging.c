@@ -1,8 +1,18 @@
 #include "paging.h"
 
+#include "buddy.h"
+#include "frames.h"
+#include "interrupts.h"
 #include "io.h"
 #include "log.h"
+#include "serial.h"
+#include "slab.h"
+#include "smp.h"
+#include "spinlock.h"
 #include "string.h"
+#include "thread.h"
+#include "trace.h"
+#include "user.h"
 
 #define PAGE_SIZE 4096
 #define PAGE_MASK (PAGE_SIZE-1)
@@ -15,22 +25,76 @@ typedef unsigned int PageTableEntry;
 extern PageDirectoryEntry page_directory[1024];
 extern PageTableEntry os_page_table[1024];
 
+// # Direct map
+// Physical memory is mapped at DIRECT_MAP_VADDR with 4MB pages, up to the end
+// of RAM or DIRECT_MAP_MAX_SIZE, whichever comes first. Any frame in there can
+// be read or written by plain address arithmetic (see phys_to_virt()), without
+// mapping it anywhere first or flushing the TLB afterwards. The loader's 4MB
+// page for the kernel image is the first page of the direct map, so until
+// init_paging() extends it only the first 4MB is covered.
+#define DIRECT_MAP_VADDR KERNEL_VADDR
+
+unsigned int direct_map_size_ = 0x400000;
+
+// Boot structures (see init_paging()) are mapped with 4kb pages right after
+// the direct map.
+#define BOOT_VADDR (DIRECT_MAP_VADDR + DIRECT_MAP_MAX_SIZE)
+
+// The last entry of the page directory points back at the page directory
+// itself, so the MMU treats the directory as the page table for the last 4MB
+// of the address space. That makes every page table permanently visible as a
+// 4kb page in that window (the table for pde i is at PAGE_TABLES_VADDR + i *
+// 4kb), and the directory itself as the very last page. Page tables in the
+// direct map are edited through it instead, and the window covers the rest.
+#define RECURSIVE_PDE 1023
+#define PAGE_TABLES_VADDR 0xFFC00000
+
+PageTableEntry* get_page_table(unsigned int pde) {
+  unsigned int paddr = page_directory[pde] & ~PAGE_MASK;
+  if (paddr < direct_map_size_) {
+    return (PageTableEntry*)(DIRECT_MAP_VADDR + paddr);
+  }
+  return (PageTableEntry*)(PAGE_TABLES_VADDR + (pde << PAGE_BITS));
+}
+
+// Not present page table entries with this (OS-available) bit set are
+// reserved for demand paging: the first access to the page faults, and
+// handle_page_fault() backs it with a zeroed frame, mapped with the entry's
+// other flag bits. A not present page directory entry with the bit set reserves
+// all 4MB it covers, and gets a 4MB page (or failing that, a page table full of
+// reserved entries) on the first fault.
+#define PAGE_DEMAND 0x200
+
+// Page directory entries with this bit set map a whole 4MB page instead of
+// pointing at a page table (loader.s turns on CR4.PSE for this). The kernel
+// image lives in one, and blocks of 4MB or more get them whenever there's a
+// free 4MB run of frames to back them.
+#define PAGE_LARGE 0x80
+#define LARGE_PAGE_SIZE 0x400000
+#define LARGE_PAGE_MASK (LARGE_PAGE_SIZE-1)
+#define LARGE_PAGE_FRAMES_ORDER 10
+
 typedef struct __attribute__((packed)) {
   unsigned int start;
   unsigned int end;
 } MemorySpan;
 
+// Number of frames kept zeroed ahead of time for alloc_zeroed_frame().
+#define ZEROED_POOL_SIZE 64
+
 typedef struct {
   MemorySpan* physical_page_stack_vaddr;
   MemorySpan* physical_page_stack_vtop;
 
-  unsigned int  buddy_tree_vaddr;
-  unsigned int  buddy_tree_depth;
+  FrameAllocator frame_allocator;
 
-  // REMEMBER TO INVALIDATE THE FRIGGIN' TLB WHEN CHANGING THE STAGING PAGE.
-  unsigned int  staging_vaddr;
-  // index of the staging page table entry in the os page table
-  unsigned int  staging_pte;
+  // A page kept free for zeroing frames that aren't in the direct map.
+  unsigned int scratch_vaddr;
+
+  unsigned int zeroed_frames[ZEROED_POOL_SIZE];
+  ZeroedFrameStats zeroed_stats;
+
+  BuddyTree     buddy_tree;
 } MemCfg;
 
 MemCfg mem_cfg_;
@@ -40,40 +104,35 @@ typedef struct {
 } MemBlockInfo;
 
 // # Physical memory allocation
-// Keep a stack of available memory pysical pages, along with their sizes in the
-// last 12 bits.
-// When a page is needed, check the top of the stack. Grab and decrement the
-// size counter. Pop if zero.
-// When a page is freed, compare its address with the top of the stack. If
-// they're the same, increment the size (for the possibly common case of
-// deallocating adjacent pages?).
-// Figure that if we run out of stack space we can always add more pages to the
-// stack (and free it of a page in the meantime :D ). We could also just drop
-// the free'd pages on the floor and wait til we run out to invoke an expensive
-// recollection routine to go through the virtual page tables to refresh the
-// state of available pages. Thrashin'!
+// Buddy allocation of physical frames, see frames.c. The allocator needs a
+// Frame struct for every physical frame, and we don't know how many of those
+// there are (or have anywhere to put them) until we've gone through the memory
+// map. So during boot we first keep a stack of free physical spans, built from
+// the memory map with the kernel and modules cut out of it, and pop pages off
+// of that stack for the allocator's bookkeeping. Once the allocator is set up,
+// whatever is left on the stack is handed over to it.
 //
 // # Virtual memory allocation
-// Buddy allocation, which needs 128kb of memory to store the statuses of the
-// finest layer (individual 4kb pages):
-//   4 gigs is 1024 * 1024 4kb pages pages (20 address bits of pages)
-//   Use each bit of a byte to store status (-3 bits, so 17 address bits/128kb)
-// The subsequent layers need half the space of the layer below them, so another
-// 128kb. All layers need 256kb. We'll store this in a heap structure:
-//   { 0.0, 1.0, 1.1, 2.0, 2.1, 2.2, 2.3, 3.0, etc }
+// Buddy allocation over the whole 4GB address space, see buddy.c.
 //
 // # How do we get the space needed for these structures?
-// First, we need the memory to store the physical stack. For the physical
-// space, we can find a single free page based on the kernel location and
-// multiboot info passed from the loader. For the virtual space we can use the
-// first available page in the kernel's page table. We'll also write an
-// expansion routine that wil allow us to add more frames to the physical page
-// stack.
+// First, we need the memory to store the boot stack of free physical spans.
+// For the physical space, we can find a single free page based on the kernel
+// location and multiboot info passed from the loader. For the virtual space we
+// can use the first available page in the kernel's page table. We'll also
+// write an expansion routine that wil allow us to add more frames to the
+// physical page stack.
+// The Frame array for the physical allocator comes straight off of that stack
+// and is mapped right after it.
 // Next, we should find the physical address space to use for the buddy system
-// (18 address bits of space, 256kb). We can use the physical page stack to get
-// this space. For the virtual space, When this is called I believe only the OS
-// is using the virtual space, so we should be fine to just use the last 256kb
-// of space (0xFFFC0000).
+// (buddy_tree_size(), a bit over 256kb). We can use the physical allocator to
+// get this space. For the virtual space, When this is called I believe only
+// the OS is using the virtual space, so we should be fine to just use the last
+// 256kb of space (0xFFFC0000).
+
+unsigned int round_to_next_page(unsigned int addr) {
+  return (addr + PAGE_SIZE - 1) & ~PAGE_MASK;
+}
 
 void make_span(unsigned int start, unsigned int end,
                MemorySpan* free_physical) {
@@ -118,12 +177,163 @@ int find_free_with_reserved(unsigned int start, unsigned int end,
   }
 }
 
-// Maps the 4kb virtual page at vaddr to the physical page at paddr, using the
-// virtual page at staging_vaddr (index staging_pte in the OS's page table) as a
-// staging area for updating the affected PT.
-void map_page(unsigned int vaddr, unsigned int paddr, MemCfg* mem_cfg) {
+// Returns the address of a 4k page aligned chunk of memory.
+unsigned int pop_physical(MemCfg* mem_cfg) {
+  if (mem_cfg->physical_page_stack_vtop == mem_cfg->physical_page_stack_vaddr) {
+    LOG(ERROR, "No physical memory blocks left on the stack!");
+    return 0;
+  }
+  MemorySpan* free_physical = mem_cfg->physical_page_stack_vtop - 1;
+  if (free_physical->end - free_physical->start < PAGE_SIZE) {
+    LOG(ERROR, "Looks like a physical block wasn't page sized?");
+    return 0;
+  }
+  unsigned int addr = free_physical->start;
+  free_physical->start += PAGE_SIZE;
+  if (free_physical->start >= free_physical->end) {
+    // Pop off empty blocks.
+    --mem_cfg->physical_page_stack_vtop;
+  }
+  return addr;
+}
+
+void zero_page(unsigned int vaddr) {
+  LOG_HEX(INFO, "Zeroing: ", vaddr);
+  memset((void*)vaddr, 0, PAGE_SIZE);
+}
+
+// Zeroes the frames in [paddr, paddr + size) through the direct map. Returns 0,
+// without touching them, if they aren't all in it.
+int zero_frames(unsigned int paddr, unsigned int size) {
+  if (paddr + size > direct_map_size_) {
+    return 0;
+  }
+  memset(phys_to_virt(paddr), 0, size);
+  return 1;
+}
+
+// Zeroes a single frame, through the direct map if it's in there and through
+// the scratch page otherwise.
+void zero_frame(unsigned int paddr) {
+  if (zero_frames(paddr, PAGE_SIZE)) {
+    return;
+  }
+  map_page(mem_cfg_.scratch_vaddr, paddr);
+  memset((void*)mem_cfg_.scratch_vaddr, 0, PAGE_SIZE);
+  unmap_page(mem_cfg_.scratch_vaddr);
+}
+
+// # Zeroed frames
+// Page tables and demand paged memory need zeroed frames, and zeroing 4kb
+// takes a while. So a small pool of frames is zeroed ahead of time, whenever
+// the CPU has nothing better to do (see idle.c), and handed out without any
+// zeroing on the allocation path. When the pool runs dry frames get zeroed on
+// the spot like before.
+
+unsigned int do_alloc_zeroed_frame() {
+  ZeroedFrameStats* stats = &mem_cfg_.zeroed_stats;
+  if (stats->num_frames) {
+    ++stats->hits;
+    --stats->num_frames;
+    return mem_cfg_.zeroed_frames[stats->num_frames];
+  }
+  ++stats->misses;
+  unsigned int paddr = frames_alloc(&mem_cfg_.frame_allocator, 0);
+  if (!paddr) {
+    LOG(ERROR, "Out of physical memory!");
+    return 0;
+  }
+  zero_frame(paddr);
+  return paddr;
+}
+
+unsigned int do_refill_zeroed_frames(unsigned int max_frames) {
+  ZeroedFrameStats* stats = &mem_cfg_.zeroed_stats;
+  if (!mem_cfg_.frame_allocator.frames) {
+    return 0;  // Paging isn't set up yet.
+  }
+  unsigned int added = 0;
+  while (added < max_frames && stats->num_frames < ZEROED_POOL_SIZE) {
+    unsigned int paddr = frames_alloc(&mem_cfg_.frame_allocator, 0);
+    if (!paddr) {
+      break;
+    }
+    zero_frame(paddr);
+    mem_cfg_.zeroed_frames[stats->num_frames] = paddr;
+    ++stats->num_frames;
+    ++added;
+  }
+  return added;
+}
+
+ZeroedFrameStats zeroed_frame_stats() {
+  return mem_cfg_.zeroed_stats;
+}
+
+// Grabs a single free physical frame. Until the frame allocator is set up this
+// pops frames straight off the boot stack of free spans.
+unsigned int alloc_frame(MemCfg* mem_cfg) {
+  if (!mem_cfg->frame_allocator.frames) {
+    return pop_physical(mem_cfg);
+  }
+  unsigned int paddr = frames_alloc(&mem_cfg->frame_allocator, 0);
+  if (!paddr) {
+    LOG(ERROR, "Out of physical memory!");
+  }
+  return paddr;
+}
+
+// Add a page table to the pd for the vaddr if it needs it. Returns 0 if there
+// was no memory left for a new page table, or if vaddr is in a 4MB page.
+int add_page_table(unsigned int vaddr, MemCfg* mem_cfg) {
+  unsigned int pde = (vaddr >> 22) & 0x3FF;
+  if ((page_directory[pde] & (PAGE_PRESENT | PAGE_LARGE)) ==
+      (PAGE_PRESENT | PAGE_LARGE)) {
+    LOG_HEX(ERROR, "Tried to add a page table inside a 4MB page: ", vaddr);
+    return 0;
+  }
+  if (!(page_directory[pde] & PAGE_PRESENT)) {
+    // A demand reservation for the whole table carries over to its entries.
+    PageTableEntry reserved = page_directory[pde] & PAGE_DEMAND ?
+        page_directory[pde] & PAGE_MASK : 0;
+    LOG(INFO,
+        "Tried to map virtual address that had no page table. Mapping a new "
+        "page table.");
+    LOG_HEX(INFO, "Adding a page table for vaddr: ", vaddr);
+    LOG_HEX(INFO, "  which is pde: : ", pde);
+    // Find an unused physical chunk, which comes pre-zeroed once the frame
+    // allocator is up.
+    int zeroed = mem_cfg->frame_allocator.frames != 0;
+    unsigned int paddr =
+        zeroed ? alloc_zeroed_frame() : pop_physical(mem_cfg);
+    if (!paddr) {
+      return 0;
+    }
+    LOG_HEX(INFO, "Found paddr for new page table: ", paddr);
+    // Map it into the page directory, which also makes it show up in the page
+    // table window (if it isn't in the direct map already) so we can...
+    page_directory[pde] = paddr | 0x3;
+    if (paddr >= direct_map_size_) {
+      invlpg((unsigned int)get_page_table(pde));
+    }
+    // ... zero it, if it isn't already.
+    if (!zeroed) {
+      zero_page((unsigned int)get_page_table(pde));
+    }
+    if (reserved) {
+      PageTableEntry* pt = get_page_table(pde);
+      for (int i = 0; i < 1024; ++i) {
+        pt[i] = reserved;
+      }
+    }
+  }
+  return 1;
+}
+
+void do_map_page(unsigned int vaddr, unsigned int paddr) {
   LOG_HEX(INFO, "Mapping virtual page: ", vaddr);
   LOG_HEX(INFO, "    to physical page: ", paddr);
+  trace(TRACE_MAP, vaddr, 1);
   if (vaddr & PAGE_MASK) {
     LOG(ERROR, "Tried to map non-page virtual address.");
     return;
@@ -132,26 +342,35 @@ void map_page(unsigned int vaddr, unsigned int paddr, MemCfg* mem_cfg) {
     LOG(ERROR, "Tried to map non-page physical address.");
     return;
   }
+  if (!add_page_table(vaddr, &mem_cfg_)) {
+    LOG(ERROR, "No memory for the page table of a new mapping.");
+    return;
+  }
+
+  PageTableEntry* pt = get_page_table((vaddr >> 22) & 0x3FF);
+  unsigned int pte = (vaddr >> 12) & 0x3FF;
+  pt[pte] = paddr | PAGE_PRESENT | PAGE_WRITABLE;  // 4kb page
+  invlpg(vaddr);
+}
+
+void do_unmap_page(unsigned int vaddr) {
+  trace(TRACE_UNMAP, vaddr, 1);
   unsigned int pde = (vaddr >> 22) & 0x3FF;
   if (!(page_directory[pde] & 1)) {
-    LOG(ERROR, "Tried to map virtual address that had no page table.");
+    return;
+  }
+  if (page_directory[pde] & PAGE_LARGE) {
+    LOG_HEX(ERROR, "Tried to unmap a single page of a 4MB page: ", vaddr);
+    return;
   }
 
-  // Get the physical address of the page table.
-  unsigned int pt_paddr = page_directory[pde] & 0xFFFFF000;
-  // Map it into virtual memory in the OS's PT using the staging pte.
-  os_page_table[mem_cfg->staging_pte] = pt_paddr | 0x3;
-  invlpg(mem_cfg->staging_vaddr);
-
-  PageTableEntry* pt = (PageTableEntry*)mem_cfg->staging_vaddr;
+  PageTableEntry* pt = get_page_table(pde);
   unsigned int pte = (vaddr >> 12) & 0x3FF;
-  pt[pte] = paddr | 0x3;  // 4kb page
+  pt[pte] = 0;
   invlpg(vaddr);
 }
 
-// Grabs the 4kb physical page currently associated with the given vaddr.
-// Returns 0xFFFFFFFF on error.
-unsigned int translate_vaddr(unsigned int vaddr, MemCfg* mem_cfg) {
+unsigned int translate_vaddr(unsigned int vaddr) {
   if (vaddr & PAGE_MASK) {
     LOG(ERROR, "Tried to map non-page virtual address.");
     return 0xFFFFFFFF;
@@ -161,14 +380,11 @@ unsigned int translate_vaddr(unsigned int vaddr, MemCfg* mem_cfg) {
     LOG(ERROR, "Tried to translate virtual address that had no page table.");
     return 0xFFFFFFFF;
   }
+  if (page_directory[pde] & PAGE_LARGE) {
+    return (page_directory[pde] & ~LARGE_PAGE_MASK) | (vaddr & LARGE_PAGE_MASK);
+  }
 
-  // Get the physical address of the page table.
-  unsigned int pt_paddr = page_directory[pde] & 0xFFFFF000;
-  // Map it into virtual memory in the OS's PT using the staging pte.
-  os_page_table[mem_cfg->staging_pte] = pt_paddr | 0x3;
-  invlpg(mem_cfg->staging_vaddr);
-
-  PageTableEntry* pt = (PageTableEntry*)mem_cfg->staging_vaddr;
+  PageTableEntry* pt = get_page_table(pde);
   unsigned int pte = (vaddr >> 12) & 0x3FF;
   if (!(pt[pte] & 1)) {
     // No page was mapped, return error.
@@ -177,6 +393,451 @@ unsigned int translate_vaddr(unsigned int vaddr, MemCfg* mem_cfg) {
   return pt[pte] & 0xFFFFF000;
 }
 
+void* phys_to_virt(unsigned int paddr) {
+  if (paddr >= direct_map_size_) {
+    LOG_HEX(ERROR, "Physical address is outside of the direct map: ", paddr);
+    return (void*)0;
+  }
+  return (void*)(DIRECT_MAP_VADDR + paddr);
+}
+
+unsigned int virt_to_phys(const void* vaddr) {
+  unsigned int v = (unsigned int)vaddr;
+  if (v >= DIRECT_MAP_VADDR && v - DIRECT_MAP_VADDR < direct_map_size_) {
+    return v - DIRECT_MAP_VADDR;
+  }
+  unsigned int paddr = translate_vaddr(v & ~PAGE_MASK);
+  if (paddr == 0xFFFFFFFF) {
+    return paddr;
+  }
+  return paddr | (v & PAGE_MASK);
+}
+
+// Maps as much physical memory as the memory map says there is (up to
+// DIRECT_MAP_MAX_SIZE) at DIRECT_MAP_VADDR. The PDEs weren't present before, so
+// there's nothing to flush.
+void make_direct_map(unsigned long mmap_vaddr, unsigned long mmap_length) {
+  unsigned int max_paddr = 0;
+  unsigned int i = 0;
+  while (i < mmap_length) {
+    memory_map_t* mmap = (memory_map_t*)(mmap_vaddr + i);
+    if (mmap->type == 1 && !mmap->base_addr_high) {
+      unsigned int end = mmap->base_addr_low + mmap->length_low;
+      if (mmap->length_high || end < mmap->base_addr_low) {
+        end = 0xFFFFFFFF;
+      }
+      if (end > max_paddr) {
+        max_paddr = end;
+      }
+    }
+    i += mmap->size + 4;  // +4 because the size field does not include itself.
+  }
+  if (max_paddr > DIRECT_MAP_MAX_SIZE) {
+    max_paddr = DIRECT_MAP_MAX_SIZE;
+  }
+  for (unsigned int paddr = direct_map_size_; paddr < max_paddr;
+       paddr += LARGE_PAGE_SIZE) {
+    page_directory[(DIRECT_MAP_VADDR + paddr) >> 22] =
+        paddr | PAGE_LARGE | PAGE_WRITABLE | PAGE_PRESENT;
+    direct_map_size_ = paddr + LARGE_PAGE_SIZE;
+  }
+  LOG_HEX(INFO, "Direct mapped physical memory: ", direct_map_size_);
+}
+
+// When a present page table entry changes, the TLB may still hold the old
+// translation. Flushing a handful of pages with invlpg is cheaper than throwing
+// away the whole TLB, but past this many pages it's cheaper to reload CR3.
+// Entries that weren't present never need flushing, since the TLB doesn't
+// cache missing translations.
+#define TLB_FLUSH_THRESHOLD 32
+
+// Collects the pages whose translations changed during a batch of page table
+// edits so the TLB can be flushed once at the end.
+typedef struct {
+  unsigned int num_pages;
+  unsigned int vaddrs[TLB_FLUSH_THRESHOLD];
+} TlbFlush;
+
+void tlb_flush_add(TlbFlush* flush, unsigned int vaddr) {
+  if (flush->num_pages < TLB_FLUSH_THRESHOLD) {
+    flush->vaddrs[flush->num_pages] = vaddr;
+  }
+  ++flush->num_pages;
+}
+
+void tlb_flush_finish(TlbFlush* flush) {
+  if (flush->num_pages > TLB_FLUSH_THRESHOLD) {
+    flush_tlb();
+  } else {
+    for (unsigned int i = 0; i < flush->num_pages; ++i) {
+      invlpg(flush->vaddrs[i]);
+    }
+  }
+  flush->num_pages = 0;
+}
+
+// Replaces the 4MB page at pde with a page table mapping the same frames, so
+// that part of it can be unmapped. Returns 0 if there was no memory for the
+// page table.
+int split_large_page(unsigned int pde) {
+  PageDirectoryEntry large = page_directory[pde];
+  unsigned int paddr = alloc_zeroed_frame();
+  if (!paddr) {
+    return 0;
+  }
+  page_directory[pde] = paddr | (large & PAGE_USER) | PAGE_WRITABLE |
+                        PAGE_PRESENT;
+  if (paddr >= direct_map_size_) {
+    invlpg((unsigned int)get_page_table(pde));
+  }
+  // Bit 7 means something else (PAT) in a page table entry.
+  PageTableEntry flags = large & PAGE_MASK & ~PAGE_LARGE;
+  PageTableEntry* pt = get_page_table(pde);
+  for (int i = 0; i < 1024; ++i) {
+    pt[i] = ((large & ~LARGE_PAGE_MASK) + i * PAGE_SIZE) | flags;
+  }
+  invlpg(pde << 22);
+  return 1;
+}
+
+// Clears the page table entries for npages pages starting at vaddr, giving
+// their frames back to the frame allocator if free_frames_too is set.
+void clear_range(unsigned int vaddr, unsigned int npages,
+                 int free_frames_too) {
+  trace(TRACE_UNMAP, vaddr, npages);
+  TlbFlush flush;
+  flush.num_pages = 0;
+  unsigned int end = vaddr + npages * PAGE_SIZE;
+  while (vaddr < end) {
+    unsigned int pde = (vaddr >> 22) & 0x3FF;
+    // End of the vaddrs covered by this page table (or the range, if it ends
+    // sooner).
+    unsigned int table_end = (vaddr | 0x3FFFFF) + 1;
+    if (!table_end || table_end > end) {
+      table_end = end;
+    }
+    int whole_table = table_end - vaddr == LARGE_PAGE_SIZE;
+    if (!(page_directory[pde] & PAGE_PRESENT)) {
+      // Drop a demand reservation for the table. If the range only covers part
+      // of it, the rest needs to stay reserved in a real page table.
+      if (whole_table) {
+        page_directory[pde] = 0;
+      } else if (page_directory[pde] & PAGE_DEMAND &&
+                 add_page_table(vaddr, &mem_cfg_)) {
+        continue;
+      }
+      vaddr = table_end;
+      continue;
+    }
+    if (page_directory[pde] & PAGE_LARGE) {
+      if (!whole_table) {
+        // Only part of it is going away, so break it up into 4kb pages.
+        if (split_large_page(pde)) {
+          continue;
+        }
+        LOG_HEX(ERROR, "Couldn't split up a 4MB page to unmap part of it: ",
+                vaddr);
+      } else {
+        if (free_frames_too) {
+          frames_free(&mem_cfg_.frame_allocator,
+                      page_directory[pde] & ~LARGE_PAGE_MASK,
+                      LARGE_PAGE_FRAMES_ORDER);
+        }
+        page_directory[pde] = 0;
+        tlb_flush_add(&flush, vaddr);
+      }
+      vaddr = table_end;
+      continue;
+    }
+    PageTableEntry* pt = get_page_table(pde);
+    for (; vaddr != table_end; vaddr += PAGE_SIZE) {
+      PageTableEntry* entry = &pt[(vaddr >> 12) & 0x3FF];
+      if (*entry & PAGE_PRESENT) {
+        if (free_frames_too) {
+          frames_free(&mem_cfg_.frame_allocator, *entry & 0xFFFFF000, 0);
+        }
+        tlb_flush_add(&flush, vaddr);
+      }
+      *entry = 0;
+    }
+  }
+  tlb_flush_finish(&flush);
+}
+
+// Moves the mappings (and demand reservations) of npages pages from old_vaddr
+// to new_vaddr without touching the memory behind them. The pages at new_vaddr
+// must have been reserved with reserve_range(), and their reservations end up
+// at old_vaddr in exchange. Both addresses must be 4MB aligned if npages
+// covers whole 4MB chunks, and the pages must fit in one page table if it
+// doesn't. Returns 0, with nothing moved, if a page table couldn't be added.
+int swap_range(unsigned int old_vaddr, unsigned int new_vaddr,
+               unsigned int npages) {
+  if (npages >= LARGE_PAGE_SIZE / PAGE_SIZE) {
+    // Whole page directory entries (page tables, 4MB pages or reservations)
+    // can just trade places.
+    for (unsigned int i = 0; i < npages / (LARGE_PAGE_SIZE / PAGE_SIZE); ++i) {
+      unsigned int old_pde = (old_vaddr >> 22) + i;
+      unsigned int new_pde = (new_vaddr >> 22) + i;
+      PageDirectoryEntry tmp = page_directory[old_pde];
+      page_directory[old_pde] = page_directory[new_pde];
+      page_directory[new_pde] = tmp;
+    }
+    // That changed a lot of translations, including in the page table window.
+    flush_tlb();
+    return 1;
+  }
+  if (!add_page_table(old_vaddr, &mem_cfg_) ||
+      !add_page_table(new_vaddr, &mem_cfg_)) {
+    return 0;
+  }
+  TlbFlush flush;
+  flush.num_pages = 0;
+  PageTableEntry* old_pt = get_page_table(old_vaddr >> 22);
+  PageTableEntry* new_pt = get_page_table(new_vaddr >> 22);
+  for (unsigned int i = 0; i < npages; ++i) {
+    PageTableEntry* old_entry = &old_pt[((old_vaddr >> 12) + i) & 0x3FF];
+    PageTableEntry* new_entry = &new_pt[((new_vaddr >> 12) + i) & 0x3FF];
+    PageTableEntry tmp = *old_entry;
+    *old_entry = *new_entry;
+    *new_entry = tmp;
+    // Reserved pages are never present, so only the old side can be cached.
+    if (tmp & PAGE_PRESENT) {
+      tlb_flush_add(&flush, old_vaddr + i * PAGE_SIZE);
+    }
+  }
+  tlb_flush_finish(&flush);
+  return 1;
+}
+
+// Fills in the page table entries for npages pages starting at vaddr, walking
+// each page table once. Maps them to the consecutive frames starting at paddr,
+// or to newly allocated frames if paddr is 0. Aligned 4MB chunks without a page
+// table get a 4MB page instead if the frames for one are available.
+int fill_range(unsigned int vaddr, unsigned int paddr, unsigned int npages,
+               unsigned int flags) {
+  LOG_HEX(INFO, "Mapping virtual range: ", vaddr);
+  LOG_HEX(INFO, "            of pages: ", npages);
+  trace(TRACE_MAP, vaddr, npages);
+  if ((vaddr | paddr) & PAGE_MASK) {
+    LOG(ERROR, "Tried to map a range that isn't page aligned.");
+    return 0;
+  }
+  flags = (flags & PAGE_MASK) | PAGE_PRESENT;
+  TlbFlush flush;
+  flush.num_pages = 0;
+  unsigned int start = vaddr;
+  unsigned int mapped = 0;
+  while (mapped < npages) {
+    unsigned int pde = (vaddr >> 22) & 0x3FF;
+    if (!((vaddr | paddr) & LARGE_PAGE_MASK) &&
+        npages - mapped >= LARGE_PAGE_SIZE / PAGE_SIZE &&
+        !(page_directory[pde] & PAGE_PRESENT)) {
+      unsigned int frame = paddr;
+      if (!paddr) {
+        frame = frames_alloc(&mem_cfg_.frame_allocator,
+                             LARGE_PAGE_FRAMES_ORDER);
+      } else {
+        paddr += LARGE_PAGE_SIZE;
+      }
+      // Fall back to 4kb pages if there's no free 4MB run of frames.
+      if (frame) {
+        page_directory[pde] = frame | flags | PAGE_LARGE;
+        vaddr += LARGE_PAGE_SIZE;
+        mapped += LARGE_PAGE_SIZE / PAGE_SIZE;
+        continue;
+      }
+    }
+    if (!add_page_table(vaddr, &mem_cfg_)) {
+      break;
+    }
+    // Ring 3 only gets at a page if its page directory entry allows it too.
+    // The old entry might be cached, so its first page gets flushed.
+    if ((flags & PAGE_USER) && !(page_directory[pde] & PAGE_USER)) {
+      page_directory[pde] |= PAGE_USER;
+      tlb_flush_add(&flush, vaddr);
+    }
+    PageTableEntry* pt = get_page_table(pde);
+    unsigned int pte = (vaddr >> 12) & 0x3FF;
+    unsigned int last_pte = pte + (npages - mapped);
+    if (last_pte > 1024) {
+      last_pte = 1024;
+    }
+    for (; pte < last_pte; ++pte) {
+      unsigned int frame = paddr;
+      if (!paddr) {
+        frame = frames_alloc(&mem_cfg_.frame_allocator, 0);
+        if (!frame) {
+          break;
+        }
+      } else {
+        paddr += PAGE_SIZE;
+      }
+      if (pt[pte] & PAGE_PRESENT) {
+        tlb_flush_add(&flush, vaddr);
+      }
+      pt[pte] = frame | flags;
+      vaddr += PAGE_SIZE;
+      ++mapped;
+    }
+    if (pte < last_pte) {
+      break;
+    }
+  }
+  tlb_flush_finish(&flush);
+  if (mapped < npages) {
+    LOG(ERROR, "Out of memory while mapping a range, undoing it.");
+    clear_range(start, mapped, !paddr);
+    return 0;
+  }
+  return 1;
+}
+
+int do_map_range(unsigned int vaddr, unsigned int npages, unsigned int flags) {
+  return fill_range(vaddr, 0, npages, flags);
+}
+
+int do_map_physical_range(unsigned int vaddr, unsigned int paddr,
+                          unsigned int npages, unsigned int flags) {
+  if (!paddr) {
+    LOG(ERROR, "Tried to map a physical range at 0.");
+    return 0;
+  }
+  return fill_range(vaddr, paddr, npages, flags);
+}
+
+void do_unmap_range(unsigned int vaddr, unsigned int npages) {
+  clear_range(vaddr, npages, 1);
+}
+
+void do_unmap_physical_range(unsigned int vaddr, unsigned int npages) {
+  clear_range(vaddr, npages, 0);
+}
+
+int do_reserve_range(unsigned int vaddr, unsigned int npages,
+                     unsigned int flags) {
+  if (vaddr & PAGE_MASK) {
+    LOG(ERROR, "Tried to reserve a range that isn't page aligned.");
+    return 0;
+  }
+  PageTableEntry reserved = (flags & PAGE_MASK & ~PAGE_PRESENT) | PAGE_DEMAND;
+  unsigned int start = vaddr;
+  unsigned int end = vaddr + npages * PAGE_SIZE;
+  while (vaddr != end) {
+    unsigned int pde = (vaddr >> 22) & 0x3FF;
+    // Whole 4MB chunks without a page table are reserved in the directory, so
+    // big reservations don't need page tables until they're touched.
+    if (!(vaddr & 0x3FFFFF) && end - vaddr >= 0x400000 &&
+        !(page_directory[pde] & PAGE_PRESENT)) {
+      page_directory[pde] = reserved;
+      vaddr += 0x400000;
+      continue;
+    }
+    if (!add_page_table(vaddr, &mem_cfg_)) {
+      LOG(ERROR, "Out of memory while reserving a range, undoing it.");
+      clear_range(start, (vaddr - start) / PAGE_SIZE, 1);
+      return 0;
+    }
+    PageTableEntry* pt = get_page_table(pde);
+    do {
+      PageTableEntry* entry = &pt[(vaddr >> 12) & 0x3FF];
+      if (!(*entry & PAGE_PRESENT)) {
+        *entry = reserved;
+      }
+      vaddr += PAGE_SIZE;
+    } while (vaddr != end && (vaddr & 0x3FFFFF));
+  }
+  return 1;
+}
+
+int handle_page_fault(unsigned int vaddr, unsigned int error_code) {
+  // Bit 0 of the error code is set for protection violations on present
+  // pages, which demand paging has nothing to do with.
+  if (error_code & 0x1) {
+    return 0;
+  }
+  // The fault was taken with interrupts on and the lock not held yet, so
+  // another thread or CPU might have faulted the same page in since. Then it's
+  // present now, and the access just needs retrying.
+  unsigned int pde = (vaddr >> 22) & 0x3FF;
+  if ((page_directory[pde] & (PAGE_PRESENT | PAGE_LARGE)) ==
+      (PAGE_PRESENT | PAGE_LARGE)) {
+    return 1;
+  }
+  if (!(page_directory[pde] & (PAGE_PRESENT | PAGE_DEMAND))) {
+    return 0;
+  }
+  if (!(page_directory[pde] & PAGE_PRESENT)) {
+    // The whole 4MB is reserved, so back it with a 4MB page if we can, falling
+    // back to a page table (and faulting in 4kb at a time) if we can't.
+    unsigned int paddr =
+        frames_alloc(&mem_cfg_.frame_allocator, LARGE_PAGE_FRAMES_ORDER);
+    if (paddr) {
+      int zeroed = zero_frames(paddr, LARGE_PAGE_SIZE);
+      page_directory[pde] = paddr | PAGE_LARGE | PAGE_PRESENT |
+                            (page_directory[pde] & PAGE_MASK & ~PAGE_DEMAND);
+      if (!zeroed) {
+        memset((void*)(vaddr & ~LARGE_PAGE_MASK), 0, LARGE_PAGE_SIZE);
+      }
+      return 1;
+    }
+  }
+  if (!add_page_table(vaddr, &mem_cfg_)) {
+    LOG_HEX(ERROR, "No memory for a page table to fault in ", vaddr);
+    return 0;
+  }
+  PageTableEntry* entry = &get_page_table(pde)[(vaddr >> 12) & 0x3FF];
+  if (*entry & PAGE_PRESENT) {
+    return 1;
+  }
+  if (!(*entry & PAGE_DEMAND)) {
+    return 0;
+  }
+  unsigned int paddr = alloc_zeroed_frame();
+  if (!paddr) {
+    LOG_HEX(ERROR, "Out of physical memory faulting in ", vaddr);
+    return 0;
+  }
+  // Not present entries are never cached in the TLB, so there's nothing to
+  // flush.
+  *entry = paddr | (*entry & PAGE_MASK & ~PAGE_DEMAND) | PAGE_PRESENT;
+  return 1;
+}
+
+#define EFLAGS_IF 0x200
+
+// See # Locking, at the end.
+void lock_memory();
+void unlock_memory();
+
+void page_fault_handler(InterruptFrame* frame, void* ctx) {
+  ctx = ctx;
+  // CR2 belongs to whichever thread faulted last, so it has to be read before
+  // anything can switch threads. The gate keeps interrupts off until here (see
+  // interrupts.c), and they can come back on once it's saved.
+  unsigned int vaddr = reg_cr2();
+  if (frame->eflags & EFLAGS_IF) {
+    sti();
+  }
+  trace(TRACE_PAGE_FAULT, vaddr, frame->error_code);
+  // User memory is never demand paged, so this is a bad access.
+  if (from_user_mode(frame)) {
+    LOG_HEX(ERROR, "User page fault accessing ", vaddr);
+    user_fault(frame);
+  }
+  lock_memory();
+  int handled = handle_page_fault(vaddr, frame->error_code);
+  unlock_memory();
+  if (handled) {
+    return;
+  }
+  serial_panic();
+  LOG_HEX(ERROR, "Page fault accessing ", vaddr);
+  LOG_HEX(ERROR, "Error codes: ", frame->error_code);
+  LOG_HEX(ERROR, "eip: ", frame->eip);
+  trace_dump();
+  magic_bp();
+}
+
 // Pushes a span of memory defined by start and end onto the free physical
 // memory stack. Reserves space for the stack if it doesn't yet exist.
 void push_free_physical(unsigned int start, unsigned int end, MemCfg* mem_cfg) {
@@ -184,7 +845,7 @@ void push_free_physical(unsigned int start, unsigned int end, MemCfg* mem_cfg) {
     LOG_HEX(INFO, "First free physical page pushed. Found free page at: ",
             start);
     LOG_HEX(INFO, "                                       that ends at: ", end);
-    map_page((unsigned int)mem_cfg->physical_page_stack_vaddr, start, mem_cfg);
+    map_page((unsigned int)mem_cfg->physical_page_stack_vaddr, start);
     mem_cfg->physical_page_stack_vtop = mem_cfg->physical_page_stack_vaddr;
     start += PAGE_SIZE;
     if (start >= end) {
@@ -234,9 +895,9 @@ void push_free_physical_with_reserved(unsigned int free_start,
 // Creates a stack of MemorySpan structs that map out the available physical
 // memory of the system (which are determined using the passed mmap and
 // kernel_location). mem_cfg->physical_page_stack_vaddr should be set to a free
-// virtual page, and the OS's staging page should be set up as well before
-// calling. Populates mem_cfg->physical_page_stack_vtop with the top address of
-// the stack.
+// virtual page, and the recursive page directory entry should be set up as
+// well before calling. Populates mem_cfg->physical_page_stack_vtop with the top
+// address of the stack.
 // TODO: This assumes that all inspected addresses fall on page boundaries,
 // which is maybe not true?
 void make_free_physical_stack(MemorySpan* reserved_spans,
@@ -252,9 +913,14 @@ void make_free_physical_stack(MemorySpan* reserved_spans,
   while (i < mmap_length) {
     memory_map_t* mmap = (memory_map_t*)(mmap_vaddr + i);
     // 1 means available
-    if (mmap->type == 1) {
+    // Memory above 4GB is out of reach without PAE, so skip it.
+    if (mmap->type == 1 && !mmap->base_addr_high) {
       unsigned int start = mmap->base_addr_low;
       unsigned int end = mmap->base_addr_low + mmap->length_low;
+      if (mmap->length_high || end < start) {
+        // Clamp spans that run past 4GB to the last page below it.
+        end = 0xFFFFF000;
+      }
       push_free_physical_with_reserved(start, end, reserved_spans, num_reserved,
                                        mem_cfg);
     }
@@ -262,152 +928,81 @@ void make_free_physical_stack(MemorySpan* reserved_spans,
   }
 }
 
-// Returns the address of a 4k page aligned chunk of memory.
-unsigned int pop_physical(MemCfg* mem_cfg) {
-  if (mem_cfg->physical_page_stack_vtop == mem_cfg->physical_page_stack_vaddr) {
-    LOG(ERROR, "No physical memory blocks left on the stack!");
-    return 0;
-  }
-  MemorySpan* free_physical = mem_cfg->physical_page_stack_vtop - 1;
-  if (free_physical->end - free_physical->start < PAGE_SIZE) {
-    LOG(ERROR, "Looks like a physical block wasn't page sized?");
-    return 0;
-  }
-  unsigned int addr = free_physical->start;
-  free_physical->start += PAGE_SIZE;
-  if (free_physical->start >= free_physical->end) {
-    // Pop off empty blocks.
-    --mem_cfg->physical_page_stack_vtop;
-  }
-  return addr;
-}
-
-void push_physical(unsigned int mem, MemCfg* mem_cfg) {
-  // TODO: Check for stack overflow.
-  MemorySpan* free_physical = mem_cfg->physical_page_stack_vtop - 1;
-  if (mem + PAGE_SIZE == free_physical->start) {
-    // mem is at the beginning of the top chunk (somewhat likely).
-    free_physical->start -= PAGE_SIZE;
-  } else if (mem == free_physical->end) {
-    // mem is at the end of the top chunk (pretty unlikely).
-    free_physical->end += PAGE_SIZE;
-  } else {
-    // mem is not touching the top chunk (pretty likely).
-    // So add a new free chunk.
-    ++mem_cfg->physical_page_stack_vtop;
-    free_physical = mem_cfg->physical_page_stack_vtop - 1;
-    free_physical->start = mem;
-    free_physical->end = mem + PAGE_SIZE;
-  }
-}
-
-int get_buddy_bit(unsigned int buddy_tree_vaddr, unsigned int buddy_index) {
-  unsigned char buddy_byte =
-      ((unsigned char*)buddy_tree_vaddr)[buddy_index >> 3];
-  return (buddy_byte >> (buddy_index & 0x7)) & 0x1;
-}
-
-void set_buddy_bit(unsigned int buddy_tree_vaddr, unsigned int buddy_index,
-                   unsigned int bit_val) {
-  unsigned char buddy_bit_in_byte = 0x1 << (buddy_index & 0x7);
-  if (bit_val) {
-    ((unsigned char*)buddy_tree_vaddr)[buddy_index >> 3] |= buddy_bit_in_byte;
-  } else {
-    ((unsigned char*)buddy_tree_vaddr)[buddy_index >> 3] &=
-        (~buddy_bit_in_byte);
-  }
-}
-
-void claim_buddy_index(unsigned int buddy_tree_vaddr,
-                       unsigned int buddy_index) {
-  // Reminder that buddy_index = 0 is not valid, and that the root is at index =
-  // 1.
-  while (buddy_index && !get_buddy_bit(buddy_tree_vaddr, buddy_index)) {
-    set_buddy_bit(buddy_tree_vaddr, buddy_index, 1);
-    // Go up to the parent next.
-    buddy_index >>= 1;
-  }
-}
-
-void claim_buddy_vaddr(unsigned int buddy_tree_vaddr,
-                       unsigned int claimed_vaddr) {
-  if (claimed_vaddr & PAGE_MASK) {
-    LOG_HEX(ERROR,
-            "Tried to claim non-page virtual address from the buddy tree: ",
-            claimed_vaddr);
-    return;
+// Sets up the physical frame allocator: maps a Frame for every physical frame
+// up to the highest free address right after the end of the kernel (growing
+// kernel_location->virtual_end), then hands all remaining free spans on the
+// boot stack over to it.
+void make_frame_allocator(KernelLocation* kernel_location, MemCfg* mem_cfg) {
+  unsigned int max_paddr = 0;
+  for (MemorySpan* span = mem_cfg->physical_page_stack_vaddr;
+       span < mem_cfg->physical_page_stack_vtop; ++span) {
+    if (span->end > max_paddr) {
+      max_paddr = span->end;
+    }
   }
-  // Start the index at the lowest level. buddy_index at 0 is not a valid value,
-  // the root node is at index = 1.
-  unsigned int buddy_index =
-      (1 << (32 - PAGE_BITS)) + (claimed_vaddr >> PAGE_BITS);
-  if (get_buddy_bit(buddy_tree_vaddr, buddy_index)) {
-    LOG_HEX(ERROR, "claimed_vaddr was already claimed: ", claimed_vaddr);
-    return;
+  unsigned int num_frames = max_paddr >> PAGE_BITS;
+  unsigned int frames_vaddr = round_to_next_page(kernel_location->virtual_end);
+  unsigned int frames_size = round_to_next_page(frames_array_size(num_frames));
+  LOG_HEX(INFO, "frames_vaddr: ", frames_vaddr);
+  LOG_HEX(INFO, "num_frames: ", num_frames);
+  kernel_location->virtual_end = frames_vaddr + frames_size;
+  for (unsigned int vaddr = frames_vaddr; vaddr < frames_vaddr + frames_size;
+       vaddr += PAGE_SIZE) {
+    map_page(vaddr, pop_physical(mem_cfg));
   }
-  claim_buddy_index(buddy_tree_vaddr, buddy_index);
-}
+  frames_init(&mem_cfg->frame_allocator, (void*)frames_vaddr, num_frames);
 
-void free_buddy_index(unsigned int buddy_tree_vaddr, unsigned int buddy_index) {
-  while (buddy_index && get_buddy_bit(buddy_tree_vaddr, buddy_index)) {
-    // Mark the memory as free.
-    set_buddy_bit(buddy_tree_vaddr, buddy_index, 0);
-    // Check to see if the buddy is taken.
-    if (get_buddy_bit(buddy_tree_vaddr, buddy_index ^ 1)) {
-      // If it's taken, no further action is needed.
-      return;
-    }
-    // If the buddy is also free, free the parent chunk.
-    buddy_index >>= 1;
+  for (MemorySpan* span = mem_cfg->physical_page_stack_vaddr;
+       span < mem_cfg->physical_page_stack_vtop; ++span) {
+    frames_add_range(&mem_cfg->frame_allocator, span->start, span->end);
   }
+  // Everything on the stack belongs to the frame allocator now.
+  mem_cfg->physical_page_stack_vtop = mem_cfg->physical_page_stack_vaddr;
+  LOG_HEX(INFO, "Free physical frames: ", mem_cfg->frame_allocator.num_free);
 }
 
-void free_buddy_vaddr(unsigned int buddy_tree_vaddr, unsigned int freed_vaddr) {
-  if (freed_vaddr & PAGE_MASK) {
-    LOG_HEX(ERROR,
-            "Tried to free non-page virtual address from the buddy tree: ",
-            freed_vaddr);
-    return;
-  }
-  // Start the index at the lowest level. buddy_index at 0 is not a valid value,
-  // the root node is at index = 1.
-  unsigned int buddy_index =
-      (1 << (32 - PAGE_BITS)) + (freed_vaddr >> PAGE_BITS);
-  if (!get_buddy_bit(buddy_tree_vaddr, buddy_index)) {
-    LOG_HEX(ERROR, "freed_vaddr was already freed: ", freed_vaddr);
-    return;
-  }
-  free_buddy_index(buddy_tree_vaddr, buddy_index);
+unsigned int do_alloc_frames(unsigned int order) {
+  return frames_alloc(&mem_cfg_.frame_allocator, order);
 }
 
-void zero_page(unsigned int vaddr) {
-  LOG_HEX(INFO, "Zeroing: ", vaddr);
-  unsigned int* zeroing_addr = (unsigned int*)vaddr;
-  for (unsigned int i = 0; i < PAGE_SIZE / sizeof(unsigned int); ++i) {
-    *zeroing_addr = 0;
-    ++zeroing_addr;
-  }
+void do_free_frames(unsigned int paddr, unsigned int order) {
+  frames_free(&mem_cfg_.frame_allocator, paddr, order);
 }
 
 void make_virtual_buddy_tree(KernelLocation kernel_location, MemCfg* mem_cfg) {
-  // TODO: This is gonna assume our kernel is tiny (<4MB) and that the buddy
-  // tree will fit along side it in a 4MB page.
-  mem_cfg->buddy_tree_vaddr = kernel_location.virtual_end;
-  LOG_HEX(INFO, "buddy_tree_vaddr: ", mem_cfg->buddy_tree_vaddr);
-  unsigned int buddy_tree_size_bytes = 0x40000;  // 256 kb
+  unsigned int buddy_tree_vaddr = kernel_location.virtual_end;
+  LOG_HEX(INFO, "buddy_tree_vaddr: ", buddy_tree_vaddr);
+  unsigned int buddy_tree_size_bytes = round_to_next_page(buddy_tree_size());
   kernel_location.virtual_end += buddy_tree_size_bytes;
-  for (unsigned int vaddr = mem_cfg->buddy_tree_vaddr;
-       vaddr < mem_cfg->buddy_tree_vaddr + buddy_tree_size_bytes;
-       vaddr += PAGE_SIZE) {
-    unsigned int paddr = pop_physical(mem_cfg);
-    map_page(vaddr, paddr, mem_cfg);
-    // Zero all the memory (zero means free)
-    zero_page(vaddr);
+  for (unsigned int vaddr = buddy_tree_vaddr;
+       vaddr < buddy_tree_vaddr + buddy_tree_size_bytes; vaddr += PAGE_SIZE) {
+    unsigned int paddr = alloc_frame(mem_cfg);
+    map_page(vaddr, paddr);
   }
-  // Now claim the kernel space.
-  for (unsigned int vaddr = kernel_location.virtual_start;
+  buddy_init(&mem_cfg->buddy_tree, (void*)buddy_tree_vaddr);
+  // Claim the first 4MB so that no allocation ever ends up at (or near) address
+  // 0. This also keeps page directory entry 0 free, which the loader uses for
+  // its temporary identity mapping.
+  buddy_claim_vaddr(&mem_cfg->buddy_tree, 0, 22);
+  // The last 4MB is where the page tables show up.
+  buddy_claim_vaddr(&mem_cfg->buddy_tree, PAGE_TABLES_VADDR, 22);
+  // Now claim the whole direct map window (whether or not there's memory
+  // behind all of it), and then the boot structures mapped after it. The
+  // window needn't be a power of two, so each set bit of its size is a block
+  // of its own, biggest first so they all stay naturally aligned.
+  unsigned int direct_map_claimed = 0;
+  for (int order = 31; order >= PAGE_BITS; --order) {
+    if (DIRECT_MAP_MAX_SIZE & (1u << order)) {
+      buddy_claim_vaddr(&mem_cfg->buddy_tree,
+                        DIRECT_MAP_VADDR + direct_map_claimed, order);
+      direct_map_claimed += 1u << order;
+    }
+  }
+  for (unsigned int vaddr = BOOT_VADDR;
        vaddr < kernel_location.virtual_end; vaddr += PAGE_SIZE) {
-    claim_buddy_vaddr(mem_cfg->buddy_tree_vaddr, vaddr);
+    if (!buddy_claim_vaddr(&mem_cfg->buddy_tree, vaddr, PAGE_BITS)) {
+      LOG_HEX(ERROR, "Kernel vaddr was already claimed: ", vaddr);
+    }
   }
 }
 
@@ -427,148 +1022,284 @@ int log2(unsigned int v) {
   return r;
 }
 
-// Finds and claims a block of VRAM of exactly 2^power_2 bytes and returns its
-// address.
-// BUG: This doesn't actually mark lower levels of the buddy tree, so if you
-// try and claim a large block and then a small block it will allocate you
-// overlapping areas of vmem.
-unsigned int claim_vblock_of_power_2(unsigned int buddy_tree_vaddr,
-                                     unsigned int power_2) {
-  if (power_2 < PAGE_BITS) {
-    return 0;
-  }
-  // Find the row of the tree we're searching. Max log2 will be rounded up to 32
-  // (meaning we need 4 gigs of memory, ha), resulting in row 1, the first row
-  // of the tree.  Row 0 (buddy_index 0) is an invalid entry.
-  int row = 33 - power_2;
-  int row_root = 1 << (row - 1);
-  for (int index = row_root; index < (row_root << 2); ++index) {
-    if (!get_buddy_bit(buddy_tree_vaddr, index)) {
-      claim_buddy_index(buddy_tree_vaddr, index);
-      return (index - row_root) << power_2;
-    }
+// The order of the smallest vblock that holds size bytes.
+int vblock_order(unsigned int size) {
+  // Round up to the next log2 e.g. 5 bytes -> 3
+  int log2_roundup = log2(size - 1) + 1;
+  if (log2_roundup < PAGE_BITS) {
+    log2_roundup = PAGE_BITS;
   }
-  return 0;  // Not available.
+  return log2_roundup;
 }
 
 // Finds a block of vram of at least the given size and marks it as claimed in
 // the buddy tree. Returns the address of the VRAM and sets claimed_size (if
 // non-null) to the claimed size.
-unsigned int claim_vblock_of_size(unsigned int buddy_tree_vaddr,
+unsigned int claim_vblock_of_size(BuddyTree* buddy_tree,
                                   unsigned int requested_size,
                                   unsigned int* claimed_size) {
-  // Round up to the next log2 e.g. 5 bytes -> 3
-  int log2_roundup = log2(requested_size - 1) + 1;
-  unsigned int mem = claim_vblock_of_power_2(buddy_tree_vaddr, log2_roundup);
+  int log2_roundup = vblock_order(requested_size);
+  unsigned int mem = buddy_claim_block(buddy_tree, log2_roundup);
   if (claimed_size) {
     *claimed_size = 1 << log2_roundup;
   }
   return mem;
 }
 
-// Add a page table to the pd for the vaddr if it needs it.
-void add_page_table(unsigned int vaddr, MemCfg* mem_cfg) {
-  unsigned int pde = (vaddr >> 22) & 0x3FF;
-  if (!(page_directory[pde] & 1)) {
-    LOG(INFO,
-        "Tried to map virtual address that had no page table. Mapping a new "
-        "page table.");
-    LOG_HEX(INFO, "Adding a page table for vaddr: ", vaddr);
-    LOG_HEX(INFO, "  which is pde: : ", pde);
-    // Find an unused physical chunk
-    unsigned int paddr = pop_physical(mem_cfg);
-    LOG_HEX(INFO, "Found paddr for new page table: ", paddr);
-    LOG_HEX(INFO, " staging_pte: ", mem_cfg->staging_pte);
-    LOG_HEX(INFO, " staging_vaddr: ", mem_cfg->staging_vaddr);
-    // Map it into the staging area so we can...
-    os_page_table[mem_cfg->staging_pte] = paddr | 0x3;
-    invlpg(mem_cfg->staging_vaddr);
-    // ... zero it.
-    zero_page(mem_cfg->staging_vaddr);
-    // Map it into the page directory.
-    page_directory[pde] = paddr | 0x3;
+unsigned int do_alloc_page_block(unsigned int size,
+                                 unsigned int* claimed_size) {
+  if (size < PAGE_SIZE) {
+    size = PAGE_SIZE;
+  }
+  unsigned int block_size;
+  unsigned int mem =
+      claim_vblock_of_size(&mem_cfg_.buddy_tree, size, &block_size);
+  if (!mem) {
+    LOG_HEX(ERROR, "No virtual memory left for a block of size ", size);
+    return 0;
+  }
+  if (!map_range(mem, block_size / PAGE_SIZE, PAGE_WRITABLE)) {
+    buddy_free_block(&mem_cfg_.buddy_tree, mem, log2(block_size));
+    return 0;
   }
+  if (claimed_size) {
+    *claimed_size = block_size;
+  }
+  return mem;
 }
 
-// This always allocates in 4kb chunks. We throw a MemBlockInfo at the front of
-// the allocated chunk to keep track of metadata.
-void *malloc(unsigned int size) {
+unsigned int do_reserve_page_block(unsigned int size,
+                                   unsigned int* claimed_size) {
+  if (size < PAGE_SIZE) {
+    size = PAGE_SIZE;
+  }
+  unsigned int block_size;
+  unsigned int mem =
+      claim_vblock_of_size(&mem_cfg_.buddy_tree, size, &block_size);
+  if (!mem) {
+    LOG_HEX(ERROR, "No virtual memory left for a block of size ", size);
+    return 0;
+  }
+  if (!reserve_range(mem, block_size / PAGE_SIZE, PAGE_WRITABLE)) {
+    buddy_free_block(&mem_cfg_.buddy_tree, mem, log2(block_size));
+    return 0;
+  }
+  if (claimed_size) {
+    *claimed_size = block_size;
+  }
+  return mem;
+}
+
+void do_free_page_block(unsigned int mem, unsigned int size) {
+  unmap_range(mem, size / PAGE_SIZE);
+  buddy_free_block(&mem_cfg_.buddy_tree, mem, log2(size));
+}
+
+// Small requests are carved out of slab pages (see slab.c). Anything bigger
+// gets its own block of 4kb pages, with a MemBlockInfo at the front of the
+// block to keep track of metadata. The block is only reserved, so pages get
+// frames as they're first touched.
+void *do_malloc(unsigned int size) {
+  if (size <= SLAB_MAX_OBJECT_SIZE) {
+    return slab_alloc(size);
+  }
   unsigned int size_with_meminfo = size + sizeof(MemBlockInfo);
   // Check for overflow.
   if (size_with_meminfo < size) {
     return (void*)0;
   }
-  if (size_with_meminfo < PAGE_SIZE) {
-    size_with_meminfo = PAGE_SIZE;
-  }
   unsigned int claimed_size;
-  unsigned int mem = claim_vblock_of_size(mem_cfg_.buddy_tree_vaddr,
-                                          size_with_meminfo, &claimed_size);
-  // TODO: Handle the case of going over a page boundary (or multiple).
-  add_page_table(mem, &mem_cfg_);
-  for (unsigned int vaddr = mem; vaddr < mem + claimed_size;
-       vaddr += PAGE_SIZE) {
-    unsigned int paddr = pop_physical(&mem_cfg_);
-    map_page(vaddr, paddr, &mem_cfg_);
+  unsigned int mem = reserve_page_block(size_with_meminfo, &claimed_size);
+  if (!mem) {
+    return (void*)0;
   }
   MemBlockInfo* info = (MemBlockInfo*)mem;
   info->size = claimed_size;
   return (void*)(info + 1);
 }
 
-void free(void* mem) {
+void do_free(void* mem) {
+  if (!mem) {
+    return;
+  }
+  if (is_slab_page((unsigned int)mem & ~PAGE_MASK)) {
+    slab_free(mem);
+    return;
+  }
   MemBlockInfo* info = (MemBlockInfo*)mem - 1;
   if ((unsigned int)info & 0xFFF) {
     LOG_HEX(ERROR, "Tried to free() a non-page aligned chunk: ",
             (unsigned int)info);
     return;
   }
-  for (unsigned int vaddr = (unsigned int)info;
-       vaddr < (unsigned int)info + (1 << info->size); vaddr += PAGE_SIZE) {
-    free_buddy_vaddr(mem_cfg_.buddy_tree_vaddr, vaddr);
-    unsigned int paddr = translate_vaddr(vaddr, &mem_cfg_);
-    // translate_vaddr returns 0xFFFFFFFF on error.
-    if (paddr != 0xFFFFFFFF) {
-      push_physical(paddr, &mem_cfg_);
+  free_page_block((unsigned int)info, info->size);
+}
+
+// Grows the block at mem from 2^order bytes to 2^new_order bytes without
+// moving it, by claiming its buddy (which must be the upper half of the
+// doubled block) at each size along the way. Returns 0, with nothing claimed,
+// if one of them isn't free.
+int grow_vblock_in_place(unsigned int mem, int order, int new_order) {
+  int claimed = order;
+  while (claimed < new_order) {
+    unsigned int buddy = mem + (1u << claimed);
+    if ((mem & (1u << claimed)) ||
+        !buddy_claim_vaddr(&mem_cfg_.buddy_tree, buddy, claimed)) {
+      break;
     }
+    ++claimed;
+  }
+  if (claimed == new_order) {
+    return 1;
   }
+  while (claimed > order) {
+    --claimed;
+    buddy_free_block(&mem_cfg_.buddy_tree, mem + (1u << claimed), claimed);
+  }
+  return 0;
 }
 
-unsigned int round_to_next_page(unsigned int addr) {
-  return (addr + PAGE_SIZE - 1) & ~PAGE_MASK;
+// Page blocks are resized without copying any of their bytes:
+//   - Shrinking unmaps and frees the upper halves of the block.
+//   - Growing claims the buddies above the block if they're free, and reserves
+//     them for demand paging.
+//   - Otherwise the block moves to a new virtual block, with its page table
+//     entries (or whole page tables) moved over rather than its memory copied.
+// In every case the claimed block stays a single buddy block, since claiming
+// the buddies of a block and then freeing it as their parent is the same as
+// claiming the parent in the first place.
+void* do_realloc(void* mem, unsigned int size) {
+  if (!mem) {
+    return malloc(size);
+  }
+  if (!size) {
+    free(mem);
+    return (void*)0;
+  }
+  if (is_slab_page((unsigned int)mem & ~PAGE_MASK)) {
+    unsigned int old_size = slab_object_size(mem);
+    if (size <= old_size) {
+      return mem;
+    }
+    void* new_mem = malloc(size);
+    if (new_mem) {
+      memcpy(new_mem, mem, old_size);
+      slab_free(mem);
+    }
+    return new_mem;
+  }
+
+  MemBlockInfo* info = (MemBlockInfo*)mem - 1;
+  if ((unsigned int)info & PAGE_MASK) {
+    LOG_HEX(ERROR, "Tried to realloc() a non-page aligned chunk: ",
+            (unsigned int)info);
+    return (void*)0;
+  }
+  unsigned int size_with_meminfo = size + sizeof(MemBlockInfo);
+  if (size_with_meminfo < size) {
+    return (void*)0;
+  }
+  unsigned int block = (unsigned int)info;
+  unsigned int old_size = info->size;
+  int order = log2(old_size);
+  int new_order = log2(size_with_meminfo - 1) + 1;
+  if (new_order < PAGE_BITS) {
+    new_order = PAGE_BITS;
+  }
+  if (new_order > BUDDY_MAX_ORDER) {
+    return (void*)0;
+  }
+  unsigned int new_size = 1u << new_order;
+  if (new_order == order) {
+    return mem;
+  }
+
+  if (new_order < order) {
+    // Give back the upper halves, from the biggest one down.
+    for (int half = order - 1; half >= new_order; --half) {
+      unmap_range(block + (1u << half), (1u << half) / PAGE_SIZE);
+      buddy_free_block(&mem_cfg_.buddy_tree, block + (1u << half), half);
+    }
+    info->size = new_size;
+    return mem;
+  }
+
+  if (grow_vblock_in_place(block, order, new_order)) {
+    if (!reserve_range(block + old_size, (new_size - old_size) / PAGE_SIZE,
+                       PAGE_WRITABLE)) {
+      for (int half = new_order - 1; half >= order; --half) {
+        buddy_free_block(&mem_cfg_.buddy_tree, block + (1u << half), half);
+      }
+      return (void*)0;
+    }
+    info->size = new_size;
+    return mem;
+  }
+
+  // Move it. The new block starts out fully reserved, and then trades the
+  // reservations for its first old_size bytes with the old block's pages.
+  unsigned int new_block = reserve_page_block(size_with_meminfo, 0);
+  if (!new_block) {
+    return (void*)0;
+  }
+  if (!swap_range(block, new_block, old_size / PAGE_SIZE)) {
+    free_page_block(new_block, new_size);
+    return (void*)0;
+  }
+  // The old block now only holds reservations, so this frees no frames.
+  free_page_block(block, old_size);
+  info = (MemBlockInfo*)new_block;
+  info->size = new_size;
+  return (void*)(info + 1);
 }
 
 void init_paging(multiboot_info_t* multiboot_info,
                  KernelLocation kernel_location) {
-  // TODO: Translate the physical address of the mmap to the virtual address in
-  // a better way.
-  unsigned long mmap_vaddr = multiboot_info->mmap_addr + KERNEL_VADDR;
-
-  // First grab the staging page, which is used to populate page tables and
-  // other things that we don't need to keep in the vaddr space. Round up to the
-  // next page since the kernel end doesn't have to fall on a page boundary.
-  mem_cfg_.staging_vaddr = round_to_next_page(kernel_location.virtual_end);
-  mem_cfg_.staging_pte   = (mem_cfg_.staging_vaddr >> 12) & 0x3FF;
-  kernel_location.virtual_end = mem_cfg_.staging_vaddr + PAGE_SIZE;
-
-  // Map the physical page stack to the first virtual page after the end of the
-  // kernel. It should be able to grow this way.
+  unsigned long mmap_vaddr =
+      (unsigned long)phys_to_virt(multiboot_info->mmap_addr);
+
+  // Point the last page directory entry back at the page directory, so that
+  // page tables can be edited through the window at PAGE_TABLES_VADDR.
+  page_directory[RECURSIVE_PDE] = virt_to_phys(page_directory) | 0x3;
+
+  make_direct_map(mmap_vaddr, multiboot_info->mmap_length);
+
+  // The loader maps the kernel image with a single 4MB page at KERNEL_VADDR,
+  // so it had better fit in one.
+  if (kernel_location.physical_end > LARGE_PAGE_SIZE) {
+    LOG_HEX(ERROR, "Kernel doesn't fit in its 4MB page, it ends at ",
+            kernel_location.physical_end);
+    return;
+  }
+
+  // The boot structures (the physical page stack, the Frame array and the
+  // buddy tree) are mapped with 4kb pages at BOOT_VADDR. The first page table
+  // for them comes from the kernel image, since there's no allocator to get
+  // one from yet.
+  page_directory[BOOT_VADDR >> 22] = virt_to_phys(os_page_table) | 0x3;
+
+  // Map the physical page stack to the first virtual page of that space. It
+  // should be able to grow this way.
   // TODO: Seems like a good idea to just store this stack as a linked list in
   // the unused RAM itself.
-  mem_cfg_.physical_page_stack_vaddr =
-      (MemorySpan*)round_to_next_page(kernel_location.virtual_end);
+  mem_cfg_.physical_page_stack_vaddr = (MemorySpan*)BOOT_VADDR;
   LOG_HEX(INFO, "page_stack_vaddr = ",
-          (unsigned int)kernel_location.virtual_end);
+          (unsigned int)mem_cfg_.physical_page_stack_vaddr);
   kernel_location.virtual_end =
       (unsigned int)mem_cfg_.physical_page_stack_vaddr + PAGE_SIZE;
 
-  // Space for the kernal and the modules.
-  MemorySpan reserved_blocks[1 + NUM_MODULES];
+  // Space for low memory, the kernal and the modules.
+  MemorySpan reserved_blocks[2 + NUM_MODULES];
+
+  // First the low 1MB, which holds the real mode IVT and BIOS data and is full
+  // of holes. This also keeps physical address 0 from ever being handed out.
+  reserved_blocks[0].start = 0;
+  reserved_blocks[0].end = 0x100000;
+
+  // Then the kernel.
+  reserved_blocks[1].start = kernel_location.physical_start;
+  reserved_blocks[1].end = kernel_location.physical_end;
 
-  // First the kernel.
-  reserved_blocks[0].start = kernel_location.physical_start;
-  reserved_blocks[0].end = kernel_location.physical_end;
-  
   // Then the modules.
   if (multiboot_info->mods_count != NUM_MODULES) {
     LOG_HEX(ERROR, "Unexpected number of modules: ",
@@ -576,16 +1307,23 @@ void init_paging(multiboot_info_t* multiboot_info,
     return;
   }
   for (unsigned int i = 0; i < multiboot_info->mods_count; ++i) {
-    module_t* module =
-        (module_t*)(multiboot_info->mods_addr + KERNEL_VADDR) + i;
-    reserved_blocks[i + 1].start = module->mod_start;
+    module_t* module = (module_t*)phys_to_virt(multiboot_info->mods_addr) + i;
+    reserved_blocks[i + 2].start = module->mod_start;
     // mod_start is page aligned, but mod_end isn't so we have to round up.
-    reserved_blocks[i + 1].end = round_to_next_page(module->mod_end);
+    reserved_blocks[i + 2].end = round_to_next_page(module->mod_end);
   }
   make_free_physical_stack(reserved_blocks,
-                           NUM_MODULES + 1, mmap_vaddr,
+                           NUM_MODULES + 2, mmap_vaddr,
                            multiboot_info->mmap_length, &mem_cfg_);
+  make_frame_allocator(&kernel_location, &mem_cfg_);
+  // The scratch page goes right after the Frame array, with its page table
+  // set up now so using it never needs to allocate.
+  mem_cfg_.scratch_vaddr = kernel_location.virtual_end;
+  kernel_location.virtual_end += PAGE_SIZE;
+  add_page_table(mem_cfg_.scratch_vaddr, &mem_cfg_);
   make_virtual_buddy_tree(kernel_location, &mem_cfg_);
+  init_slab();
+  register_interrupt_handler(PAGE_FAULT_VECTOR, page_fault_handler, 0);
 }
 
 unsigned int map_module(module_t* module) {
@@ -594,21 +1332,222 @@ unsigned int map_module(module_t* module) {
   unsigned int mod_end = round_to_next_page(module->mod_end);
   LOG_HEX(INFO, "map_module: mod_start: ", mod_start);
   LOG_HEX(INFO, "              mod_end: ", mod_end);
+  if (mod_end <= direct_map_size_) {
+    return (unsigned int)phys_to_virt(mod_start);
+  }
   unsigned int module_vaddr =
-      claim_vblock_of_size(mem_cfg_.buddy_tree_vaddr, mod_end - mod_start,
+      claim_vblock_of_size(&mem_cfg_.buddy_tree, mod_end - mod_start,
                            0 /* don't care about size */);
-  add_page_table(module_vaddr, &mem_cfg_);
-  unsigned int vaddr = module_vaddr;
-  for (unsigned int paddr = mod_start; paddr < mod_end; paddr += PAGE_SIZE) {
-    map_page(vaddr, paddr, &mem_cfg_);
-    vaddr += PAGE_SIZE;
-  }
+  map_physical_range(module_vaddr, mod_start, (mod_end - mod_start) / PAGE_SIZE,
+                     PAGE_WRITABLE);
   return module_vaddr;
 }
 
+void* do_map_physical(unsigned int paddr, unsigned int size,
+                      unsigned int flags) {
+  unsigned int start = paddr & ~PAGE_MASK;
+  unsigned int end = round_to_next_page(paddr + size);
+  // Cached mappings of RAM can just use the direct map. Anything else would
+  // alias it with different caching, which the CPU doesn't like. The direct
+  // map is kernel only, so user mappings always get their own.
+  if (!(flags & (PAGE_WRITE_THROUGH | PAGE_CACHE_DISABLE | PAGE_USER)) &&
+      end <= direct_map_size_) {
+    return phys_to_virt(paddr);
+  }
+  unsigned int block_size;
+  unsigned int vaddr =
+      claim_vblock_of_size(&mem_cfg_.buddy_tree, end - start, &block_size);
+  if (!vaddr) {
+    LOG_HEX(ERROR, "No virtual memory left to map physical address ", paddr);
+    return 0;
+  }
+  if (!map_physical_range(vaddr, start, (end - start) / PAGE_SIZE, flags)) {
+    buddy_free_block(&mem_cfg_.buddy_tree, vaddr, log2(block_size));
+    return 0;
+  }
+  return (void*)(vaddr + (paddr & PAGE_MASK));
+}
+
+void do_unmap_physical(void* vaddr, unsigned int size) {
+  unsigned int v = (unsigned int)vaddr;
+  if (v >= DIRECT_MAP_VADDR && v - DIRECT_MAP_VADDR < direct_map_size_) {
+    return;
+  }
+  unsigned int start = v & ~PAGE_MASK;
+  unsigned int end = round_to_next_page(v + size);
+  unmap_physical_range(start, (end - start) / PAGE_SIZE);
+  buddy_free_block(&mem_cfg_.buddy_tree, start, vblock_order(end - start));
+}
+
 // There needs to be a struct to keep track of process metadata:
 //   - Page directory for the program (program code and data loaded at 0x0 and
 //     OS pages pre-mapped at 0xC0000000).
 //   - Stack location (starting at 0xBFFFFFFB and growing down).
 //   - Future: Allocated heap pages and a way to determine which have free space
 //     remaining in them.
+
+// # Locking
+// Everything above shares the page tables, the buddy tree, the frame allocator
+// and the slabs without any locking of its own, so the public entry points
+// take memory_lock_ around the do_* functions that do the work, with
+// preemption disabled so a thread can't be switched out while holding it.
+// Calls between them (and page faults taken inside them) just nest, since the
+// CPU holding the lock can take it again.
+
+Spinlock memory_lock_;
+// The index + 1 of the CPU holding memory_lock_, or 0, and how many times it
+// has taken it.
+volatile unsigned int memory_lock_owner_ = 0;
+unsigned int memory_lock_depth_ = 0;
+
+void lock_memory() {
+  preempt_disable();
+  unsigned int owner = this_cpu()->index + 1;
+  // Only this CPU could have stored its own index there, and it would have
+  // cleared it again before letting go.
+  if (memory_lock_owner_ != owner) {
+    spin_lock(&memory_lock_);
+    memory_lock_owner_ = owner;
+  }
+  ++memory_lock_depth_;
+}
+
+void unlock_memory() {
+  if (--memory_lock_depth_ == 0) {
+    memory_lock_owner_ = 0;
+    spin_unlock(&memory_lock_);
+  }
+  preempt_enable();
+}
+
+void map_page(unsigned int vaddr, unsigned int paddr) {
+  lock_memory();
+  do_map_page(vaddr, paddr);
+  unlock_memory();
+}
+
+void unmap_page(unsigned int vaddr) {
+  lock_memory();
+  do_unmap_page(vaddr);
+  unlock_memory();
+}
+
+int map_range(unsigned int vaddr, unsigned int npages, unsigned int flags) {
+  lock_memory();
+  int mapped = do_map_range(vaddr, npages, flags);
+  unlock_memory();
+  return mapped;
+}
+
+int map_physical_range(unsigned int vaddr, unsigned int paddr,
+                       unsigned int npages, unsigned int flags) {
+  lock_memory();
+  int mapped = do_map_physical_range(vaddr, paddr, npages, flags);
+  unlock_memory();
+  return mapped;
+}
+
+void unmap_range(unsigned int vaddr, unsigned int npages) {
+  lock_memory();
+  do_unmap_range(vaddr, npages);
+  unlock_memory();
+}
+
+void unmap_physical_range(unsigned int vaddr, unsigned int npages) {
+  lock_memory();
+  do_unmap_physical_range(vaddr, npages);
+  unlock_memory();
+}
+
+int reserve_range(unsigned int vaddr, unsigned int npages,
+                  unsigned int flags) {
+  lock_memory();
+  int reserved = do_reserve_range(vaddr, npages, flags);
+  unlock_memory();
+  return reserved;
+}
+
+unsigned int alloc_zeroed_frame() {
+  lock_memory();
+  unsigned int paddr = do_alloc_zeroed_frame();
+  unlock_memory();
+  return paddr;
+}
+
+unsigned int refill_zeroed_frames(unsigned int max_frames) {
+  lock_memory();
+  unsigned int added = do_refill_zeroed_frames(max_frames);
+  unlock_memory();
+  return added;
+}
+
+unsigned int alloc_frames(unsigned int order) {
+  lock_memory();
+  unsigned int paddr = do_alloc_frames(order);
+  unlock_memory();
+  trace(TRACE_ALLOC_FRAMES, paddr, order);
+  return paddr;
+}
+
+void free_frames(unsigned int paddr, unsigned int order) {
+  trace(TRACE_FREE_FRAMES, paddr, order);
+  lock_memory();
+  do_free_frames(paddr, order);
+  unlock_memory();
+}
+
+unsigned int alloc_page_block(unsigned int size, unsigned int* claimed_size) {
+  lock_memory();
+  unsigned int mem = do_alloc_page_block(size, claimed_size);
+  unlock_memory();
+  return mem;
+}
+
+unsigned int reserve_page_block(unsigned int size,
+                                unsigned int* claimed_size) {
+  lock_memory();
+  unsigned int mem = do_reserve_page_block(size, claimed_size);
+  unlock_memory();
+  return mem;
+}
+
+void free_page_block(unsigned int vaddr, unsigned int size) {
+  lock_memory();
+  do_free_page_block(vaddr, size);
+  unlock_memory();
+}
+
+void* malloc(unsigned int size) {
+  lock_memory();
+  void* mem = do_malloc(size);
+  unlock_memory();
+  trace(TRACE_MALLOC, (unsigned int)mem, size);
+  return mem;
+}
+
+void free(void* mem) {
+  trace(TRACE_FREE, (unsigned int)mem, 0);
+  lock_memory();
+  do_free(mem);
+  unlock_memory();
+}
+
+void* realloc(void* mem, unsigned int size) {
+  lock_memory();
+  void* new_mem = do_realloc(mem, size);
+  unlock_memory();
+  return new_mem;
+}
+
+void* map_physical(unsigned int paddr, unsigned int size, unsigned int flags) {
+  lock_memory();
+  void* vaddr = do_map_physical(paddr, size, flags);
+  unlock_memory();
+  return vaddr;
+}
+
+void unmap_physical(void* vaddr, unsigned int size) {
+  lock_memory();
+  do_unmap_physical(vaddr, size);
+  unlock_memory();
+}
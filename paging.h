@@ -5,6 +5,9 @@
 
 #define NUM_MODULES 1
 #define KERNEL_VADDR 0xC0000000
+// Physical memory is mapped 1:1 starting at KERNEL_VADDR, up to this much of
+// it. See phys_to_virt().
+#define DIRECT_MAP_MAX_SIZE 0x30000000
 
 typedef struct __attribute__((packed)) {
   unsigned int physical_start;
@@ -13,20 +16,136 @@ typedef struct __attribute__((packed)) {
   unsigned int virtual_end;
 } KernelLocation;
 
+// Page table entry flags.
+#define PAGE_PRESENT  0x1
+#define PAGE_WRITABLE 0x2
+#define PAGE_USER     0x4
+#define PAGE_WRITE_THROUGH 0x8
+#define PAGE_CACHE_DISABLE 0x10
+
 void init_paging(multiboot_info_t* multiboot_info,
                  KernelLocation kernel_location);
 
-// Allocates a block of at least "size" bytes. Currently will allocate entire
-// 4kb pages at a time (note: the first few bytes of the 4kb are used for
-// bookkeeping), and doesn't support malloc'ing >4MB blocks.
-// TODO: We should find a way of keeping track of recently allocated pages for
-// per program so we can keep taking from the same page while it contains free
-// space.
+// Maps the 4kb virtual page at vaddr to the physical page at paddr, adding a
+// page table for it if needed.
+void map_page(unsigned int vaddr, unsigned int paddr);
+
+// Removes the mapping for the 4kb virtual page at vaddr, if there is one.
+void unmap_page(unsigned int vaddr);
+
+// Grabs the 4kb physical page currently associated with the given vaddr.
+// Returns 0xFFFFFFFF on error.
+unsigned int translate_vaddr(unsigned int vaddr);
+
+// Returns the address of the physical address paddr in the direct map, or 0
+// if it's outside of it. Only the first 4MB is covered until init_paging().
+void* phys_to_virt(unsigned int paddr);
+
+// Returns the physical address behind vaddr, which is plain arithmetic for
+// addresses in the direct map and a page table walk otherwise. Returns
+// 0xFFFFFFFF if vaddr isn't mapped.
+unsigned int virt_to_phys(const void* vaddr);
+
+// Maps npages pages starting at vaddr to newly allocated frames with the given
+// PAGE_* flags (PAGE_PRESENT is implied). Each page table is walked once and
+// the TLB is flushed once for the whole batch. Returns 0, with nothing mapped,
+// if we ran out of memory.
+int map_range(unsigned int vaddr, unsigned int npages, unsigned int flags);
+
+// Like map_range(), but maps the pages to consecutive physical pages starting
+// at paddr rather than allocating frames.
+int map_physical_range(unsigned int vaddr, unsigned int paddr,
+                       unsigned int npages, unsigned int flags);
+
+// Unmaps npages pages starting at vaddr and frees their frames.
+void unmap_range(unsigned int vaddr, unsigned int npages);
+
+// Unmaps npages pages starting at vaddr without freeing their frames, e.g. for
+// ranges mapped with map_physical_range().
+void unmap_physical_range(unsigned int vaddr, unsigned int npages);
+
+// Reserves npages pages starting at vaddr for demand paging without giving
+// them any frames yet. The first access to each page faults it in, mapped with
+// the given PAGE_* flags. Aligned 4MB chunks are faulted in as a whole 4MB
+// page when there are frames for one. Pages that are already mapped are left
+// alone. Returns 0, with nothing reserved, if we ran out of memory for page
+// tables.
+int reserve_range(unsigned int vaddr, unsigned int npages, unsigned int flags);
+
+// Called for page faults (with the faulting address from CR2). Backs the page
+// with a frame if it was reserved for demand paging, returning 1 if the access
+// can be retried and 0 if the fault was a real error.
+int handle_page_fault(unsigned int vaddr, unsigned int error_code);
+
+// Allocates a block of at least "size" bytes. Requests of up to
+// SLAB_MAX_OBJECT_SIZE bytes are packed into shared slab pages, larger ones
+// get entire 4kb pages (note: the first few bytes of the 4kb are used for
+// bookkeeping).
 void* malloc(unsigned int size);
 
 // Free's a previously malloc'd chunk of memory.
 void free(void* mem);
 
+// Resizes a malloc'd chunk to at least "size" bytes, keeping its contents (up
+// to the smaller of the two sizes). Returns the chunk's new address, which is
+// often the same one, or 0 (leaving mem alone) if there's no memory. Big
+// chunks never have their bytes copied: they grow into free neighbouring
+// virtual memory when they can, and otherwise have their pages remapped.
+void* realloc(void* mem, unsigned int size);
+
+// Claims a naturally aligned block of virtual memory of at least "size" bytes
+// and backs every page of it with physical memory, using 4MB pages for blocks
+// of 4MB or more when there are free 4MB runs of frames. Returns the vaddr of
+// the block, or 0 if there's no memory left, and sets claimed_size (if
+// non-null) to the size of the block, which is always a power of two.
+unsigned int alloc_page_block(unsigned int size, unsigned int* claimed_size);
+
+// Like alloc_page_block(), but only reserves the block: each page is backed
+// with a zeroed frame by the page fault handler the first time it's touched.
+unsigned int reserve_page_block(unsigned int size, unsigned int* claimed_size);
+
+// Unmaps and frees a block returned by alloc_page_block() or
+// reserve_page_block(). size must be the claimed size of the block.
+void free_page_block(unsigned int vaddr, unsigned int size);
+
+// Allocates 2^order physically contiguous 4kb frames, aligned to their size.
+// Returns the physical address of the first frame, or 0 if there's no block
+// that large available.
+unsigned int alloc_frames(unsigned int order);
+
+// Frees frames returned by alloc_frames(), coalescing them with their free
+// neighbours.
+void free_frames(unsigned int paddr, unsigned int order);
+
+// Returns a zeroed 4kb frame (free it with free_frames(paddr, 0)), or 0 if
+// we're out of memory. Frames come from a pool zeroed ahead of time when it has
+// any, and are zeroed on the spot otherwise.
+unsigned int alloc_zeroed_frame();
+
+// Zeroes up to max_frames more frames for the alloc_zeroed_frame() pool,
+// stopping early once it's full. Returns the number of frames added. Meant to
+// be called when there's nothing better to do.
+unsigned int refill_zeroed_frames(unsigned int max_frames);
+
+typedef struct {
+  unsigned int hits;        // alloc_zeroed_frame() calls served by the pool.
+  unsigned int misses;      // Calls that had to zero a frame themselves.
+  unsigned int num_frames;  // Frames in the pool right now.
+} ZeroedFrameStats;
+
+ZeroedFrameStats zeroed_frame_stats();
+
 unsigned int map_module(module_t* module);
 
+// Returns a virtual address for size bytes of physical memory at paddr (which
+// doesn't need to be aligned), mapped with the given PAGE_* flags. RAM in the
+// direct map comes straight from it, anything else gets a fresh mapping, which
+// is how device registers (mapped with PAGE_CACHE_DISABLE) and memory for user
+// programs (PAGE_USER) are reached.
+// Returns 0 if we're out of memory.
+void* map_physical(unsigned int paddr, unsigned int size, unsigned int flags);
+
+// Undoes map_physical(), given the same size.
+void unmap_physical(void* vaddr, unsigned int size);
+
 #endif  // PAGING_H
@@ -6,7 +6,9 @@ global page_directory
 page_directory:
   resb 4096
 
-; The page table used by the OS.
+; The page table for the 4MB at BOOT_VADDR, right after the direct map, where
+; paging.c maps its boot structures before it has an allocator to get page
+; tables from.
 global os_page_table
 os_page_table:
   resb 4096
@@ -0,0 +1,53 @@
+#include "pit.h"
+
+#include "io.h"
+
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+// Bit 0 gates channel 2, bit 1 connects it to the speaker, and bit 5 reads
+// back its output.
+#define PIT_CHANNEL2_GATE 0x61
+#define GATE_ENABLE 0x01
+#define GATE_SPEAKER 0x02
+#define GATE_OUTPUT 0x20
+
+// Command bits: channel in 7-6, access mode (3 = low byte then high byte) in
+// 5-4, operating mode in 3-1. Mode 0 counts down once and raises its output at
+// 0, and mode 2 pulses it every time it counts down, reloading the count.
+#define PIT_CMD_CHANNEL0 0x00
+#define PIT_CMD_CHANNEL2 0x80
+#define PIT_CMD_LOHI 0x30
+#define PIT_CMD_MODE0 0x00
+#define PIT_CMD_MODE2 0x04
+
+void pit_wait(unsigned int ticks) {
+  unsigned char gate = inb(PIT_CHANNEL2_GATE) & ~GATE_SPEAKER;
+  outb(PIT_CHANNEL2_GATE, gate & ~GATE_ENABLE);
+  outb(PIT_COMMAND, PIT_CMD_CHANNEL2 | PIT_CMD_LOHI | PIT_CMD_MODE0);
+  outb(PIT_CHANNEL2, ticks & 0xFF);
+  outb(PIT_CHANNEL2, (ticks >> 8) & 0xFF);
+  // Counting starts when the gate goes high.
+  outb(PIT_CHANNEL2_GATE, gate | GATE_ENABLE);
+  while (!(inb(PIT_CHANNEL2_GATE) & GATE_OUTPUT)) {
+  }
+  outb(PIT_CHANNEL2_GATE, gate & ~GATE_ENABLE);
+}
+
+void pit_oneshot(unsigned int ticks) {
+  outb(PIT_COMMAND, PIT_CMD_CHANNEL0 | PIT_CMD_LOHI | PIT_CMD_MODE0);
+  outb(PIT_CHANNEL0, ticks & 0xFF);
+  outb(PIT_CHANNEL0, (ticks >> 8) & 0xFF);
+}
+
+void pit_periodic(unsigned int ticks) {
+  outb(PIT_COMMAND, PIT_CMD_CHANNEL0 | PIT_CMD_LOHI | PIT_CMD_MODE2);
+  outb(PIT_CHANNEL0, ticks & 0xFF);
+  outb(PIT_CHANNEL0, (ticks >> 8) & 0xFF);
+}
+
+void pit_stop() {
+  // Writing the command without a count leaves the channel waiting for one,
+  // with its output low.
+  outb(PIT_COMMAND, PIT_CMD_CHANNEL0 | PIT_CMD_LOHI | PIT_CMD_MODE0);
+}
@@ -0,0 +1,26 @@
+#ifndef PIT_H
+#define PIT_H
+
+// The 8253/8254 programmable interval timer. Slow to program, but its
+// frequency is fixed, which makes it the reference everything else is
+// calibrated against.
+
+#define PIT_HZ 1193182
+#define PIT_IRQ 0
+// The longest either function can count.
+#define PIT_MAX_TICKS 0xFFFF
+
+// Busy-waits for ticks PIT ticks, using channel 2 (which isn't wired to an
+// IRQ, and is gated through port 0x61 instead).
+void pit_wait(unsigned int ticks);
+
+// Has channel 0 raise IRQ 0 once, ticks PIT ticks from now.
+void pit_oneshot(unsigned int ticks);
+
+// Has channel 0 raise IRQ 0 every ticks PIT ticks, until pit_stop().
+void pit_periodic(unsigned int ticks);
+
+// Stops channel 0 from raising IRQ 0 until it's started again.
+void pit_stop();
+
+#endif  // PIT_H
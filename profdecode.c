@@ -0,0 +1,264 @@
+// Symbolizes the samples profile_dump() writes (see profile.h) using the
+// symbols in kernel.elf, into either a flat profile, or folded stacks for
+// flamegraph.pl and the like.
+//
+//   ./profdecode kernel.elf < com1.out       flat profile
+//   ./profdecode -f kernel.elf < com1.out    folded stacks
+//
+// Built for the host, like the tests.
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Must match profile.h.
+#define PROFILE_MAX_DEPTH 8
+// Addresses below this are ring 3's.
+#define KERNEL_VIRTUAL_OFFSET 0xC0000000u
+
+typedef struct {
+  unsigned int address;
+  unsigned int size;
+  const char* name;
+  unsigned int self;
+  unsigned int total;
+  unsigned int last_sample;  // The last sample total was counted for, + 1.
+} Symbol;
+
+Symbol* symbols;
+unsigned int num_symbols = 0;
+// For samples that don't land in any symbol.
+Symbol unknown_symbol = {0, 0, "[unknown]", 0, 0, 0};
+Symbol user_symbol = {0, 0, "[user]", 0, 0, 0};
+
+int compare_symbols(const void* a, const void* b) {
+  unsigned int a_address = ((const Symbol*)a)->address;
+  unsigned int b_address = ((const Symbol*)b)->address;
+  return a_address < b_address ? -1 : a_address > b_address;
+}
+
+// Loads the code symbols, skipping NASM's local labels (like "cpuid.done"),
+// which would otherwise split up the functions they're in.
+int load_symbols(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return 0;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  unsigned char* data = malloc(size);
+  if (fread(data, 1, size, file) != (size_t)size) {
+    fprintf(stderr, "Couldn't read %s\n", path);
+    fclose(file);
+    return 0;
+  }
+  fclose(file);
+
+  Elf32_Ehdr* header = (Elf32_Ehdr*)data;
+  if (size < (long)sizeof(Elf32_Ehdr) ||
+      memcmp(header->e_ident, ELFMAG, SELFMAG) ||
+      header->e_ident[EI_CLASS] != ELFCLASS32) {
+    fprintf(stderr, "%s isn't a 32-bit ELF file\n", path);
+    return 0;
+  }
+  Elf32_Shdr* sections = (Elf32_Shdr*)(data + header->e_shoff);
+  for (unsigned int i = 0; i < header->e_shnum; ++i) {
+    if (sections[i].sh_type != SHT_SYMTAB) {
+      continue;
+    }
+    Elf32_Sym* syms = (Elf32_Sym*)(data + sections[i].sh_offset);
+    unsigned int count = sections[i].sh_size / sizeof(Elf32_Sym);
+    const char* names = (const char*)data +
+                        sections[sections[i].sh_link].sh_offset;
+    symbols = calloc(count, sizeof(Symbol));
+    for (unsigned int j = 0; j < count; ++j) {
+      unsigned int type = ELF32_ST_TYPE(syms[j].st_info);
+      unsigned int section = syms[j].st_shndx;
+      const char* name = names + syms[j].st_name;
+      if ((type != STT_FUNC && type != STT_NOTYPE) || !*name ||
+          strchr(name, '.') || section == SHN_UNDEF ||
+          section >= header->e_shnum ||
+          !(sections[section].sh_flags & SHF_EXECINSTR)) {
+        continue;
+      }
+      Symbol* symbol = &symbols[num_symbols++];
+      symbol->address = syms[j].st_value;
+      symbol->size = syms[j].st_size;
+      symbol->name = name;
+    }
+    qsort(symbols, num_symbols, sizeof(Symbol), compare_symbols);
+    return 1;
+  }
+  fprintf(stderr, "%s has no symbols\n", path);
+  return 0;
+}
+
+// NASM's symbols have no size, so those run up to the next symbol.
+Symbol* find_symbol(unsigned int address) {
+  if (address < KERNEL_VIRTUAL_OFFSET) {
+    return &user_symbol;
+  }
+  unsigned int low = 0;
+  unsigned int high = num_symbols;
+  while (low < high) {
+    unsigned int middle = low + (high - low) / 2;
+    if (symbols[middle].address <= address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (!low) {
+    return &unknown_symbol;
+  }
+  Symbol* symbol = &symbols[low - 1];
+  if (symbol->size && address >= symbol->address + symbol->size) {
+    return &unknown_symbol;
+  }
+  return symbol;
+}
+
+typedef struct {
+  unsigned int num_samples;
+  unsigned int hz;
+  char** stacks;  // Folded, one per sample.
+} Profile;
+
+void count_total(Symbol* symbol, unsigned int sample) {
+  if (symbol->last_sample != sample + 1) {
+    symbol->last_sample = sample + 1;
+    ++symbol->total;
+  }
+}
+
+// Reads the profile out of everything else in the log. Returns 0 if there
+// wasn't one.
+int read_profile(Profile* profile) {
+  char line[512];
+  int found = 0;
+  while (fgets(line, sizeof(line), stdin)) {
+    if (sscanf(line, "PROFILE %u %u", &profile->num_samples, &profile->hz) ==
+        2) {
+      found = 1;
+      break;
+    }
+  }
+  if (!found) {
+    return 0;
+  }
+  profile->stacks = calloc(profile->num_samples + 1, sizeof(char*));
+  unsigned int sample = 0;
+  while (sample < profile->num_samples && fgets(line, sizeof(line), stdin)) {
+    if (!strncmp(line, "END PROFILE", 11)) {
+      break;
+    }
+    unsigned int addresses[PROFILE_MAX_DEPTH + 1];
+    unsigned int depth = 0;
+    char* next = line;
+    while (depth <= PROFILE_MAX_DEPTH) {
+      char* end;
+      unsigned long address = strtoul(next, &end, 16);
+      if (end == next) {
+        break;
+      }
+      addresses[depth++] = address;
+      next = end;
+    }
+    if (!depth) {
+      continue;  // Something else that ended up in the middle of it.
+    }
+    Symbol* leaf = find_symbol(addresses[0]);
+    ++leaf->self;
+    count_total(leaf, sample);
+    // Outermost first. Return addresses point just past the call, which
+    // might be the start of the next function, hence the - 1.
+    char folded[PROFILE_MAX_DEPTH * 64 + 64] = "";
+    for (unsigned int i = depth - 1; i > 0; --i) {
+      Symbol* caller = find_symbol(addresses[i] - 1);
+      count_total(caller, sample);
+      strncat(folded, caller->name, 63);
+      strcat(folded, ";");
+    }
+    strncat(folded, leaf->name, 63);
+    profile->stacks[sample++] = strdup(folded);
+  }
+  profile->num_samples = sample;
+  return 1;
+}
+
+int compare_strings(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void print_folded(Profile* profile) {
+  qsort(profile->stacks, profile->num_samples, sizeof(char*), compare_strings);
+  unsigned int i = 0;
+  while (i < profile->num_samples) {
+    unsigned int run = 1;
+    while (i + run < profile->num_samples &&
+           !strcmp(profile->stacks[i], profile->stacks[i + run])) {
+      ++run;
+    }
+    printf("%s %u\n", profile->stacks[i], run);
+    i += run;
+  }
+}
+
+int compare_self(const void* a, const void* b) {
+  const Symbol* const* x = a;
+  const Symbol* const* y = b;
+  if ((*x)->self != (*y)->self) {
+    return (*x)->self > (*y)->self ? -1 : 1;
+  }
+  return (*x)->total > (*y)->total ? -1 : (*x)->total < (*y)->total;
+}
+
+void print_flat(Profile* profile) {
+  Symbol** seen = calloc(num_symbols + 2, sizeof(Symbol*));
+  unsigned int num_seen = 0;
+  for (unsigned int i = 0; i < num_symbols; ++i) {
+    if (symbols[i].total) {
+      seen[num_seen++] = &symbols[i];
+    }
+  }
+  if (unknown_symbol.total) {
+    seen[num_seen++] = &unknown_symbol;
+  }
+  if (user_symbol.total) {
+    seen[num_seen++] = &user_symbol;
+  }
+  qsort(seen, num_seen, sizeof(Symbol*), compare_self);
+  printf("%u samples at %u Hz\n", profile->num_samples, profile->hz);
+  printf("  self%%    self   total  function\n");
+  for (unsigned int i = 0; i < num_seen; ++i) {
+    printf("%6.2f%% %7u %7u  %s\n",
+           profile->num_samples ? 100.0 * seen[i]->self / profile->num_samples
+                                : 0.0,
+           seen[i]->self, seen[i]->total, seen[i]->name);
+  }
+}
+
+int main(int argc, char** argv) {
+  int folded = argc == 3 && !strcmp(argv[1], "-f");
+  if (argc != 2 && !folded) {
+    fprintf(stderr, "usage: %s [-f] kernel.elf < log\n", argv[0]);
+    return 1;
+  }
+  if (!load_symbols(argv[argc - 1])) {
+    return 1;
+  }
+  Profile profile;
+  if (!read_profile(&profile)) {
+    fprintf(stderr, "No profile in the input.\n");
+    return 1;
+  }
+  if (folded) {
+    print_folded(&profile);
+  } else {
+    print_flat(&profile);
+  }
+  return 0;
+}
@@ -0,0 +1,137 @@
+#include "profile.h"
+
+#include "interrupts.h"
+#include "log.h"
+#include "paging.h"
+#include "pit.h"
+#include "serial.h"
+#include "string.h"
+#include "thread.h"
+#include "timer.h"
+
+// # Walking the stack
+// The kernel is built with frame pointers, so [ebp] is the caller's ebp and
+// [ebp + 4] is the return address into the caller. The interrupted ebp can be
+// anything though (code between a call and its prologue, or asm that uses ebp
+// for something else), so the walk only follows ebps that stay on the stack
+// the interrupt came in on, and only upwards. That stack runs from the
+// interrupted esp up to the top of the thread's stack, or for the boot thread
+// (whose stack is the loader's, see loader.s) at most PROFILE_BOOT_STACK_SIZE.
+
+#define PROFILE_BOOT_STACK_SIZE 0x1000
+
+typedef struct {
+  ProfileSample* samples;
+  unsigned int max_samples;
+  unsigned int num_samples;
+  unsigned int buffer_size;
+  int running;
+} Profile;
+
+Profile profile_;
+
+unsigned int walk_stack(InterruptFrame* frame, unsigned int* callers) {
+  Thread* thread = current_thread();
+  unsigned int low = frame->cpu.esp;
+  unsigned int high = thread->stack ? thread->stack + THREAD_STACK_SIZE :
+      low + PROFILE_BOOT_STACK_SIZE;
+  unsigned int ebp = frame->cpu.ebp;
+  unsigned int depth = 0;
+  while (depth < PROFILE_MAX_DEPTH && ebp >= low && ebp <= high - 8 &&
+         !(ebp & 3)) {
+    unsigned int* saved = (unsigned int*)ebp;
+    callers[depth++] = saved[1];
+    if (saved[0] <= ebp) {
+      break;
+    }
+    ebp = saved[0];
+  }
+  return depth;
+}
+
+void profile_interrupt(InterruptFrame* frame, void* ctx) {
+  ctx = ctx;
+  if (profile_.running) {
+    ProfileSample* sample = &profile_.samples[profile_.num_samples++];
+    sample->eip = frame->eip;
+    // Ring 3's stack isn't ours to walk.
+    sample->depth = from_user_mode(frame) ? 0 :
+        walk_stack(frame, sample->callers);
+    if (profile_.num_samples == profile_.max_samples) {
+      profile_.running = 0;
+      pit_stop();
+    }
+  }
+  ack_irq(IRQ_VECTOR(PIT_IRQ));
+}
+
+int profile_start(unsigned int max_samples) {
+  if (timers_use_pit()) {
+    LOG(ERROR, "The timers are using the PIT, so there's nothing to profile "
+               "with.");
+    return 0;
+  }
+  profile_stop();
+  if (profile_.samples) {
+    free_page_block((unsigned int)profile_.samples, profile_.buffer_size);
+    profile_.samples = 0;
+  }
+  if (!max_samples) {
+    return 0;
+  }
+  unsigned int size = max_samples * sizeof(ProfileSample);
+  profile_.samples =
+      (ProfileSample*)alloc_page_block(size, &profile_.buffer_size);
+  if (!profile_.samples) {
+    LOG(ERROR, "No memory for the profile's samples.");
+    return 0;
+  }
+  profile_.max_samples = max_samples;
+  profile_.num_samples = 0;
+
+  register_interrupt_handler(IRQ_VECTOR(PIT_IRQ), profile_interrupt, 0);
+  enable_irq(PIT_IRQ);
+  unsigned int eflags = irq_save();
+  profile_.running = 1;
+  pit_periodic(PIT_HZ / PROFILE_HZ);
+  irq_restore(eflags);
+  return 1;
+}
+
+void profile_stop() {
+  unsigned int eflags = irq_save();
+  if (profile_.running) {
+    pit_stop();
+    profile_.running = 0;
+  }
+  irq_restore(eflags);
+}
+
+void put_dec(unsigned int value) {
+  char dec[12];
+  int_to_dec(value, dec);
+  serial_puts(dec);
+}
+
+void profile_dump() {
+  serial_puts("PROFILE ");
+  put_dec(profile_.num_samples);
+  serial_puts(" ");
+  put_dec(PROFILE_HZ);
+  serial_puts("\n");
+  for (unsigned int i = 0; i < profile_.num_samples; ++i) {
+    ProfileSample* sample = &profile_.samples[i];
+    char line[12 * (PROFILE_MAX_DEPTH + 1) + 1];
+    int_to_hex(sample->eip, line);
+    unsigned int length = 10;
+    for (unsigned int j = 0; j < sample->depth; ++j) {
+      line[length++] = ' ';
+      int_to_hex(sample->callers[j], line + length);
+      length += 10;
+    }
+    line[length++] = '\n';
+    line[length] = 0;
+    serial_write(line, length);
+  }
+  serial_puts("END PROFILE\n");
+}
@@ -0,0 +1,42 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// A sampling profiler. The PIT interrupts the boot CPU PROFILE_HZ times a
+// second, and each interrupt records where it landed along with the return
+// addresses found by following the saved ebp chain, so samples show who was
+// calling too. profile_dump() sends them over serial, and profdecode turns
+// them into a flat profile or folded stacks (for flame graphs) using
+// kernel.elf:
+//
+//   ./profdecode kernel.elf < com1.out
+//   ./profdecode -f kernel.elf < com1.out | flamegraph.pl > profile.svg
+//
+// Only the boot CPU takes interrupts, so work on the other CPUs isn't seen.
+
+// Not a round number, so sampling doesn't fall into step with anything
+// periodic.
+#define PROFILE_HZ 997
+#define PROFILE_MAX_DEPTH 8
+
+typedef struct {
+  unsigned int eip;
+  unsigned int depth;
+  unsigned int callers[PROFILE_MAX_DEPTH];  // Innermost first.
+} ProfileSample;
+
+// Starts sampling into a buffer of max_samples samples, allocated up front.
+// Sampling stops by itself when it's full. Returns 0 if the PIT is in use by
+// the timers (see timers_use_pit()) or there's no memory for the buffer.
+// Needs init_timers().
+int profile_start(unsigned int max_samples);
+
+// Stops sampling. The samples stay around for profile_dump() until the next
+// profile_start().
+void profile_stop();
+
+// Writes the samples to serial, one per line between a "PROFILE <samples>
+// <hz>" header and an "END PROFILE" footer, as hex addresses: the eip, then
+// the callers from innermost to outermost.
+void profile_dump();
+
+#endif  // PROFILE_H
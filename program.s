@@ -1,5 +1,89 @@
-; set eax to some distinguishable number, to read from the log afterwards
+; A user program, run in ring 3 by user.c. It times a round trip through a
+; system call that does nothing, both with int 0x80 and (if eax says it's
+; available) with sysenter, logs the cycles each took, and exits with a
+; distinguishable number to read from the log afterwards. It's loaded wherever
+; there's room, so everything has to be position independent.
 [BITS 32]
-fn: 
-  mov eax, dword 0xDEADBEEF
+
+; See syscall.h.
+SYS_EXIT        equ 0
+SYS_NULL        equ 1
+SYS_LOG_INT     equ 2
+SYSCALL_VECTOR  equ 0x80
+
+; The tags on the logged numbers.
+TAG_INT         equ 0x80
+TAG_SYSENTER    equ 0x34    ; sysenter's opcode is 0F 34
+
+; Each benchmark makes 2^ITERATIONS_SHIFT calls.
+ITERATIONS_SHIFT equ 12
+
+start:
+  mov     ebp, eax                ; 1 if we can use sysenter
+
+  call    bench_int
+  mov     esi, eax
+  mov     ebx, TAG_INT
+  mov     eax, SYS_LOG_INT
+  int     SYSCALL_VECTOR
+
+  test    ebp, ebp
+  jz      .exit
+  call    bench_sysenter
+  mov     esi, eax
+  mov     ebx, TAG_SYSENTER
+  mov     eax, SYS_LOG_INT
+  call    syscall_sysenter
+
+.exit:
+  mov     ebx, 0xDEADBEEF
+  mov     eax, SYS_EXIT
+  int     SYSCALL_VECTOR          ; doesn't come back
+
+; syscall_sysenter - makes the system call in eax with sysenter, clobbering ecx
+; and edx. sysexit comes back to .back with the same esp, and the ret takes it
+; from there.
+syscall_sysenter:
+  call    .here                   ; there's no mov edx, eip
+.here:
+  pop     edx
+  add     edx, .back - .here
+  mov     ecx, esp
+  sysenter
+.back:
+  ret
+
+; bench_int - returns the average cycles per SYS_NULL through int 0x80.
+bench_int:
+  rdtsc
+  mov     esi, eax
+  mov     edi, edx
+  mov     ebx, 1 << ITERATIONS_SHIFT
+.loop:
+  mov     eax, SYS_NULL
+  int     SYSCALL_VECTOR
+  dec     ebx
+  jnz     .loop
+  jmp     average
+
+; bench_sysenter - returns the average cycles per SYS_NULL through sysenter.
+bench_sysenter:
+  rdtsc
+  mov     esi, eax
+  mov     edi, edx
+  mov     ebx, 1 << ITERATIONS_SHIFT
+.loop:
+  mov     eax, SYS_NULL
+  call    syscall_sysenter
+  dec     ebx
+  jnz     .loop
+  ; falls through
+
+; average - returns the cycles since the rdtsc in edi:esi, divided by the
+; number of iterations.
+average:
+  rdtsc
+  sub     eax, esi
+  sbb     edx, edi
+  shrd    eax, edx, ITERATIONS_SHIFT
   ret
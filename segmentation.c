@@ -4,9 +4,25 @@
 #include "log.h"
 #include "string.h"
 
-SegmentDescriptor gdt[5];
+// For the system segments, which don't fit the flat 4GB mold of the others.
+// access is the descriptor's type byte (present, privilege, type) and
+// granularity is the top nibble of flags.
+void set_descriptor(SegmentDescriptor* descriptor, unsigned int base,
+                    unsigned int limit, unsigned int access,
+                    unsigned int granularity) {
+  descriptor->limit = limit & 0xFFFF;
+  descriptor->base_15_0 = base & 0xFFFF;
+  descriptor->base_23_16 = (base >> 16) & 0xFF;
+  descriptor->flags =
+      (granularity << 12) | (((limit >> 16) & 0xF) << 8) | (access & 0xFF);
+  descriptor->base_31_24 = base >> 24;
+}
+
+void init_segmentation(CpuSegments* segments, void* per_cpu,
+                       unsigned int per_cpu_size, unsigned int kernel_stack) {
+  SegmentDescriptor* gdt = segments->gdt;
+  memset(segments, 0, sizeof(CpuSegments));
 
-void init_segmentation() {
   // leave 0 (null) segment as is
   
   // segment 1 is for code
@@ -53,9 +69,27 @@ void init_segmentation() {
   gdt[4].base_15_0 = 0x0000;
   gdt[4].limit = 0xFFFF;
 
+  // segment 5 is the TSS
+  // 0b1000 (present in memory, privilege = 0, system segment)
+  // 0b1001 (available 32-bit TSS)
+  // 0b0000 (byte granularity)
+  segments->tss.ss0 = KERNEL_DATA_SELECTOR;
+  segments->tss.esp0 = kernel_stack;
+  // Past the end of the TSS, i.e. no I/O permission bitmap.
+  segments->tss.iomap_base = sizeof(TaskStateSegment);
+  set_descriptor(&gdt[5], (unsigned int)&segments->tss,
+                 sizeof(TaskStateSegment) - 1, 0x89, 0x0);
+
+  // segment 6 is the per-CPU data, reached through gs
+  // 0b1001 (present in memory, privilege = 0, data/code segment)
+  // 0b0010 (read/write, no-expand down, non-accessed)
+  // 0b0100 (byte granularity, 32-bit operations)
+  set_descriptor(&gdt[6], (unsigned int)per_cpu, per_cpu_size - 1, 0x92, 0x4);
+
   GDTSpec gdt_spec;
   gdt_spec.address = (unsigned int)gdt;
-  gdt_spec.size = sizeof(gdt);
+  gdt_spec.size = sizeof(segments->gdt);
 
   lgdt(&gdt_spec);
+  load_cpu_selectors(TSS_SELECTOR, PER_CPU_SELECTOR);
 }
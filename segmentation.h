@@ -1,6 +1,62 @@
 #ifndef SEGMENTATION_H
 #define SEGMENTATION_H
 
-void init_segmentation();
+#include "gdt.h"
+
+// Selectors for the GDT entries that init_segmentation() sets up. Every CPU
+// has its own GDT, but the flat segments are the same in all of them.
+#define KERNEL_CODE_SELECTOR 0x08
+#define KERNEL_DATA_SELECTOR 0x10
+#define USER_CODE_SELECTOR 0x18
+#define USER_DATA_SELECTOR 0x20
+#define TSS_SELECTOR 0x28
+// A small data segment whose base is the CPU's per-CPU data, loaded into gs.
+#define PER_CPU_SELECTOR 0x30
+#define NUM_GDT_ENTRIES 7
+
+// The hardware's 32-bit task state segment. We don't use hardware task
+// switching, so only esp0/ss0 (the stack to switch to when an interrupt comes
+// in from ring 3) and iomap_base matter.
+typedef struct __attribute__((packed)) {
+  unsigned int link;
+  unsigned int esp0;
+  unsigned int ss0;
+  unsigned int esp1;
+  unsigned int ss1;
+  unsigned int esp2;
+  unsigned int ss2;
+  unsigned int cr3;
+  unsigned int eip;
+  unsigned int eflags;
+  unsigned int eax;
+  unsigned int ecx;
+  unsigned int edx;
+  unsigned int ebx;
+  unsigned int esp;
+  unsigned int ebp;
+  unsigned int esi;
+  unsigned int edi;
+  unsigned int es;
+  unsigned int cs;
+  unsigned int ss;
+  unsigned int ds;
+  unsigned int fs;
+  unsigned int gs;
+  unsigned int ldt;
+  unsigned short trap;
+  unsigned short iomap_base;
+} TaskStateSegment;
+
+// One CPU's GDT and TSS.
+typedef struct {
+  SegmentDescriptor gdt[NUM_GDT_ENTRIES];
+  TaskStateSegment tss;
+} CpuSegments;
+
+// Fills in and loads the running CPU's GDT and TSS, pointing gs at the
+// per_cpu_size bytes at per_cpu and the TSS's ring 0 stack at kernel_stack
+// (its top).
+void init_segmentation(CpuSegments* segments, void* per_cpu,
+                       unsigned int per_cpu_size, unsigned int kernel_stack);
 
 #endif  // SEGMENTATION_H
@@ -1,4 +1,9 @@
+#include "serial.h"
+
+#include "interrupts.h"
 #include "io.h" /* io.h is implement in the section "Moving the cursor" */
+#include "spinlock.h"
+#include "string.h"
 
 /* The I/O ports */
 
@@ -10,7 +15,10 @@
 #define SERIAL_COM1_BASE                0x3F8      /* COM1 base port */
 
 #define SERIAL_DATA_PORT(base)          (base)
+#define SERIAL_INTERRUPT_ENABLE_PORT(base) (base + 1)
 #define SERIAL_FIFO_COMMAND_PORT(base)  (base + 2)
+/* Reads of the FIFO command port give the interrupt identification. */
+#define SERIAL_INTERRUPT_ID_PORT(base)  (base + 2)
 #define SERIAL_LINE_COMMAND_PORT(base)  (base + 3)
 #define SERIAL_MODEM_COMMAND_PORT(base) (base + 4)
 #define SERIAL_LINE_STATUS_PORT(base)   (base + 5)
@@ -24,6 +32,15 @@
  */
 #define SERIAL_LINE_ENABLE_DLAB         0x80
 
+/* Interrupt enable bit for "the transmitter holding register is empty". */
+#define SERIAL_INTERRUPT_THRE           0x02
+/* OUT2 in the modem control register gates the UART's IRQ line on PCs. */
+#define SERIAL_MODEM_OUT2               0x08
+
+#define SERIAL_COM1_IRQ                 4
+/* How much the transmit FIFO takes once it's empty. */
+#define SERIAL_TX_FIFO_SIZE             16
+
 /** serial_configure_baud_rate:
  *  Sets the speed of the data being sent. The default speed of a serial
  *  port is 115200 bits/s. The argument is a divisor of that number, hence
@@ -86,20 +103,90 @@ void serial_write_internal(unsigned short com, const char* buf, unsigned int len
   }
 }
 
-void serial_write(const char* buf, unsigned int len) {
-  serial_write_internal(SERIAL_COM1_BASE, buf, len);
+// # Buffered transmit
+// Waiting for the UART on every byte made logging most of what boot spent its
+// time on, so once serial_init_interrupts() has been called writes go into
+// tx_ring_ instead, and the THRE interrupt drains it a FIFO's worth at a time.
+// Writers only wait when the ring is full, and then they feed the FIFO
+// themselves, since the interrupt can't come in while they hold the lock.
+// Before that, and after serial_panic(), writes go straight to the UART.
+//
+// The THRE interrupt only fires when the FIFO empties, so a write that finds
+// it already empty starts things off by filling it.
+
+// A power of 2, so the free-running indices wrap around it cleanly.
+#define TX_RING_SIZE 4096
+
+char tx_ring_[TX_RING_SIZE];
+unsigned int tx_head_ = 0;  // The next byte to send.
+unsigned int tx_tail_ = 0;  // Where the next byte written goes.
+Spinlock tx_lock_;
+int tx_buffered_ = 0;
+volatile int tx_panic_ = 0;
+
+// Sends as much of the ring as fits in the FIFO, if it's empty. Needs the lock
+// (or a panic).
+void fill_tx_fifo(unsigned short com) {
+  if (!serial_is_transmit_fifo_empty(com)) {
+    return;
+  }
+  for (unsigned int i = 0; i < SERIAL_TX_FIFO_SIZE && tx_head_ != tx_tail_;
+       ++i) {
+    outb(SERIAL_DATA_PORT(com), tx_ring_[tx_head_++ & (TX_RING_SIZE - 1)]);
+  }
 }
 
-void serial_puts_internal(unsigned short com, const char* str) {
-  while (*str != '\0') {
-    while (!serial_is_transmit_fifo_empty(com)) {
-      // thumbs.twiddle();
+void serial_interrupt(void* ctx) {
+  ctx = ctx;
+  spin_lock(&tx_lock_);
+  // Reading the interrupt ID clears a pending THRE interrupt, in case there's
+  // nothing left to send.
+  inb(SERIAL_INTERRUPT_ID_PORT(SERIAL_COM1_BASE));
+  fill_tx_fifo(SERIAL_COM1_BASE);
+  spin_unlock(&tx_lock_);
+  ack_irq(IRQ_VECTOR(SERIAL_COM1_IRQ));
+}
+
+void serial_init_interrupts() {
+  register_irq_handler(IRQ_VECTOR(SERIAL_COM1_IRQ), serial_interrupt, 0);
+  unsigned int eflags = irq_save();
+  spin_lock(&tx_lock_);
+  outb(SERIAL_MODEM_COMMAND_PORT(SERIAL_COM1_BASE), 0x03 | SERIAL_MODEM_OUT2);
+  outb(SERIAL_INTERRUPT_ENABLE_PORT(SERIAL_COM1_BASE), SERIAL_INTERRUPT_THRE);
+  tx_buffered_ = 1;
+  spin_unlock(&tx_lock_);
+  irq_restore(eflags);
+  enable_irq(SERIAL_COM1_IRQ);
+}
+
+void serial_write(const char* buf, unsigned int len) {
+  if (tx_panic_ || !tx_buffered_) {
+    serial_write_internal(SERIAL_COM1_BASE, buf, len);
+    return;
+  }
+  unsigned int eflags = irq_save();
+  spin_lock(&tx_lock_);
+  for (unsigned int i = 0; i < len; ++i) {
+    while (tx_tail_ - tx_head_ == TX_RING_SIZE) {
+      fill_tx_fifo(SERIAL_COM1_BASE);
     }
-    outb(SERIAL_DATA_PORT(com), *str);
-    ++str;
+    tx_ring_[tx_tail_++ & (TX_RING_SIZE - 1)] = buf[i];
   }
+  fill_tx_fifo(SERIAL_COM1_BASE);
+  spin_unlock(&tx_lock_);
+  irq_restore(eflags);
 }
 
 void serial_puts(const char* str) {
-  serial_puts_internal(SERIAL_COM1_BASE, str);
+  serial_write(str, strlen(str));
+}
+
+void serial_panic() {
+  // Whoever holds the lock might never let go of it (it might even be us), so
+  // this doesn't take it. Anything being written right now may come out
+  // garbled, but everything already in the ring makes it out.
+  tx_panic_ = 1;
+  while (tx_head_ != tx_tail_) {
+    fill_tx_fifo(SERIAL_COM1_BASE);
+  }
 }
@@ -3,9 +3,18 @@
 
 void serial_init();
 
+// Switches writes from waiting on the UART for every byte to going through a
+// buffer that its interrupt drains. Needs init_interrupts().
+void serial_init_interrupts();
+
 void serial_write(const char* buf, unsigned int len);
 
 // Null terminated string.
 void serial_puts(const char* str);
 
+// For when something has gone badly wrong: sends everything still buffered,
+// and makes every write after this wait for the UART again, so it's all out
+// before we halt. Doesn't need interrupts, or any locks.
+void serial_panic();
+
 #endif  // SERIAL_H
@@ -0,0 +1,203 @@
+#include "slab.h"
+
+#include "log.h"
+#include "paging.h"
+
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_PAGE_MASK (SLAB_PAGE_SIZE-1)
+// Written at the start of every slab page so free() can tell slab objects apart
+// from whole page blocks (which start with their MemBlockInfo size, always a
+// power of two).
+#define SLAB_MAGIC 0x51AB51AB
+// Objects are 16 byte aligned, so the first one starts at the first 16 byte
+// boundary after the Slab header.
+#define SLAB_OBJECTS_OFFSET 32
+// Number of completely free slab pages each cache holds on to before giving
+// pages back to the page allocator.
+#define SLAB_MAX_EMPTY 2
+
+struct SlabCache;
+
+// # Slab allocation
+// Each size class has a SlabCache, which owns a set of 4kb slab pages. Each slab
+// page starts with a Slab header and is then carved into objects of the
+// cache's size. Free objects in a slab are kept in a singly linked list that is
+// threaded through the objects themselves. Objects that have never been handed
+// out aren't on the list: next_uncarved points at the first of them so that
+// creating a slab doesn't need to touch the whole page.
+//
+// Slabs are kept on one of three doubly linked lists per cache depending on how
+// many of their objects are in use (partial, full, or empty), so that both
+// allocation and freeing are O(1): allocation takes from the head of the partial
+// (or else empty) list, and freeing finds the Slab by masking off the low bits
+// of the object's address.
+typedef struct Slab {
+  unsigned int magic;
+  struct SlabCache* cache;
+  struct Slab* prev;
+  struct Slab* next;
+  void* free_objects;
+  unsigned int next_uncarved;
+  unsigned short num_used;
+  unsigned short num_objects;
+} Slab;
+
+typedef struct SlabCache {
+  unsigned int object_size;
+  Slab* partial;
+  Slab* full;
+  Slab* empty;
+  unsigned int num_empty;
+} SlabCache;
+
+// Powers of two plus the common sizes in between them. The last two classes
+// are the largest sizes that fit three and two objects in a slab page.
+SlabCache slab_caches[] = {
+  {16, 0, 0, 0, 0},   {32, 0, 0, 0, 0},   {48, 0, 0, 0, 0},
+  {64, 0, 0, 0, 0},   {96, 0, 0, 0, 0},   {128, 0, 0, 0, 0},
+  {192, 0, 0, 0, 0},  {256, 0, 0, 0, 0},  {384, 0, 0, 0, 0},
+  {512, 0, 0, 0, 0},  {768, 0, 0, 0, 0},  {1024, 0, 0, 0, 0},
+  {1344, 0, 0, 0, 0}, {SLAB_MAX_OBJECT_SIZE, 0, 0, 0, 0},
+};
+
+#define NUM_SLAB_CACHES (sizeof(slab_caches) / sizeof(slab_caches[0]))
+
+// Maps (size + 15) / 16 to the index of the smallest cache that fits size.
+unsigned char slab_cache_for_size[SLAB_MAX_OBJECT_SIZE / 16 + 1];
+
+void init_slab() {
+  unsigned int cache = 0;
+  for (unsigned int i = 0; i <= SLAB_MAX_OBJECT_SIZE / 16; ++i) {
+    while (slab_caches[cache].object_size < i * 16) {
+      ++cache;
+    }
+    slab_cache_for_size[i] = cache;
+  }
+}
+
+void slab_list_remove(Slab** list, Slab* slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->prev = 0;
+  slab->next = 0;
+}
+
+void slab_list_push(Slab** list, Slab* slab) {
+  slab->prev = 0;
+  slab->next = *list;
+  if (*list) {
+    (*list)->prev = slab;
+  }
+  *list = slab;
+}
+
+// Grabs a new page from the page allocator and sets it up as an empty slab for
+// the given cache.
+Slab* new_slab(SlabCache* cache) {
+  unsigned int page = alloc_page_block(SLAB_PAGE_SIZE, 0);
+  if (!page) {
+    LOG(ERROR, "Couldn't allocate a new slab page.");
+    return 0;
+  }
+  Slab* slab = (Slab*)page;
+  slab->magic = SLAB_MAGIC;
+  slab->cache = cache;
+  slab->prev = 0;
+  slab->next = 0;
+  slab->free_objects = 0;
+  slab->next_uncarved = page + SLAB_OBJECTS_OFFSET;
+  slab->num_used = 0;
+  slab->num_objects =
+      (SLAB_PAGE_SIZE - SLAB_OBJECTS_OFFSET) / cache->object_size;
+  return slab;
+}
+
+void* slab_alloc(unsigned int size) {
+  if (size > SLAB_MAX_OBJECT_SIZE) {
+    LOG_HEX(ERROR, "Object too large for the slab allocator: ", size);
+    return 0;
+  }
+  SlabCache* cache = &slab_caches[slab_cache_for_size[(size + 15) / 16]];
+
+  Slab* slab = cache->partial;
+  if (!slab) {
+    // Prefer reusing an empty slab over asking for a new page.
+    if (cache->empty) {
+      slab = cache->empty;
+      slab_list_remove(&cache->empty, slab);
+      --cache->num_empty;
+    } else {
+      slab = new_slab(cache);
+      if (!slab) {
+        return 0;
+      }
+    }
+    slab_list_push(&cache->partial, slab);
+  }
+
+  void* obj;
+  if (slab->free_objects) {
+    obj = slab->free_objects;
+    slab->free_objects = *(void**)obj;
+  } else {
+    obj = (void*)slab->next_uncarved;
+    slab->next_uncarved += cache->object_size;
+  }
+  ++slab->num_used;
+  if (slab->num_used == slab->num_objects) {
+    slab_list_remove(&cache->partial, slab);
+    slab_list_push(&cache->full, slab);
+  }
+  return obj;
+}
+
+void slab_free(void* mem) {
+  Slab* slab = (Slab*)((unsigned int)mem & ~SLAB_PAGE_MASK);
+  if (slab->magic != SLAB_MAGIC) {
+    LOG_HEX(ERROR, "Tried to slab_free() a non-slab object: ",
+            (unsigned int)mem);
+    return;
+  }
+  SlabCache* cache = slab->cache;
+  if (((unsigned int)mem - ((unsigned int)slab + SLAB_OBJECTS_OFFSET)) %
+      cache->object_size) {
+    LOG_HEX(ERROR, "Tried to slab_free() a misaligned object: ",
+            (unsigned int)mem);
+    return;
+  }
+
+  if (slab->num_used == slab->num_objects) {
+    slab_list_remove(&cache->full, slab);
+    slab_list_push(&cache->partial, slab);
+  }
+  *(void**)mem = slab->free_objects;
+  slab->free_objects = mem;
+  --slab->num_used;
+
+  if (slab->num_used == 0) {
+    slab_list_remove(&cache->partial, slab);
+    if (cache->num_empty < SLAB_MAX_EMPTY) {
+      slab_list_push(&cache->empty, slab);
+      ++cache->num_empty;
+    } else {
+      // We've got enough spares, so hand the page back.
+      slab->magic = 0;
+      free_page_block((unsigned int)slab, SLAB_PAGE_SIZE);
+    }
+  }
+}
+
+int is_slab_page(unsigned int page_vaddr) {
+  return ((Slab*)page_vaddr)->magic == SLAB_MAGIC;
+}
+
+unsigned int slab_object_size(void* mem) {
+  Slab* slab = (Slab*)((unsigned int)mem & ~SLAB_PAGE_MASK);
+  return slab->cache->object_size;
+}
@@ -0,0 +1,26 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+// Objects larger than this are not served by the slab allocator and should be
+// allocated as whole pages instead.
+#define SLAB_MAX_OBJECT_SIZE 2032
+
+// Must be called once paging is set up, before slab_alloc() is used.
+void init_slab();
+
+// Allocates an object of at least "size" bytes (size must be <=
+// SLAB_MAX_OBJECT_SIZE) from the smallest size class that fits it. Returns 0 if
+// no memory is available.
+void* slab_alloc(unsigned int size);
+
+// Frees an object previously returned by slab_alloc().
+void slab_free(void* mem);
+
+// Returns non-zero if the page starting at page_vaddr is a slab page, i.e. if
+// objects inside it should be released with slab_free().
+int is_slab_page(unsigned int page_vaddr);
+
+// Returns the usable size of an object previously returned by slab_alloc().
+unsigned int slab_object_size(void* mem);
+
+#endif  // SLAB_H
@@ -0,0 +1,188 @@
+#include "smp.h"
+
+#include "interrupts.h"
+#include "io.h"
+#include "log.h"
+#include "paging.h"
+#include "pit.h"
+#include "string.h"
+#include "thread.h"
+
+// # Starting the APs
+// The MP spec's INIT-SIPI-SIPI dance: an INIT IPI resets the AP, and a startup
+// IPI (SIPI) sends it to a page of real mode code below 1MB. The second SIPI is
+// for CPUs that missed the first. That code, the trampoline in smp_asm.s, gets
+// the AP into protected mode with paging, on a stack of its own, and calls
+// ap_main(). APs are started one at a time since they share the trampoline's
+// parameters.
+
+// In the low 1MB, which paging.c never hands out.
+#define AP_TRAMPOLINE_PADDR 0x8000
+#define AP_STACK_SIZE 0x4000
+// How long to give an AP to come online before giving up on it.
+#define AP_STARTUP_TIMEOUT_MS 100
+
+typedef struct __attribute__((packed)) {
+  unsigned int cr0;
+  unsigned int cr3;
+  unsigned int cr4;
+  unsigned int stack;
+  Cpu* cpu;
+} ApBootParams;
+
+// See smp_asm.s.
+extern char ap_trampoline_start[];
+extern char ap_trampoline_end[];
+extern char ap_boot_params[];
+
+Cpu cpus_[MAX_CPUS];
+unsigned int num_cpus_ = 1;
+
+// Sets up the running CPU's per-CPU data and segments.
+void init_cpu(Cpu* cpu, unsigned int index) {
+  cpu->self = cpu;
+  cpu->index = index;
+  cpu->thread = init_cpu_thread(index);
+  init_segmentation(&cpu->segments, cpu, sizeof(Cpu), cpu->stack);
+}
+
+void init_boot_cpu() {
+  init_cpu(&cpus_[0], 0);
+}
+
+// Where APs wait for work, forever.
+void ap_work_loop(Cpu* cpu) {
+  while (1) {
+    CpuWorkFn fn = cpu->work;
+    if (!fn) {
+      cpu_relax();
+      continue;
+    }
+    fn(cpu->work_arg);
+    __sync_synchronize();
+    cpu->work = 0;
+  }
+}
+
+// Called by the trampoline on the AP's own stack, with the boot CPU's GDT
+// (well, the trampoline's copy of it) and no IDT.
+void ap_main(Cpu* cpu) {
+  init_cpu(cpu, cpu->index);
+  load_interrupt_table();
+  lapic_enable();
+  __sync_synchronize();
+  cpu->online = 1;
+  ap_work_loop(cpu);
+}
+
+// Waits for roughly ms milliseconds, without needing interrupts.
+void wait_ms(unsigned int ms) {
+  for (unsigned int i = 0; i < ms; ++i) {
+    pit_wait(PIT_HZ / 1000);
+  }
+}
+
+int start_ap(Cpu* cpu, volatile ApBootParams* params) {
+  cpu->stack = alloc_page_block(AP_STACK_SIZE, 0);
+  if (!cpu->stack) {
+    LOG(ERROR, "Couldn't allocate an AP stack.");
+    return 0;
+  }
+  cpu->stack += AP_STACK_SIZE;
+  params->stack = cpu->stack;
+  params->cpu = cpu;
+  __sync_synchronize();
+
+  lapic_send_init(cpu->apic_id);
+  wait_ms(10);
+  lapic_send_startup(cpu->apic_id, AP_TRAMPOLINE_PADDR);
+  wait_ms(1);
+  if (!cpu->online) {
+    lapic_send_startup(cpu->apic_id, AP_TRAMPOLINE_PADDR);
+  }
+  for (unsigned int i = 0; i < AP_STARTUP_TIMEOUT_MS && !cpu->online; ++i) {
+    wait_ms(1);
+  }
+  if (!cpu->online) {
+    // It might still be on its way, so its stack has to stay where it is.
+    LOG_INT(ERROR, "CPU didn't come online, APIC ID: ", cpu->apic_id);
+    return 0;
+  }
+  return 1;
+}
+
+void init_smp() {
+  cpus_[0].apic_id = apic_interrupts_enabled() ? lapic_id() : 0;
+  cpus_[0].online = 1;
+  if (!apic_interrupts_enabled()) {
+    LOG(INFO, "No APIC, so just the boot CPU.");
+    return;
+  }
+  ApicInfo info = apic_info();
+  if (info.num_cpus <= 1) {
+    LOG(INFO, "Only one CPU.");
+    return;
+  }
+
+  // The trampoline turns paging on while running from its physical address,
+  // so that needs to be mapped there too. Virtual memory below 4MB is never
+  // handed out, so it's free.
+  unsigned int trampoline_size = ap_trampoline_end - ap_trampoline_start;
+  memcpy(phys_to_virt(AP_TRAMPOLINE_PADDR), ap_trampoline_start,
+         trampoline_size);
+  if (!map_physical_range(AP_TRAMPOLINE_PADDR, AP_TRAMPOLINE_PADDR, 1,
+                          PAGE_WRITABLE)) {
+    LOG(ERROR, "Couldn't map the AP trampoline.");
+    return;
+  }
+  volatile ApBootParams* params = (volatile ApBootParams*)phys_to_virt(
+      AP_TRAMPOLINE_PADDR + (ap_boot_params - ap_trampoline_start));
+  params->cr0 = reg_cr0();
+  params->cr3 = reg_cr3();
+  params->cr4 = reg_cr4();
+
+  for (unsigned int i = 0; i < info.num_cpus && num_cpus_ < MAX_CPUS; ++i) {
+    if (info.cpu_apic_ids[i] == cpus_[0].apic_id) {
+      continue;
+    }
+    Cpu* cpu = &cpus_[num_cpus_];
+    cpu->index = num_cpus_;
+    cpu->apic_id = info.cpu_apic_ids[i];
+    if (!start_ap(cpu, params)) {
+      // Stop there, since a late starter would still be using this Cpu and
+      // the trampoline's parameters.
+      break;
+    }
+    ++num_cpus_;
+  }
+
+  unmap_physical_range(AP_TRAMPOLINE_PADDR, 1);
+  LOG_INT(INFO, "CPUs online: ", num_cpus_);
+}
+
+unsigned int num_cpus() {
+  return num_cpus_;
+}
+
+Cpu* cpu_by_index(unsigned int index) {
+  return &cpus_[index];
+}
+
+int run_on_cpu(unsigned int index, CpuWorkFn fn, void* arg) {
+  if (index == 0 || index >= num_cpus_) {
+    return 0;
+  }
+  Cpu* cpu = &cpus_[index];
+  if (cpu->work) {
+    return 0;
+  }
+  cpu->work_arg = arg;
+  // The AP starts as soon as it sees fn, so arg has to be there first.
+  __sync_synchronize();
+  cpu->work = fn;
+  return 1;
+}
+
+int cpu_is_idle(unsigned int index) {
+  return !cpus_[index].work;
+}
@@ -0,0 +1,58 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "apic.h"
+#include "segmentation.h"
+
+// Per-CPU data, and starting the other CPUs (the application processors, or
+// APs) once the boot CPU is up.
+//
+// Each CPU's gs points at its own Cpu, so this_cpu() is a single load no
+// matter which CPU runs it. Only the boot CPU takes interrupts and runs the
+// thread scheduler: the others are started with interrupts disabled and wait
+// for work handed to them with run_on_cpu(). Page table changes aren't shot
+// down on the other CPUs' TLBs yet, so work running there shouldn't touch
+// memory that the boot CPU might unmap while it runs.
+
+typedef void (*CpuWorkFn)(void* arg);
+
+struct Thread;
+
+typedef struct Cpu {
+  struct Cpu* self;  // At gs:0, so this_cpu() doesn't need to know the base.
+  unsigned int index;  // 0 for the boot CPU, then in order of starting up.
+  unsigned int apic_id;
+  volatile int online;
+  unsigned int stack;  // The top of the stack it started on.
+  struct Thread* thread;  // The running thread, see thread.h.
+  int need_resched;  // Set when the running thread should make way.
+  // The work run_on_cpu() handed it, cleared once it has returned.
+  CpuWorkFn volatile work;
+  void* volatile work_arg;
+  CpuSegments segments;
+} Cpu;
+
+// Sets up the boot CPU's per-CPU data, GDT and TSS. Must come before anything
+// that uses this_cpu(), which includes the memory code.
+void init_boot_cpu();
+
+// Starts every other CPU that the APIC tables list, returning once they're all
+// online (or have failed to come up). Needs the APIC, paging and timers.
+void init_smp();
+
+// The running CPU's data. See smp_asm.s.
+Cpu* this_cpu();
+
+unsigned int num_cpus();
+
+// Returns the CPU with the given index (< num_cpus()).
+Cpu* cpu_by_index(unsigned int index);
+
+// Has an AP run fn(arg), with interrupts disabled. Returns 0 if it isn't
+// online or is still busy with earlier work.
+int run_on_cpu(unsigned int index, CpuWorkFn fn, void* arg);
+
+// Returns 1 once the AP has finished whatever work it was given.
+int cpu_is_idle(unsigned int index);
+
+#endif  // SMP_H
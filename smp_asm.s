@@ -0,0 +1,79 @@
+global this_cpu
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_boot_params
+
+extern ap_main          ; in smp.c
+
+; Must match AP_TRAMPOLINE_PADDR in smp.c.
+AP_TRAMPOLINE_PADDR equ 0x8000
+CR0_PE              equ 0x1
+
+; The trampoline is assembled along with the rest of the kernel, but runs from
+; the copy that init_smp() puts at AP_TRAMPOLINE_PADDR, so everything in it
+; that needs an address has to be given one relative to there.
+%define TRAMPOLINE(label) (AP_TRAMPOLINE_PADDR + (label) - ap_trampoline_start)
+
+; this_cpu - returns the running CPU's Cpu, whose first field points at itself.
+this_cpu:
+  mov     eax, [gs:0]
+  ret
+
+; An AP starts here in real mode, at AP_TRAMPOLINE_PADDR:0 after the startup
+; IPI. It switches to protected mode with a flat GDT of its own, then turns on
+; paging with the boot CPU's page directory (which has this page identity
+; mapped while APs are starting) and jumps into the kernel proper on the stack
+; init_smp() gave it.
+bits 16
+ap_trampoline_start:
+  cli
+  cld
+  xor     ax, ax
+  mov     ds, ax
+  lgdt    [TRAMPOLINE(ap_gdt_spec)]
+  mov     eax, cr0
+  or      eax, CR0_PE
+  mov     cr0, eax
+  jmp     dword 0x08:TRAMPOLINE(ap_protected_mode)
+
+bits 32
+ap_protected_mode:
+  mov     ax, 0x10
+  mov     ds, ax
+  mov     es, ax
+  mov     fs, ax
+  mov     gs, ax
+  mov     ss, ax
+  ; CR4 first, for PSE, since the page directory has 4MB pages in it.
+  mov     eax, [TRAMPOLINE(ap_boot_params.cr4)]
+  mov     cr4, eax
+  mov     eax, [TRAMPOLINE(ap_boot_params.cr3)]
+  mov     cr3, eax
+  mov     eax, [TRAMPOLINE(ap_boot_params.cr0)]
+  mov     cr0, eax
+  mov     esp, [TRAMPOLINE(ap_boot_params.stack)]
+  push    dword [TRAMPOLINE(ap_boot_params.cpu)]
+  mov     eax, ap_main
+  call    eax               ; never returns
+.hang:
+  hlt
+  jmp     .hang
+
+align 8
+ap_gdt:
+  dq      0                     ; null
+  dq      0x00CF9A000000FFFF    ; flat 4GB code, like segmentation.c's
+  dq      0x00CF92000000FFFF    ; flat 4GB data
+ap_gdt_spec:
+  dw      ap_gdt_spec - ap_gdt - 1
+  dd      TRAMPOLINE(ap_gdt)
+
+; Filled in by init_smp() before each startup IPI. See ApBootParams in smp.c.
+align 4
+ap_boot_params:
+.cr0:   dd 0
+.cr3:   dd 0
+.cr4:   dd 0
+.stack: dd 0
+.cpu:   dd 0
+ap_trampoline_end:
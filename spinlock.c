@@ -0,0 +1,23 @@
+#include "spinlock.h"
+
+#include "io.h"
+
+// xchg is a full barrier, so nothing from inside the critical section can move
+// above taking the lock, and the release store can't move above anything
+// before it on x86 either.
+
+void spin_lock(Spinlock* lock) {
+  while (__sync_lock_test_and_set(&lock->locked, 1)) {
+    while (lock->locked) {
+      cpu_relax();
+    }
+  }
+}
+
+int spin_trylock(Spinlock* lock) {
+  return !__sync_lock_test_and_set(&lock->locked, 1);
+}
+
+void spin_unlock(Spinlock* lock) {
+  __sync_lock_release(&lock->locked);
+}
@@ -0,0 +1,18 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+// A test-and-test-and-set lock for data shared between CPUs. Spinning only
+// reads the lock, so waiting CPUs don't bounce its cache line around until it
+// looks free. Zero-initialised means unlocked.
+typedef struct {
+  volatile int locked;
+} Spinlock;
+
+void spin_lock(Spinlock* lock);
+
+// Returns 1 if it took the lock, 0 if it's held.
+int spin_trylock(Spinlock* lock);
+
+void spin_unlock(Spinlock* lock);
+
+#endif  // SPINLOCK_H
@@ -1,6 +1,7 @@
 #include "stdio.h"
 
 #include "fb.h"
+#include "idle.h"
 #include "keyboard.h"
 #include "log.h"
 
@@ -15,9 +16,8 @@ int fgetc(FILE* stream) {
   }
 
   while (1) {
-    while (!HasScancode()) {
-      // Wait for input.
-    }
+    // Wait for input.
+    idle_until(HasScancode);
 
     Scancode scancode = PopScancode();
     Key key = GetKey(scancode);
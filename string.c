@@ -2,6 +2,11 @@
 
 #define INT_MIN -2147483648
 
+// Unaligned (and type punned) loads and stores for the word-at-a-time parts of
+// the mem* functions.
+typedef unsigned short __attribute__((may_alias)) unaligned_u16;
+typedef unsigned int __attribute__((may_alias)) unaligned_u32;
+
 void int_to_dec(int i, char dec_str[12]) {
   int is_negative = i < 0;
   // Avoid undefined behavior by not trying to negate INT_MIN.
@@ -51,3 +56,234 @@ void int_to_hex(unsigned int i, char hex_str[12]) {
     i >>= 4;
   }
 }
+
+// # mem* and friends
+// Bulk work goes to rep stosd/movsd, which every x86 handles well when the
+// destination is word aligned. rep has a startup cost of a few dozen cycles
+// though, so blocks under REP_MIN_SIZE bytes are done with plain unaligned
+// word moves instead. Either way a 16-bit and a byte move finish off the tail.
+//
+// rep movsd slows to a crawl when the source and destination can't both be
+// word aligned, so large copies like that use 16 byte SSE2 moves instead (with
+// unaligned loads and aligned stores) once string_use_sse() has turned them
+// on. For everything else rep is as fast or faster.
+//
+// The kernel doesn't save SSE registers anywhere (no interrupt handler, syscall
+// or thread switch knows about them), but a user program may well have
+// something in them. So in the kernel each run of SSE moves happens with
+// interrupts disabled, and puts back the xmm registers it used once it's done.
+// Runs are capped at SSE_CHUNK_SIZE bytes to keep interrupt latency down. Host
+// builds (the tests) don't need any of that.
+//
+// Note: these must be built with -fno-tree-loop-distribute-patterns, or the
+// compiler may turn their loops back into calls to themselves.
+
+#define REP_MIN_SIZE 64
+#define SSE_MIN_SIZE 256
+#define SSE_CHUNK_SIZE 4096
+
+// %3 is a 64 byte buffer to keep xmm0-3 in meanwhile.
+#if __STDC_HOSTED__
+#define SSE_BEGIN ""
+#define SSE_END ""
+#else
+#define SSE_BEGIN                  \
+  "pushf\n\tcli\n\t"              \
+  "movdqu %%xmm0, (%3)\n\t"       \
+  "movdqu %%xmm1, 16(%3)\n\t"     \
+  "movdqu %%xmm2, 32(%3)\n\t"     \
+  "movdqu %%xmm3, 48(%3)\n\t"
+#define SSE_END                    \
+  "movdqu (%3), %%xmm0\n\t"       \
+  "movdqu 16(%3), %%xmm1\n\t"     \
+  "movdqu 32(%3), %%xmm2\n\t"     \
+  "movdqu 48(%3), %%xmm3\n\t"     \
+  "popf\n\t"
+#endif
+
+// Only targets that can use SSE themselves need to hear about the clobbers.
+#ifdef __SSE2__
+#define SSE_CLOBBERS , "xmm0", "xmm1", "xmm2", "xmm3"
+#else
+#define SSE_CLOBBERS
+#endif
+
+int sse_enabled = 0;
+
+void string_use_sse(int enabled) {
+  sse_enabled = enabled;
+}
+
+// Copies blocks * 64 bytes from src to the 16 byte aligned dest. Each block is
+// loaded in full before any of it is stored, so this is also safe for
+// overlapping copies where dest is below src.
+void sse_copy_blocks(unsigned char* dest, const unsigned char* src,
+                     size_t blocks) {
+  unsigned char saved[64];
+  __asm__ volatile(
+      SSE_BEGIN
+      "1:\n\t"
+      "movdqu (%1), %%xmm0\n\t"
+      "movdqu 16(%1), %%xmm1\n\t"
+      "movdqu 32(%1), %%xmm2\n\t"
+      "movdqu 48(%1), %%xmm3\n\t"
+      "movdqa %%xmm0, (%0)\n\t"
+      "movdqa %%xmm1, 16(%0)\n\t"
+      "movdqa %%xmm2, 32(%0)\n\t"
+      "movdqa %%xmm3, 48(%0)\n\t"
+      "add $64, %0\n\t"
+      "add $64, %1\n\t"
+      "dec %2\n\t"
+      "jnz 1b\n\t"
+      SSE_END
+      : "+r"(dest), "+r"(src), "+r"(blocks)
+      : "r"(saved)
+      : "memory", "cc" SSE_CLOBBERS);
+}
+
+void* memset(void* dest, int c, size_t n) {
+  unsigned char* d = (unsigned char*)dest;
+  unsigned char byte = (unsigned char)c;
+  unsigned int word = byte * 0x01010101u;
+  if (n < REP_MIN_SIZE) {
+    for (; n >= 4; d += 4, n -= 4) {
+      *(unaligned_u32*)d = word;
+    }
+  } else {
+    for (; (unsigned long)d & 3; ++d, --n) {
+      *d = byte;
+    }
+    size_t words = n / 4;
+    __asm__ volatile("rep stosl"
+                     : "+D"(d), "+c"(words)
+                     : "a"(word)
+                     : "memory");
+    n &= 3;
+  }
+  if (n & 2) {
+    *(unaligned_u16*)d = (unsigned short)word;
+    d += 2;
+  }
+  if (n & 1) {
+    *d = byte;
+  }
+  return dest;
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+  unsigned char* d = (unsigned char*)dest;
+  const unsigned char* s = (const unsigned char*)src;
+  if (sse_enabled && n >= SSE_MIN_SIZE &&
+      (((unsigned long)d ^ (unsigned long)s) & 3)) {
+    for (; (unsigned long)d & 15; ++d, ++s, --n) {
+      *d = *s;
+    }
+    while (n >= 64) {
+      size_t blocks = (n < SSE_CHUNK_SIZE ? n : SSE_CHUNK_SIZE) / 64;
+      sse_copy_blocks(d, s, blocks);
+      d += blocks * 64;
+      s += blocks * 64;
+      n -= blocks * 64;
+    }
+  }
+  if (n < REP_MIN_SIZE) {
+    for (; n >= 4; d += 4, s += 4, n -= 4) {
+      *(unaligned_u32*)d = *(const unaligned_u32*)s;
+    }
+  } else {
+    for (; (unsigned long)d & 3; ++d, ++s, --n) {
+      *d = *s;
+    }
+    size_t words = n / 4;
+    __asm__ volatile("rep movsl"
+                     : "+D"(d), "+S"(s), "+c"(words)
+                     :
+                     : "memory");
+    n &= 3;
+  }
+  if (n & 2) {
+    *(unaligned_u16*)d = *(const unaligned_u16*)s;
+    d += 2;
+    s += 2;
+  }
+  if (n & 1) {
+    *d = *s;
+  }
+  return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+  unsigned char* d = (unsigned char*)dest;
+  const unsigned char* s = (const unsigned char*)src;
+  // memcpy() never stores over bytes it hasn't loaded yet when moving forward,
+  // so it's fine with overlaps as long as dest is below src.
+  if (d <= s || d >= s + n) {
+    return memcpy(dest, src, n);
+  }
+  // Otherwise copy backwards, a word at a time. (std and rep movsd would be
+  // faster, but interrupt handlers assume the direction flag is clear.)
+  d += n;
+  s += n;
+  while (n && ((unsigned long)d & 3)) {
+    *--d = *--s;
+    --n;
+  }
+  while (n >= 4) {
+    d -= 4;
+    s -= 4;
+    *(unaligned_u32*)d = *(const unaligned_u32*)s;
+    n -= 4;
+  }
+  while (n) {
+    *--d = *--s;
+    --n;
+  }
+  return dest;
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+  const unsigned char* x = (const unsigned char*)a;
+  const unsigned char* y = (const unsigned char*)b;
+  // Skip over equal words, then find the differing byte.
+  while (n >= 4 && *(const unaligned_u32*)x == *(const unaligned_u32*)y) {
+    x += 4;
+    y += 4;
+    n -= 4;
+  }
+  for (; n; ++x, ++y, --n) {
+    if (*x != *y) {
+      return *x - *y;
+    }
+  }
+  return 0;
+}
+
+size_t strlen(const char* str) {
+  const char* c = str;
+  while ((unsigned long)c & 3) {
+    if (!*c) {
+      return c - str;
+    }
+    ++c;
+  }
+  // An aligned word never crosses into the next page, so reading past the
+  // terminator is safe. A word has a zero byte exactly when this trick leaves
+  // a high bit set in it.
+  const unaligned_u32* w = (const unaligned_u32*)c;
+  while (!((*w - 0x01010101u) & ~*w & 0x80808080u)) {
+    ++w;
+  }
+  c = (const char*)w;
+  while (*c) {
+    ++c;
+  }
+  return c - str;
+}
+
+int strcmp(const char* a, const char* b) {
+  while (*a && *a == *b) {
+    ++a;
+    ++b;
+  }
+  return (int)(unsigned char)*a - (int)(unsigned char)*b;
+}
@@ -1,8 +1,24 @@
 #ifndef STRING_H
 #define STRING_H
 
+#include <stddef.h>
+
 void int_to_dec(int i, char dec_str[12]);
 
 void int_to_hex(unsigned int i, char hex_str[12]);
 
+// The usual C library functions. The compiler is free to emit calls to these
+// on its own (e.g. for struct copies), so they keep their standard names and
+// signatures.
+void* memset(void* dest, int c, size_t n);
+void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
+int memcmp(const void* a, const void* b, size_t n);
+size_t strlen(const char* str);
+int strcmp(const char* a, const char* b);
+
+// Lets memset() and memcpy() use SSE2 for large blocks. Only turn it on once
+// the CPU has SSE2 and it's been enabled (see enable_sse() in io.h).
+void string_use_sse(int enabled);
+
 #endif  // STRING_H
@@ -1,9 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "string.h"
 #include "test.h"
 
-int main() {
+// string.c's mem* functions replace the C library's in this binary, so the
+// expected results come from these plain byte loops instead.
+void ref_memset(unsigned char* dest, unsigned char c, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    dest[i] = c;
+  }
+}
+
+void ref_memcpy(unsigned char* dest, const unsigned char* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    dest[i] = src[i];
+  }
+}
+
+void ref_memmove(unsigned char* dest, const unsigned char* src, size_t n) {
+  unsigned char* tmp = malloc(n + 1);
+  ref_memcpy(tmp, src, n);
+  ref_memcpy(dest, tmp, n);
+  free(tmp);
+}
+
+void fill_pattern(unsigned char* buf, size_t n, unsigned int seed) {
+  for (size_t i = 0; i < n; ++i) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+}
+
+int same(const unsigned char* a, const unsigned char* b, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    if (a[i] != b[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void test_int_to_str() {
   char dec_str[12];
   int_to_dec(-123, dec_str);
   EXPECT_TRUE(strcmp("-123", dec_str) == 0);
@@ -14,5 +54,188 @@ int main() {
 
   int_to_hex(0xCAFEBABE, dec_str);
   EXPECT_TRUE(strcmp("0xCAFEBABE", dec_str) == 0);
-  return 0;
+}
+
+// Sizes around every threshold in string.c, plus some big ones.
+const size_t test_sizes[] = {0,   1,   2,    3,    4,    5,     7,
+                             8,   15,  16,   17,   63,   64,    65,
+                             511, 512, 513,  1000, 4095, 4096,  4097,
+                             4160, 8193, 65536 + 7};
+#define NUM_TEST_SIZES (sizeof(test_sizes) / sizeof(test_sizes[0]))
+// Room for the largest size at any alignment, with guard bytes either side.
+#define TEST_BUF_SIZE (65536 + 64)
+
+void test_memset_and_memcpy() {
+  unsigned char* expected = malloc(TEST_BUF_SIZE);
+  unsigned char* actual = malloc(TEST_BUF_SIZE);
+  unsigned char* src = malloc(TEST_BUF_SIZE);
+  fill_pattern(src, TEST_BUF_SIZE, 1);
+  for (size_t i = 0; i < NUM_TEST_SIZES; ++i) {
+    size_t n = test_sizes[i];
+    for (size_t align = 0; align < 16; ++align) {
+      fill_pattern(expected, TEST_BUF_SIZE, 2);
+      fill_pattern(actual, TEST_BUF_SIZE, 2);
+      ref_memset(expected + 16 + align, 0xA5, n);
+      EXPECT_TRUE(memset(actual + 16 + align, 0xA5, n) == actual + 16 + align);
+      EXPECT_TRUE(same(expected, actual, TEST_BUF_SIZE));
+
+      // Also misalign the source relative to the destination.
+      size_t src_align = (align * 7) & 15;
+      ref_memcpy(expected + 16 + align, src + src_align, n);
+      EXPECT_TRUE(memcpy(actual + 16 + align, src + src_align, n) ==
+                  actual + 16 + align);
+      EXPECT_TRUE(same(expected, actual, TEST_BUF_SIZE));
+    }
+  }
+  free(expected);
+  free(actual);
+  free(src);
+}
+
+void test_memmove() {
+  unsigned char* expected = malloc(TEST_BUF_SIZE);
+  unsigned char* actual = malloc(TEST_BUF_SIZE);
+  const long offsets[] = {-17, -4, -3, -1, 1, 2, 4, 5, 64, 600};
+  for (size_t i = 0; i < NUM_TEST_SIZES; ++i) {
+    size_t n = test_sizes[i];
+    if (n + 1300 > TEST_BUF_SIZE) {
+      continue;
+    }
+    for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); ++j) {
+      fill_pattern(expected, TEST_BUF_SIZE, 3);
+      fill_pattern(actual, TEST_BUF_SIZE, 3);
+      size_t src = 640 + (i & 7);
+      ref_memmove(expected + src + offsets[j], expected + src, n);
+      memmove(actual + src + offsets[j], actual + src, n);
+      EXPECT_TRUE(same(expected, actual, TEST_BUF_SIZE));
+    }
+  }
+  free(expected);
+  free(actual);
+}
+
+void test_memcmp() {
+  unsigned char a[64];
+  unsigned char b[64];
+  fill_pattern(a, sizeof(a), 4);
+  ref_memcpy(b, a, sizeof(a));
+  EXPECT_TRUE(memcmp(a, b, sizeof(a)) == 0);
+  EXPECT_TRUE(memcmp(a + 3, b + 3, 0) == 0);
+  for (size_t i = 0; i < sizeof(a); ++i) {
+    b[i] = a[i] + 1;
+    EXPECT_TRUE(memcmp(a, b, sizeof(a)) < 0);
+    EXPECT_TRUE(memcmp(b, a, sizeof(a)) > 0);
+    // Differences past n don't count.
+    EXPECT_TRUE(memcmp(a, b, i) == 0);
+    b[i] = a[i];
+  }
+  // Bytes compare as unsigned.
+  a[0] = 0x80;
+  b[0] = 0x01;
+  EXPECT_TRUE(memcmp(a, b, 1) > 0);
+}
+
+void test_strlen() {
+  char buf[80];
+  for (size_t align = 0; align < 8; ++align) {
+    for (size_t len = 0; len < 40; ++len) {
+      ref_memset((unsigned char*)buf, 'x', sizeof(buf));
+      buf[align + len] = 0;
+      EXPECT_TRUE(strlen(buf + align) == len);
+    }
+  }
+  // High bytes right before the terminator mustn't look like zeroes.
+  const char high[] = "\x80\x81\xFF\x01";
+  EXPECT_TRUE(strlen(high) == 4);
+}
+
+void test_strcmp() {
+  EXPECT_TRUE(strcmp("", "") == 0);
+  EXPECT_TRUE(strcmp("paging.c", "paging.c") == 0);
+  EXPECT_TRUE(strcmp("paging.c", "paging.h") < 0);
+  EXPECT_TRUE(strcmp("paging.h", "paging.c") > 0);
+  // A prefix comes first.
+  EXPECT_TRUE(strcmp("log", "log.c") < 0);
+  EXPECT_TRUE(strcmp("log.c", "log") > 0);
+  // Bytes compare as unsigned.
+  EXPECT_TRUE(strcmp("\x80", "\x01") > 0);
+}
+
+void run_tests() {
+  test_memset_and_memcpy();
+  test_memmove();
+  test_memcmp();
+  test_strlen();
+  test_strcmp();
+}
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Times fn over size bytes at the given misalignment, repeating enough to
+// move about 256MB, and returns the throughput in MB/s.
+double throughput(int fn, unsigned char* dest, unsigned char* src,
+                  size_t size) {
+  size_t reps = (256u << 20) / size;
+  if (reps > (1u << 22)) {
+    reps = 1u << 22;
+  }
+  double start = now_seconds();
+  for (size_t i = 0; i < reps; ++i) {
+    switch (fn) {
+      case 0: ref_memset(dest, (unsigned char)i, size); break;
+      case 1: memset(dest, (int)i, size); break;
+      case 2: ref_memcpy(dest, src, size); break;
+      case 3: memcpy(dest, src, size); break;
+    }
+    // Keep the compiler from dropping repeated work.
+    __asm__ volatile("" : : "r"(dest) : "memory");
+  }
+  return (double)size * reps / (now_seconds() - start) / (1 << 20);
+}
+
+// Reports MB/s for byte loops (what the kernel used to do), the rep
+// stosd/movsd path and the SSE2 path, for aligned and misaligned blocks.
+void bench() {
+  const size_t sizes[] = {1, 16, 256, 4096, 65536, 1 << 20};
+  unsigned char* dest = malloc((1 << 20) + 64);
+  unsigned char* src = malloc((1 << 20) + 64);
+  fill_pattern(src, (1 << 20) + 64, 5);
+  printf("%-8s %8s %6s %10s %10s %10s\n", "op", "size", "align", "bytes",
+         "rep", "sse2");
+  for (int op = 0; op < 2; ++op) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      for (int misaligned = 0; misaligned < 2; ++misaligned) {
+        unsigned char* d = dest + (misaligned ? 3 : 0);
+        unsigned char* s = src + (misaligned ? 9 : 0);
+        double bytes = throughput(op * 2, d, s, sizes[i]);
+        string_use_sse(0);
+        double rep = throughput(op * 2 + 1, d, s, sizes[i]);
+        string_use_sse(1);
+        double sse = throughput(op * 2 + 1, d, s, sizes[i]);
+        printf("%-8s %8zu %6s %10.0f %10.0f %10.0f\n",
+               op ? "memcpy" : "memset", sizes[i], misaligned ? "no" : "yes",
+               bytes, rep, sse);
+      }
+    }
+  }
+  free(dest);
+  free(src);
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    bench();
+    return 0;
+  }
+  test_int_to_str();
+  // Once with just rep stosd/movsd, and once with the SSE2 path as well.
+  string_use_sse(0);
+  run_tests();
+  string_use_sse(1);
+  run_tests();
+  return test_result();
 }
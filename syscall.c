@@ -0,0 +1,109 @@
+#include "syscall.h"
+
+#include "interrupts.h"
+#include "io.h"
+#include "log.h"
+#include "segmentation.h"
+#include "smp.h"
+#include "trace.h"
+#include "user.h"
+
+// # Getting in
+// sysenter jumps to SYSENTER_EIP with esp = SYSENTER_ESP, and the selectors
+// derived from SYSENTER_CS, without touching memory. sysexit goes back to ring
+// 3 with eip = edx and esp = ecx, the selectors also derived from SYSENTER_CS
+// (which segmentation.h's layout is made for). Unlike an interrupt, nothing
+// switches to the running thread's kernel stack, so SYSENTER_ESP points at the
+// TSS's esp0, where schedule() keeps the top of it, and sysenter_entry loads
+// esp from there.
+//
+// Both ways in end up in syscall_dispatch(), which calls through
+// syscall_table_.
+
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+#define CPUID_SEP (1u << 11)
+
+// See syscall_asm.s
+extern void sysenter_entry();
+
+int sysenter_enabled_ = 0;
+
+unsigned int sys_exit(unsigned int result, unsigned int b, unsigned int c) {
+  b = b;
+  c = c;
+  user_exit(result);
+  return 0;  // Never gets here.
+}
+
+unsigned int sys_null(unsigned int a, unsigned int b, unsigned int c) {
+  a = a;
+  b = b;
+  c = c;
+  return 0;
+}
+
+unsigned int sys_log_int(unsigned int tag, unsigned int value,
+                         unsigned int c) {
+  c = c;
+  LOG_HEX(INFO, "User program log, tag: ", tag);
+  LOG_INT(INFO, "                value: ", value);
+  return 0;
+}
+
+SyscallFn syscall_table_[NUM_SYSCALLS] = {
+  sys_exit,     // SYS_EXIT
+  sys_null,     // SYS_NULL
+  sys_log_int,  // SYS_LOG_INT
+};
+
+// Called by both ways in, with interrupts enabled.
+unsigned int syscall_dispatch(unsigned int number, unsigned int a,
+                              unsigned int b, unsigned int c) {
+  trace(TRACE_SYSCALL, number, a);
+  if (number >= NUM_SYSCALLS) {
+    return SYSCALL_ERROR;
+  }
+  return syscall_table_[number](a, b, c);
+}
+
+void syscall_interrupt(InterruptFrame* frame, void* ctx) {
+  ctx = ctx;
+  sti();
+  frame->cpu.eax =
+      syscall_dispatch(frame->cpu.eax, frame->cpu.ebx, frame->cpu.esi,
+                       frame->cpu.edi);
+  cli();
+}
+
+// The Pentium Pro reports SEP without really having it.
+int cpu_has_sysenter() {
+  unsigned int regs[4];
+  cpuid(1, regs);
+  unsigned int family = (regs[0] >> 8) & 0xF;
+  unsigned int model = (regs[0] >> 4) & 0xF;
+  unsigned int stepping = regs[0] & 0xF;
+  if (family == 6 && model < 3 && stepping < 3) {
+    return 0;
+  }
+  return (regs[3] & CPUID_SEP) != 0;
+}
+
+void init_syscalls() {
+  register_interrupt_handler(SYSCALL_VECTOR, syscall_interrupt, 0);
+  set_interrupt_user_callable(SYSCALL_VECTOR);
+  if (!cpu_has_sysenter()) {
+    LOG(INFO, "No sysenter, system calls will use int 0x80.");
+    return;
+  }
+  wrmsr(MSR_SYSENTER_CS, KERNEL_CODE_SELECTOR);
+  wrmsr(MSR_SYSENTER_ESP, (unsigned int)&this_cpu()->segments.tss.esp0);
+  wrmsr(MSR_SYSENTER_EIP, (unsigned int)sysenter_entry);
+  sysenter_enabled_ = 1;
+  LOG(INFO, "System calls can use sysenter.");
+}
+
+int sysenter_enabled() {
+  return sysenter_enabled_;
+}
@@ -0,0 +1,33 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+// System calls from ring 3. The call number goes in eax and up to three
+// arguments in ebx, esi and edi, and the result comes back in eax. There are
+// two ways in:
+//   - sysenter, with where to come back to in edx and the user's esp in ecx,
+//     both of which are clobbered. Only there if sysenter_enabled().
+//   - int 0x80, which works on any CPU and preserves everything but eax, but
+//     takes a lot longer getting in and out.
+// program.s uses (and times) both.
+#define SYSCALL_VECTOR 0x80
+
+#define SYS_EXIT 0     // (result) Ends the program, see user.h.
+#define SYS_NULL 1     // () Does nothing, for measuring the overhead.
+#define SYS_LOG_INT 2  // (tag, value) Logs both.
+#define NUM_SYSCALLS 3
+
+// What an unknown call number returns.
+#define SYSCALL_ERROR 0xFFFFFFFF
+
+typedef unsigned int (*SyscallFn)(unsigned int a, unsigned int b,
+                                  unsigned int c);
+
+// Opens up int 0x80 to ring 3, and sets up sysenter if the CPU has it. Only
+// for the boot CPU, since that's the only one that runs threads (and so user
+// programs). Needs init_interrupts().
+void init_syscalls();
+
+// Returns 1 if init_syscalls() set up sysenter.
+int sysenter_enabled();
+
+#endif  // SYSCALL_H
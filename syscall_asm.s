@@ -0,0 +1,39 @@
+global sysenter_entry
+
+extern syscall_dispatch ; in syscall.c
+
+KERNEL_DATA_SELECTOR equ 0x10   ; see segmentation.h
+PER_CPU_SELECTOR     equ 0x30
+
+; sysenter_entry - where sysenter comes in, in ring 0 with interrupts disabled
+; and esp pointing at the running CPU's tss.esp0 (see syscall.c), which holds
+; the top of the running thread's stack. The user's esp is in ecx and where to
+; return to is in edx, which is just where sysexit wants them on the way out.
+sysenter_entry:
+  mov     esp, [esp]
+  push    ecx
+  push    edx
+  push    ds                    ; whatever ring 3 left in these
+  push    es
+  push    gs
+  mov     cx, KERNEL_DATA_SELECTOR
+  mov     ds, cx
+  mov     es, cx
+  mov     cx, PER_CPU_SELECTOR
+  mov     gs, cx
+  cld
+  sti
+  push    edi
+  push    esi
+  push    ebx
+  push    eax
+  call    syscall_dispatch      ; (number, a, b, c), keeps ebx, esi, edi, ebp
+  add     esp, 16
+  cli
+  pop     gs
+  pop     es
+  pop     ds
+  pop     edx
+  pop     ecx
+  sti                           ; sysexit leaves IF alone, and this only takes
+  sysexit                       ; effect after the next instruction
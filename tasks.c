@@ -0,0 +1,266 @@
+#include "tasks.h"
+
+#include "apic.h"
+#include "deque.h"
+#include "interrupts.h"
+#include "io.h"
+#include "log.h"
+#include "smp.h"
+#include "thread.h"
+
+// # Workers
+// Each CPU has a deque of Task*. spawn() pushes onto the running CPU's, and a
+// CPU looking for work pops its own before trying to steal from the others,
+// starting at a random one so thieves don't all pile onto the same victim.
+//
+// An AP that can't find anything for a while parks: it sets its bit in
+// parked_, checks every deque one last time, and halts. spawn() wakes one
+// parked worker (if there are any) with an IPI after each push. The bit is
+// set before the last check and read after the push, with full barriers on
+// both sides, so either the worker sees the task or spawn() sees the bit.
+// The boot CPU never parks, since it only looks for work from inside sync().
+//
+// The wakeup IPI goes through the full interrupt stub rather than an irq one,
+// since the irq stubs run deferred work and the scheduler on the way out,
+// which only the boot CPU may do.
+
+#define TASK_WAKEUP_VECTOR 0x41
+// How many times a worker looks for work before parking.
+#define TASK_SPIN_ROUNDS 64
+
+typedef struct {
+  Deque deque;
+  unsigned int rng;
+  TaskStats stats;
+} Worker;
+
+Worker workers_[MAX_CPUS];
+// How many CPUs (from the boot CPU up) are looking for work, and how many
+// could be.
+unsigned int num_workers_ = 1;
+unsigned int max_workers_ = 1;
+// Bit i is set while CPU i is parked (or on its way there).
+unsigned int parked_ = 0;
+
+unsigned int next_random(Worker* worker) {
+  // xorshift32
+  unsigned int x = worker->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  worker->rng = x;
+  return x;
+}
+
+void run_task(Task* task) {
+  // The task belongs to its spawner again as soon as pending drops, so don't
+  // touch it after that.
+  TaskGroup* group = task->group;
+  task->fn(task->arg);
+  __atomic_sub_fetch(&group->pending, 1, __ATOMIC_RELEASE);
+}
+
+// Returns a task from this CPU's deque, or failing that one stolen from
+// another CPU's, or 0.
+Task* find_task(unsigned int index) {
+  Worker* worker = &workers_[index];
+  preempt_disable();
+  Task* task = (Task*)deque_pop(&worker->deque);
+  preempt_enable();
+  if (task) {
+    return task;
+  }
+  unsigned int num_workers = num_workers_;
+  if (num_workers <= 1) {
+    return 0;
+  }
+  unsigned int start = next_random(worker);
+  for (unsigned int i = 0; i < num_workers; ++i) {
+    unsigned int victim = (start + i) % num_workers;
+    if (victim == index) {
+      continue;
+    }
+    task = (Task*)deque_steal(&workers_[victim].deque);
+    if (task) {
+      ++worker->stats.steals;
+      return task;
+    }
+  }
+  return 0;
+}
+
+int any_tasks() {
+  for (unsigned int i = 0; i < num_workers_; ++i) {
+    if (!deque_is_empty(&workers_[i].deque)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void park(Cpu* cpu) {
+  unsigned int bit = 1u << cpu->index;
+  __atomic_or_fetch(&parked_, bit, __ATOMIC_SEQ_CST);
+  if (cpu->index < num_workers_ && any_tasks()) {
+    __atomic_and_fetch(&parked_, ~bit, __ATOMIC_SEQ_CST);
+    return;
+  }
+  ++workers_[cpu->index].stats.parks;
+  // Comes back with interrupts enabled once the IPI has been handled, or
+  // right away if it already arrived.
+  halt_until_interrupt();
+  cli();
+  __atomic_and_fetch(&parked_, ~bit, __ATOMIC_SEQ_CST);
+}
+
+// Wakes one parked worker, if there are any.
+void wake_worker(Worker* waker) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  unsigned int active = (1u << num_workers_) - 1;
+  unsigned int parked = __atomic_load_n(&parked_, __ATOMIC_RELAXED) & active;
+  if (!parked) {
+    return;
+  }
+  unsigned int index = __builtin_ctz(parked);
+  unsigned int bit = 1u << index;
+  // Whoever clears the bit sends the IPI, so each park only gets one.
+  if (__atomic_fetch_and(&parked_, ~bit, __ATOMIC_SEQ_CST) & bit) {
+    ++waker->stats.wakeups;
+    lapic_send_interrupt(cpu_by_index(index)->apic_id, TASK_WAKEUP_VECTOR);
+  }
+}
+
+void task_worker(void* arg) {
+  arg = arg;
+  Cpu* cpu = this_cpu();
+  unsigned int idle_rounds = 0;
+  while (1) {
+    Task* task = cpu->index < num_workers_ ? find_task(cpu->index) : 0;
+    if (task) {
+      run_task(task);
+      idle_rounds = 0;
+    } else if (++idle_rounds < TASK_SPIN_ROUNDS) {
+      cpu_relax();
+    } else {
+      park(cpu);
+      idle_rounds = 0;
+    }
+  }
+}
+
+void task_wakeup_interrupt(InterruptFrame* frame, void* ctx) {
+  frame = frame;
+  ctx = ctx;
+  lapic_eoi();
+}
+
+void init_tasks() {
+  for (unsigned int i = 0; i < MAX_CPUS; ++i) {
+    workers_[i].rng = 0x9E3779B9 * (i + 1);
+  }
+  register_interrupt_handler(TASK_WAKEUP_VECTOR, task_wakeup_interrupt, 0);
+  unsigned int num_workers = 1;
+  while (num_workers < num_cpus()) {
+    if (!run_on_cpu(num_workers, task_worker, 0)) {
+      LOG_INT(ERROR, "Couldn't start a task worker on CPU ", num_workers);
+      break;
+    }
+    ++num_workers;
+  }
+  max_workers_ = num_workers_ = num_workers;
+  LOG_INT(INFO, "Task workers: ", num_workers_);
+}
+
+void spawn(TaskGroup* group, Task* task, TaskFn fn, void* arg) {
+  task->fn = fn;
+  task->arg = arg;
+  task->group = group;
+  __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+  // Deque operations on the boot CPU could otherwise interleave between
+  // threads.
+  preempt_disable();
+  Worker* worker = &workers_[this_cpu()->index];
+  int pushed = deque_push(&worker->deque, task);
+  preempt_enable();
+  ++worker->stats.spawned;
+  if (!pushed) {
+    run_task(task);  // Full, so there's plenty for everyone else to do.
+    return;
+  }
+  if (num_workers_ > 1) {
+    wake_worker(worker);
+  }
+}
+
+void sync(TaskGroup* group) {
+  while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE)) {
+    Task* task = find_task(this_cpu()->index);
+    if (task) {
+      run_task(task);
+    } else {
+      cpu_relax();
+    }
+  }
+}
+
+typedef struct {
+  unsigned int begin;
+  unsigned int end;
+  unsigned int grain;
+  RangeFn fn;
+  void* arg;
+} Range;
+
+void run_range(void* arg) {
+  Range* range = (Range*)arg;
+  TaskGroup group = {0};
+  Task task;
+  Range right;
+  // Hand off the right half and keep splitting the left one. Only one task is
+  // in flight per level, so the stack only grows with log(size / grain).
+  if (range->end - range->begin > range->grain) {
+    unsigned int middle = range->begin + (range->end - range->begin) / 2;
+    right = *range;
+    right.begin = middle;
+    spawn(&group, &task, run_range, &right);
+    Range left = *range;
+    left.end = middle;
+    run_range(&left);
+  } else {
+    range->fn(range->begin, range->end, range->arg);
+  }
+  sync(&group);
+}
+
+void parallel_for(unsigned int begin, unsigned int end, unsigned int grain,
+                  RangeFn fn, void* arg) {
+  if (begin >= end) {
+    return;
+  }
+  Range range = {begin, end, grain ? grain : 1, fn, arg};
+  run_range(&range);
+}
+
+void set_task_workers(unsigned int num_workers) {
+  if (num_workers < 1) {
+    num_workers = 1;
+  } else if (num_workers > max_workers_) {
+    num_workers = max_workers_;
+  }
+  num_workers_ = num_workers;
+}
+
+unsigned int task_workers() {
+  return num_workers_;
+}
+
+TaskStats task_stats() {
+  TaskStats total = {0, 0, 0, 0};
+  for (unsigned int i = 0; i < MAX_CPUS; ++i) {
+    total.spawned += workers_[i].stats.spawned;
+    total.steals += workers_[i].stats.steals;
+    total.parks += workers_[i].stats.parks;
+    total.wakeups += workers_[i].stats.wakeups;
+  }
+  return total;
+}
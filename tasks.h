@@ -0,0 +1,66 @@
+#ifndef TASKS_H
+#define TASKS_H
+
+// Fork-join parallelism across every CPU. spawn() puts a task on the running
+// CPU's deque, where any idle CPU can steal it, and sync() waits for a group
+// of tasks to finish, running tasks itself (its own first, then stolen ones)
+// while it waits. Spawning is cheap enough to split work down to pieces of a
+// few microseconds.
+//
+// Tasks can spawn and sync tasks of their own. They must not block, and
+// nothing can spawn from an IRQ or deferred work. Tasks that end up on another
+// CPU run with interrupts disabled, so they shouldn't take long to get through
+// each piece of work, and shouldn't touch memory the boot CPU might unmap (see
+// smp.h).
+
+typedef void (*TaskFn)(void* arg);
+
+// Zero-initialised, and waited on with sync().
+typedef struct {
+  unsigned int pending;
+} TaskGroup;
+
+// Owned by whoever spawned it, and in use until its group's sync() returns.
+typedef struct {
+  TaskFn fn;
+  void* arg;
+  TaskGroup* group;
+} Task;
+
+// Turns every AP into a worker (so they're no longer available to
+// run_on_cpu()). Needs init_smp(). Until this is called, and with a single
+// CPU, tasks all run on the boot CPU from sync().
+void init_tasks();
+
+// Queues fn(arg) to run as part of group.
+void spawn(TaskGroup* group, Task* task, TaskFn fn, void* arg);
+
+// Waits for every task spawned in group to finish.
+void sync(TaskGroup* group);
+
+typedef void (*RangeFn)(unsigned int begin, unsigned int end, void* arg);
+
+// Runs fn over [begin, end) in parallel, by splitting it in half until the
+// pieces are no bigger than grain, and returns once they're all done.
+void parallel_for(unsigned int begin, unsigned int end, unsigned int grain,
+                  RangeFn fn, void* arg);
+
+// Limits the work to the first num_workers CPUs (including the boot CPU), for
+// measuring how things scale. Defaults to all of them. Only change it while
+// no tasks are running, since a CPU that stops looking for work leaves
+// whatever is on its deque behind.
+void set_task_workers(unsigned int num_workers);
+unsigned int task_workers();
+
+typedef struct {
+  unsigned int spawned;
+  unsigned int steals;   // Tasks that ran on a CPU other than their spawner's.
+  unsigned int parks;    // Times a worker ran out of work and halted.
+  unsigned int wakeups;  // IPIs sent to parked workers.
+} TaskStats;
+
+// Summed over every CPU. Each CPU counts its own, so the sum is only a
+// snapshot while tasks are running.
+TaskStats task_stats();
+
+#endif  // TASKS_H
@@ -2,8 +2,15 @@
 
 #include <stdio.h>
 
+int num_failures = 0;
+
 void expect_true(int val, const char* valstr, const char* file, int line) {
   if (!val) {
+    ++num_failures;
     printf("FAILURE in %s:%d: %s should be true but was not.\n", file, line, valstr);
   }
 }
+
+int test_result() {
+  return num_failures ? 1 : 0;
+}
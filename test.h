@@ -5,4 +5,8 @@
 
 void expect_true(int val, const char* valstr, const char* file, int line);
 
+// Returns 0 if every expectation so far held, 1 otherwise. Meant to be returned
+// from main().
+int test_result();
+
 #endif  // TEST_H
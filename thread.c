@@ -0,0 +1,332 @@
+#include "thread.h"
+
+#include "deferred.h"
+#include "idle.h"
+#include "interrupts.h"
+#include "log.h"
+#include "paging.h"
+#include "smp.h"
+#include "trace.h"
+
+// # Scheduling
+// Each priority has a FIFO run queue of runnable threads, linked through
+// Thread.next, and runnable_ has bit p set when queue p isn't empty. Picking
+// the next thread is a bsf on runnable_ and a pop, whatever the number of
+// threads. The running thread isn't in any queue.
+//
+// Everything here is only touched with interrupts disabled. Threads switch by
+// calling schedule(), either directly (yield(), block(), ...) or from
+// thread_irq_exit() when need_resched was set by something that happened
+// during an IRQ:
+//   - unblock() of a more important thread.
+//   - The time slice timer, which only runs while there's another thread of
+//     the running thread's priority to take turns with.
+// A thread that isn't running is always inside switch_context(), called from
+// schedule(), with its callee-saved registers on its stack.
+//
+// The running thread and need_resched live in the per-CPU data. Threads only
+// ever run on the boot CPU, but every CPU has a thread of its own for the code
+// it started out running, so that preempt_disable() works anywhere.
+
+#define EFLAGS_IF 0x200
+
+typedef struct {
+  Thread* head;
+  Thread* tail;
+} RunQueue;
+
+RunQueue run_queues_[NUM_THREAD_PRIORITIES];
+unsigned int runnable_ = 0;
+// The code each CPU started out running. Statically allocated so that there is
+// always a current thread, even before init_threads().
+Thread boot_threads_[MAX_CPUS];
+// A thread that has exited and whose stack can be freed once we're off it.
+Thread* zombie_ = 0;
+Timer slice_timer_;
+ThreadStats stats_;
+
+// See thread_asm.s
+extern void switch_context(unsigned int* old_esp, unsigned int new_esp);
+
+void run_queue_push(Thread* thread) {
+  RunQueue* queue = &run_queues_[thread->priority];
+  thread->next = 0;
+  if (queue->tail) {
+    queue->tail->next = thread;
+  } else {
+    queue->head = thread;
+  }
+  queue->tail = thread;
+  runnable_ |= 1u << thread->priority;
+}
+
+// Pops the first thread of the most important non-empty queue.
+Thread* run_queue_pop() {
+  if (!runnable_) {
+    return 0;
+  }
+  unsigned int priority = __builtin_ctz(runnable_);
+  RunQueue* queue = &run_queues_[priority];
+  Thread* thread = queue->head;
+  queue->head = thread->next;
+  if (!queue->head) {
+    queue->tail = 0;
+    runnable_ &= ~(1u << priority);
+  }
+  thread->next = 0;
+  return thread;
+}
+
+void slice_expired(void* ctx) {
+  ctx = ctx;
+  this_cpu()->need_resched = 1;
+}
+
+// Starts the time slice if the running thread has a thread of the same
+// priority to take turns with, and stops it otherwise.
+void update_slice_timer() {
+  if (runnable_ & (1u << current_thread()->priority)) {
+    if (!slice_timer_.active) {
+      start_timer(&slice_timer_, now_ns() + THREAD_TIME_SLICE_NS,
+                  slice_expired, 0);
+    }
+  } else {
+    cancel_timer(&slice_timer_);
+  }
+}
+
+// Frees the last thread to exit, if it isn't the one running.
+void reap_zombie() {
+  if (zombie_ && zombie_ != current_thread()) {
+    Thread* zombie = zombie_;
+    zombie_ = 0;
+    free_page_block(zombie->stack, THREAD_STACK_SIZE);
+    free(zombie);
+  }
+}
+
+// Switches to the most important runnable thread, putting the current thread
+// at the back of its run queue if it's still runnable. Called with interrupts
+// disabled, and returns (with them still disabled) once the current thread is
+// picked again.
+void schedule() {
+  Cpu* cpu = this_cpu();
+  Thread* prev = cpu->thread;
+  if (prev->state == THREAD_RUNNING) {
+    prev->state = THREAD_RUNNABLE;
+    run_queue_push(prev);
+  }
+  // The idle thread never blocks, so there's always something to run once
+  // init_threads() has started it.
+  Thread* next = run_queue_pop();
+  if (!next) {
+    LOG(ERROR, "Nothing to run, not even the idle thread.");
+    prev->state = THREAD_RUNNING;
+    return;
+  }
+  cpu->need_resched = 0;
+  next->state = THREAD_RUNNING;
+  cpu->thread = next;
+  // Restart the slice for whoever runs next, rather than carrying over what
+  // was left of the last one's.
+  cancel_timer(&slice_timer_);
+  update_slice_timer();
+  if (next != prev) {
+    ++stats_.switches;
+    trace(TRACE_SWITCH, (unsigned int)next->name, 0);
+    // Interrupts and sysenter from ring 3 land at the top of the running
+    // thread's stack (see user.c). The boot thread never goes to ring 3.
+    if (next->stack) {
+      cpu->segments.tss.esp0 = next->stack + THREAD_STACK_SIZE;
+    }
+    switch_context(&prev->esp, next->esp);
+    reap_zombie();
+  }
+}
+
+// Where new threads start, out of switch_context(). Interrupts are still
+// disabled from the schedule() that switched to us.
+void thread_entry() {
+  reap_zombie();
+  sti();
+  Thread* thread = current_thread();
+  thread->fn(thread->arg);
+  thread_exit();
+}
+
+Thread* thread_create(const char* name, unsigned int priority, ThreadFn fn,
+                      void* arg) {
+  if (priority >= NUM_THREAD_PRIORITIES) {
+    LOG_INT(ERROR, "Invalid thread priority: ", priority);
+    return 0;
+  }
+  Thread* thread = (Thread*)malloc(sizeof(Thread));
+  if (!thread) {
+    return 0;
+  }
+  thread->stack = alloc_page_block(THREAD_STACK_SIZE, 0);
+  if (!thread->stack) {
+    free(thread);
+    return 0;
+  }
+  thread->priority = priority;
+  thread->preempt_count = 0;
+  thread->fn = fn;
+  thread->arg = arg;
+  thread->name = name;
+  thread->sleep_timer.active = 0;
+  // Lay out the stack the way switch_context() leaves it, so that switching
+  // to the thread "returns" into thread_entry() with zeroed registers.
+  unsigned int* sp = (unsigned int*)(thread->stack + THREAD_STACK_SIZE);
+  *--sp = 0;  // thread_entry()'s return address, which it never uses.
+  *--sp = (unsigned int)thread_entry;
+  *--sp = 0;  // ebp
+  *--sp = 0;  // ebx
+  *--sp = 0;  // esi
+  *--sp = 0;  // edi
+  thread->esp = (unsigned int)sp;
+
+  unsigned int eflags = irq_save();
+  thread->state = THREAD_RUNNABLE;
+  run_queue_push(thread);
+  if (priority < current_thread()->priority) {
+    schedule();
+  } else {
+    update_slice_timer();
+  }
+  irq_restore(eflags);
+  return thread;
+}
+
+Thread* init_cpu_thread(unsigned int cpu_index) {
+  Thread* thread = &boot_threads_[cpu_index];
+  thread->priority = THREAD_PRIORITY_DEFAULT;
+  thread->state = THREAD_RUNNING;
+  thread->name = "boot";
+  return thread;
+}
+
+Thread* current_thread() {
+  return this_cpu()->thread;
+}
+
+void yield() {
+  unsigned int eflags = irq_save();
+  schedule();
+  irq_restore(eflags);
+}
+
+void wake_sleeper(void* ctx) {
+  unblock((Thread*)ctx);
+}
+
+void sleep_ns(unsigned long long ns) {
+  unsigned int eflags = irq_save();
+  Thread* thread = current_thread();
+  start_timer(&thread->sleep_timer, now_ns() + ns, wake_sleeper, thread);
+  thread->state = THREAD_BLOCKED;
+  schedule();
+  irq_restore(eflags);
+}
+
+void block() {
+  unsigned int eflags = irq_save();
+  current_thread()->state = THREAD_BLOCKED;
+  schedule();
+  irq_restore(eflags);
+}
+
+// Switches threads right away if something asked for it and it's safe to: not
+// in an IRQ, not in deferred work, and not with preemption disabled.
+void preempt_if_needed() {
+  unsigned int eflags = irq_save();
+  Cpu* cpu = this_cpu();
+  if (cpu->need_resched && (eflags & EFLAGS_IF) &&
+      !cpu->thread->preempt_count && !deferred_work_running()) {
+    ++stats_.preemptions;
+    schedule();
+  }
+  irq_restore(eflags);
+}
+
+void unblock(Thread* thread) {
+  unsigned int eflags = irq_save();
+  if (thread->state == THREAD_BLOCKED) {
+    cancel_timer(&thread->sleep_timer);
+    thread->state = THREAD_RUNNABLE;
+    run_queue_push(thread);
+    if (thread->priority < current_thread()->priority) {
+      this_cpu()->need_resched = 1;
+    } else {
+      update_slice_timer();
+    }
+  }
+  irq_restore(eflags);
+  preempt_if_needed();
+}
+
+void thread_exit() {
+  cli();
+  Thread* thread = current_thread();
+  if (!thread->stack) {
+    LOG(ERROR, "The boot thread can't exit.");
+    sti();
+    return;
+  }
+  // Only one thread can exit at a time without running anything in between,
+  // so zombie_ is always free by now.
+  thread->state = THREAD_DEAD;
+  zombie_ = thread;
+  schedule();
+}
+
+int should_yield() {
+  // Wraps around to every bit for THREAD_PRIORITY_IDLE.
+  return (runnable_ & ((2u << current_thread()->priority) - 1)) != 0;
+}
+
+void preempt_disable() {
+  ++current_thread()->preempt_count;
+}
+
+void preempt_enable() {
+  if (--current_thread()->preempt_count == 0) {
+    preempt_if_needed();
+  }
+}
+
+void thread_irq_exit() {
+  // An IRQ that came in during deferred work (which runs with interrupts
+  // enabled) is nested inside another IRQ, or inside the thread running that
+  // work, so it's not safe to switch away from.
+  Cpu* cpu = this_cpu();
+  if (cpu->need_resched && !cpu->thread->preempt_count &&
+      !deferred_work_running()) {
+    ++stats_.preemptions;
+    schedule();
+  }
+}
+
+ThreadStats thread_stats() {
+  return stats_;
+}
+
+int any_thread_runnable() {
+  return runnable_ != 0;
+}
+
+// Runs whenever nothing else can, doing idle work and halting until some other
+// thread becomes runnable.
+void idle_thread(void* arg) {
+  arg = arg;
+  while (1) {
+    idle_until(any_thread_runnable);
+    yield();
+  }
+}
+
+void init_threads() {
+  if (!thread_create("idle", THREAD_PRIORITY_IDLE, idle_thread, 0)) {
+    LOG(ERROR, "Couldn't start the idle thread.");
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "timer.h"
+
+// Kernel threads, scheduled by strict priority: the runnable thread with the
+// lowest priority number always runs, and threads of the same priority take
+// turns, THREAD_TIME_SLICE_NS at a time. Threads only run on the boot CPU, and
+// everything here except preempt_disable() and preempt_enable() must only be
+// called there.
+#define NUM_THREAD_PRIORITIES 32
+#define THREAD_PRIORITY_HIGHEST 0
+#define THREAD_PRIORITY_DEFAULT 16
+#define THREAD_PRIORITY_IDLE (NUM_THREAD_PRIORITIES - 1)
+#define THREAD_STACK_SIZE 0x4000
+#define THREAD_TIME_SLICE_NS 10000000
+
+typedef void (*ThreadFn)(void* arg);
+
+typedef enum {
+  THREAD_RUNNING,
+  THREAD_RUNNABLE,
+  THREAD_BLOCKED,
+  THREAD_DEAD
+} ThreadState;
+
+typedef struct Thread {
+  unsigned int esp;  // Saved by switch_context() while not running.
+  unsigned int stack;  // 0 for the boot thread, whose stack isn't ours.
+  unsigned int priority;
+  ThreadState state;
+  // preempt_disable() depth. Per thread, since a thread can block with
+  // preemption disabled.
+  unsigned int preempt_count;
+  ThreadFn fn;
+  void* arg;
+  struct Thread* next;  // In its run queue.
+  Timer sleep_timer;
+  const char* name;
+} Thread;
+
+// Turns the code that's been running since boot into a thread (at
+// THREAD_PRIORITY_DEFAULT) and starts the idle thread. Needs init_timers().
+void init_threads();
+
+// Starts a thread running fn(arg). Returns 0 if we're out of memory. The
+// thread exits when fn returns.
+Thread* thread_create(const char* name, unsigned int priority, ThreadFn fn,
+                      void* arg);
+
+Thread* current_thread();
+
+// Returns the thread for the code a CPU starts out running, for its per-CPU
+// data (see smp.h). Only the boot CPU's is ever scheduled.
+Thread* init_cpu_thread(unsigned int cpu_index);
+
+// Lets other threads of the same priority run.
+void yield();
+
+// Blocks the current thread for at least ns nanoseconds.
+void sleep_ns(unsigned long long ns);
+
+// Blocks the current thread until something calls unblock() on it. To avoid
+// missing a wakeup, check whatever's being waited for with interrupts
+// disabled (see irq_save()) and keep them disabled until this is called.
+void block();
+
+// Makes a blocked thread runnable again, switching to it as soon as possible
+// if it's more important than the running thread. Does nothing if it isn't
+// blocked. Safe to call from deferred work.
+void unblock(Thread* thread);
+
+// Ends the current thread. Its stack is freed by whichever thread runs next.
+void thread_exit();
+
+// Returns 1 if a thread at least as important as the current one is waiting to
+// run, i.e. if yield() would do anything.
+int should_yield();
+
+// Keeps the current thread from being preempted until the matching
+// preempt_enable(). They nest. For code that changes shared data structures
+// (like the page tables) that have no locks of their own.
+void preempt_disable();
+void preempt_enable();
+
+// Called on the way out of every IRQ, with interrupts disabled. Switches
+// threads if the IRQ (or the deferred work it queued) made that necessary.
+void thread_irq_exit();
+
+typedef struct {
+  unsigned int switches;     // Every time a different thread started running.
+  unsigned int preemptions;  // Switches forced by an IRQ or a time slice.
+} ThreadStats;
+
+ThreadStats thread_stats();
+
+#endif  // THREAD_H
@@ -0,0 +1,23 @@
+global switch_context
+
+; switch_context - saves the callee-saved registers on the current stack,
+; stores the stack pointer, and resumes the thread whose stack pointer is given.
+; Everything else is either caller-saved (so the C caller already assumes it's
+; gone) or the same for every thread. Interrupts must be disabled.
+; stack: [esp + 8] the new thread's saved esp
+;        [esp + 4] where to save the current thread's esp
+;        [esp    ] return address
+switch_context:
+  mov     eax, [esp + 4]
+  mov     edx, [esp + 8]
+  push    ebp
+  push    ebx
+  push    esi
+  push    edi
+  mov     [eax], esp
+  mov     esp, edx
+  pop     edi
+  pop     esi
+  pop     ebx
+  pop     ebp
+  ret                       ; into wherever the new thread called this from
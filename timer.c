@@ -0,0 +1,289 @@
+#include "timer.h"
+
+#include "apic.h"
+#include "deferred.h"
+#include "interrupts.h"
+#include "io.h"
+#include "log.h"
+#include "pit.h"
+
+// The local APIC timer's vector. Only this CPU gets it, so it doesn't need to
+// be anywhere near the legacy IRQs.
+#define LAPIC_TIMER_VECTOR 0x40
+#define NS_PER_SECOND 1000000000ull
+// 10ms of PIT ticks to calibrate over.
+#define CALIBRATION_TICKS (PIT_HZ / 100)
+#define MAX_TIMERS 256
+// The soonest the hardware is asked to fire, so a deadline that has already
+// passed still gets an interrupt instead of a count of 0.
+#define MIN_DELTA_NS 1000
+// The longest the hardware is asked to wait, even if the LAPIC timer could go
+// for longer. Waking up early just means reprogramming it.
+#define MAX_DELTA_NS 1000000000ull
+
+// Multiplies by mult / 2^shift, for converting between clocks without the
+// 64-bit division we don't have.
+typedef struct {
+  unsigned int mult;
+  unsigned int shift;
+} Scale;
+
+typedef struct {
+  int initialized;
+  unsigned long long tsc_base;
+  unsigned long long tsc_hz;
+  Scale tsc_to_ns;
+  int use_lapic;
+  unsigned long long timer_hz;  // Of whichever hardware timer is in use.
+  Scale ns_to_timer_ticks;
+  unsigned int max_timer_ticks;
+  Timer* heap[MAX_TIMERS];
+  unsigned int num_timers;
+  // Set while run_expired_timers() is queued, so a burst of timer interrupts
+  // only queues it once.
+  int expiry_queued;
+} TimerConfig;
+
+TimerConfig timers_;
+
+// Long division, one bit at a time. Only used while calibrating.
+unsigned long long udiv64(unsigned long long n, unsigned long long d) {
+  unsigned long long q = 0;
+  unsigned long long r = 0;
+  for (int bit = 63; bit >= 0; --bit) {
+    r = (r << 1) | ((n >> bit) & 1);
+    if (r >= d) {
+      r -= d;
+      q |= 1ull << bit;
+    }
+  }
+  return q;
+}
+
+// Makes a Scale that converts from_hz ticks to to_hz ticks, keeping as many
+// bits of precision as fit in a 32-bit multiplier.
+Scale make_scale(unsigned long long from_hz, unsigned long long to_hz) {
+  Scale scale;
+  scale.shift = 32;
+  unsigned long long mult = udiv64(to_hz << 32, from_hz);
+  while ((mult >> 32) && scale.shift) {
+    --scale.shift;
+    mult = udiv64(to_hz << scale.shift, from_hz);
+  }
+  scale.mult = (mult >> 32) ? 0xFFFFFFFF : (unsigned int)mult;
+  return scale;
+}
+
+unsigned long long scale_apply(Scale scale, unsigned long long x) {
+  unsigned long long low = (x & 0xFFFFFFFF) * scale.mult;
+  unsigned long long high = (x >> 32) * scale.mult;
+  return (high << (32 - scale.shift)) + (low >> scale.shift);
+}
+
+unsigned long long cycles_to_ns(unsigned long long cycles) {
+  return scale_apply(timers_.tsc_to_ns, cycles);
+}
+
+int timers_use_pit() {
+  return !timers_.use_lapic;
+}
+
+unsigned long long now_ns() {
+  if (!timers_.initialized) {
+    return 0;
+  }
+  return cycles_to_ns(rdtsc() - timers_.tsc_base);
+}
+
+// # The heap
+// heap[0] is the earliest deadline and the children of heap[i] are at 2i + 1
+// and 2i + 2. Each Timer knows its index, so it can be removed from the middle.
+// Only touched with interrupts disabled.
+
+void heap_set(unsigned int index, Timer* timer) {
+  timers_.heap[index] = timer;
+  timer->heap_index = index;
+}
+
+void heap_sift_up(unsigned int index) {
+  Timer* timer = timers_.heap[index];
+  while (index > 0) {
+    unsigned int parent = (index - 1) / 2;
+    if (timers_.heap[parent]->deadline <= timer->deadline) {
+      break;
+    }
+    heap_set(index, timers_.heap[parent]);
+    index = parent;
+  }
+  heap_set(index, timer);
+}
+
+void heap_sift_down(unsigned int index) {
+  Timer* timer = timers_.heap[index];
+  while (1) {
+    unsigned int child = 2 * index + 1;
+    if (child >= timers_.num_timers) {
+      break;
+    }
+    if (child + 1 < timers_.num_timers &&
+        timers_.heap[child + 1]->deadline < timers_.heap[child]->deadline) {
+      ++child;
+    }
+    if (timer->deadline <= timers_.heap[child]->deadline) {
+      break;
+    }
+    heap_set(index, timers_.heap[child]);
+    index = child;
+  }
+  heap_set(index, timer);
+}
+
+void heap_remove(Timer* timer) {
+  unsigned int index = timer->heap_index;
+  Timer* last = timers_.heap[--timers_.num_timers];
+  timer->active = 0;
+  if (last == timer) {
+    return;
+  }
+  heap_set(index, last);
+  heap_sift_up(index);
+  heap_sift_down(last->heap_index);
+}
+
+// Programs the hardware for the earliest deadline, or stops it if there are no
+// timers left. Called with interrupts disabled.
+void program_next_deadline() {
+  if (!timers_.num_timers) {
+    if (timers_.use_lapic) {
+      lapic_timer_stop();
+    } else {
+      pit_stop();
+    }
+    return;
+  }
+  unsigned long long now = now_ns();
+  unsigned long long deadline = timers_.heap[0]->deadline;
+  unsigned long long delta = deadline > now ? deadline - now : 0;
+  if (delta < MIN_DELTA_NS) {
+    delta = MIN_DELTA_NS;
+  } else if (delta > MAX_DELTA_NS) {
+    delta = MAX_DELTA_NS;
+  }
+  unsigned long long ticks = scale_apply(timers_.ns_to_timer_ticks, delta);
+  if (!ticks) {
+    ticks = 1;
+  } else if (ticks > timers_.max_timer_ticks) {
+    ticks = timers_.max_timer_ticks;
+  }
+  if (timers_.use_lapic) {
+    lapic_timer_oneshot(LAPIC_TIMER_VECTOR, ticks);
+  } else {
+    pit_oneshot(ticks);
+  }
+}
+
+// Runs as deferred work after a timer interrupt.
+void run_expired_timers(unsigned int data) {
+  data = data;
+  unsigned int eflags = irq_save();
+  timers_.expiry_queued = 0;
+  while (timers_.num_timers && timers_.heap[0]->deadline <= now_ns()) {
+    Timer* timer = timers_.heap[0];
+    heap_remove(timer);
+    // With interrupts enabled, since fn is allowed to take its time, and to
+    // start and cancel timers.
+    irq_restore(eflags);
+    timer->fn(timer->ctx);
+    eflags = irq_save();
+  }
+  program_next_deadline();
+  irq_restore(eflags);
+}
+
+void timer_interrupt(void* ctx) {
+  unsigned int vector = (unsigned int)ctx;
+  ack_irq(vector);
+  if (!timers_.expiry_queued &&
+      defer_work(DEFERRED_HIGH, run_expired_timers, 0)) {
+    timers_.expiry_queued = 1;
+  }
+}
+
+int start_timer(Timer* timer, unsigned long long deadline, TimerFn fn,
+                void* ctx) {
+  unsigned int eflags = irq_save();
+  if (timer->active) {
+    heap_remove(timer);
+  }
+  if (timers_.num_timers == MAX_TIMERS) {
+    irq_restore(eflags);
+    LOG(ERROR, "Too many timers running.");
+    return 0;
+  }
+  timer->deadline = deadline;
+  timer->fn = fn;
+  timer->ctx = ctx;
+  timer->active = 1;
+  heap_set(timers_.num_timers++, timer);
+  heap_sift_up(timer->heap_index);
+  if (timers_.heap[0] == timer) {
+    program_next_deadline();
+  }
+  irq_restore(eflags);
+  return 1;
+}
+
+void cancel_timer(Timer* timer) {
+  unsigned int eflags = irq_save();
+  if (timer->active) {
+    // If it was the earliest, the hardware will go off for nothing and get
+    // reprogrammed then.
+    heap_remove(timer);
+  }
+  irq_restore(eflags);
+}
+
+void init_timers() {
+  timers_.use_lapic = apic_interrupts_enabled();
+
+  // Measure the TSC (and the LAPIC timer, which runs off the bus clock) over
+  // a fixed number of PIT ticks, with interrupts off so nothing stretches it.
+  unsigned int eflags = irq_save();
+  if (timers_.use_lapic) {
+    lapic_timer_oneshot(LAPIC_TIMER_VECTOR, 0xFFFFFFFF);
+  }
+  unsigned long long start = rdtsc();
+  pit_wait(CALIBRATION_TICKS);
+  unsigned long long cycles = rdtsc() - start;
+  unsigned int lapic_ticks = 0;
+  if (timers_.use_lapic) {
+    lapic_ticks = 0xFFFFFFFF - lapic_timer_remaining();
+    lapic_timer_stop();
+  }
+  irq_restore(eflags);
+
+  timers_.tsc_hz = udiv64(cycles * PIT_HZ, CALIBRATION_TICKS);
+  timers_.tsc_to_ns = make_scale(timers_.tsc_hz, NS_PER_SECOND);
+  if (timers_.use_lapic) {
+    timers_.timer_hz =
+        udiv64((unsigned long long)lapic_ticks * PIT_HZ, CALIBRATION_TICKS);
+    timers_.max_timer_ticks = 0xFFFFFFFF;
+    register_irq_handler(LAPIC_TIMER_VECTOR, timer_interrupt,
+                         (void*)LAPIC_TIMER_VECTOR);
+  } else {
+    timers_.timer_hz = PIT_HZ;
+    timers_.max_timer_ticks = PIT_MAX_TICKS;
+    register_irq_handler(IRQ_VECTOR(PIT_IRQ), timer_interrupt,
+                         (void*)IRQ_VECTOR(PIT_IRQ));
+    pit_stop();
+    enable_irq(PIT_IRQ);
+  }
+  timers_.ns_to_timer_ticks = make_scale(NS_PER_SECOND, timers_.timer_hz);
+  timers_.tsc_base = rdtsc();
+  timers_.initialized = 1;
+
+  LOG_INT(INFO, "TSC kHz: ", udiv64(timers_.tsc_hz, 1000));
+  LOG_INT(INFO, "Timer kHz: ", udiv64(timers_.timer_hz, 1000));
+  LOG(INFO, timers_.use_lapic ? "Using the local APIC timer."
+                              : "Using the PIT for timers.");
+}
@@ -0,0 +1,45 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+// Time and one-shot timers. Time comes from the TSC, calibrated against the
+// PIT at boot. Timers are kept in a min-heap by deadline, and the hardware
+// timer (the local APIC timer if the APIC is in use, the PIT otherwise) is only
+// ever programmed for the earliest one, so there's no periodic tick and an
+// idle machine stays halted until something is actually due.
+
+typedef void (*TimerFn)(void* ctx);
+
+// Owned by the caller, and must start out zeroed.
+typedef struct {
+  unsigned long long deadline;  // In now_ns() time.
+  TimerFn fn;
+  void* ctx;
+  unsigned int active;
+  unsigned int heap_index;
+} Timer;
+
+// Calibrates the clocks and sets up the timer interrupt. Needs interrupts, and
+// should come after init_apic_interrupts() so it can use the local APIC timer.
+void init_timers();
+
+// Returns 1 if the timers run on the PIT, which leaves it to them. They use
+// the local APIC timer otherwise, so the PIT is free for something else. Only
+// 0 once init_timers() has picked the local APIC timer.
+int timers_use_pit();
+
+// Nanoseconds since init_timers(). Returns 0 before then.
+unsigned long long now_ns();
+
+// Converts a number of TSC cycles to nanoseconds.
+unsigned long long cycles_to_ns(unsigned long long cycles);
+
+// Calls fn(ctx) once now_ns() reaches deadline (in deferred work, see
+// deferred.h), restarting the timer if it was already running. Returns 0 if
+// there are too many timers running.
+int start_timer(Timer* timer, unsigned long long deadline, TimerFn fn,
+                void* ctx);
+
+// Stops the timer if it's running.
+void cancel_timer(Timer* timer);
+
+#endif  // TIMER_H
@@ -0,0 +1,110 @@
+#include "trace.h"
+
+#include "io.h"
+#include "serial.h"
+#include "smp.h"
+#include "string.h"
+
+// # The ring
+// Writers claim the next index with an atomic increment, so events from every
+// CPU end up in one ring in roughly the order they happened, and a writer
+// interrupted halfway through just ends up with an older index than the
+// interrupt's. Each slot's seq is cleared while it's being written and set to
+// its index + 1 once it's done, with release ordering, so trace_snapshot() can
+// check seq before and after copying a slot to know it got the whole thing.
+// An event written over while it's being read just gets skipped.
+
+TraceEvent trace_ring_[TRACE_RING_SIZE];
+unsigned int trace_next_ = 0;
+
+void trace(TraceEventType type, unsigned int a, unsigned int b) {
+  unsigned int index = __atomic_fetch_add(&trace_next_, 1, __ATOMIC_RELAXED);
+  TraceEvent* event = &trace_ring_[index & (TRACE_RING_SIZE - 1)];
+  __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  event->type = type;
+  event->cpu = this_cpu()->index;
+  event->tsc = rdtsc();
+  event->a = a;
+  event->b = b;
+  __atomic_store_n(&event->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int trace_snapshot(TraceEvent* out, unsigned int max) {
+  unsigned int next = __atomic_load_n(&trace_next_, __ATOMIC_ACQUIRE);
+  unsigned int count = next < TRACE_RING_SIZE ? next : TRACE_RING_SIZE;
+  if (count > max) {
+    count = max;
+  }
+  unsigned int copied = 0;
+  for (unsigned int index = next - count; index != next; ++index) {
+    TraceEvent* event = &trace_ring_[index & (TRACE_RING_SIZE - 1)];
+    if (__atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) != index + 1) {
+      continue;
+    }
+    out[copied] = *event;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&event->seq, __ATOMIC_RELAXED) != index + 1) {
+      continue;
+    }
+    ++copied;
+  }
+  return copied;
+}
+
+const char* trace_event_names_[NUM_TRACE_EVENTS] = {
+  "log",           // TRACE_LOG
+  "irq",           // TRACE_IRQ
+  "page fault",    // TRACE_PAGE_FAULT
+  "map",           // TRACE_MAP
+  "unmap",         // TRACE_UNMAP
+  "alloc frames",  // TRACE_ALLOC_FRAMES
+  "free frames",   // TRACE_FREE_FRAMES
+  "malloc",        // TRACE_MALLOC
+  "free",          // TRACE_FREE
+  "switch to",     // TRACE_SWITCH
+  "syscall",       // TRACE_SYSCALL
+};
+
+void put_hex(unsigned int value) {
+  char hex[12];
+  int_to_hex(value, hex);
+  serial_puts(hex);
+}
+
+void trace_dump() {
+  // Copied out in one go, so what's dumped is a snapshot, and the events this
+  // adds (there shouldn't be any, but still) don't get in the way.
+  static TraceEvent events[TRACE_RING_SIZE];
+  serial_panic();
+  unsigned int count = trace_snapshot(events, TRACE_RING_SIZE);
+  unsigned long long last = count ? events[count - 1].tsc : 0;
+  serial_puts("Trace, oldest first (cpu, cycles before the last event):\n");
+  for (unsigned int i = 0; i < count; ++i) {
+    TraceEvent* event = &events[i];
+    char dec[12];
+    int_to_dec(event->cpu, dec);
+    serial_puts("  ");
+    serial_puts(dec);
+    serial_puts(" -");
+    unsigned long long ago = last - event->tsc;
+    put_hex(ago >> 32 ? 0xFFFFFFFF : (unsigned int)ago);
+    serial_puts(" ");
+    serial_puts(event->type < NUM_TRACE_EVENTS ?
+                trace_event_names_[event->type] : "?");
+    serial_puts(" ");
+    if (event->type == TRACE_LOG || event->type == TRACE_SWITCH) {
+      // Only ever literals, which stay put.
+      serial_puts(event->a ? (const char*)(unsigned long)event->a :
+                             "(not a literal)");
+    } else {
+      put_hex(event->a);
+    }
+    if (event->type != TRACE_SWITCH && event->type != TRACE_FREE) {
+      serial_puts(" ");
+      put_hex(event->b);
+    }
+    serial_puts("\n");
+  }
+  serial_puts("End of trace.\n");
+}
@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// A flight recorder: a ring of the last TRACE_RING_SIZE events (log messages,
+// IRQs, allocations, page mappings, ...) kept in memory, which only goes out
+// over serial when trace_dump() is called, e.g. on a fatal fault. Recording is
+// a few stores, lock-free, and fine from any CPU, IRQ or deferred work, so it
+// can stay on all the time.
+
+// A power of 2.
+#define TRACE_RING_SIZE 1024
+
+typedef enum {
+  TRACE_LOG,         // a: the text (0 if it wasn't a literal), b: the value.
+  TRACE_IRQ,         // a: the vector, b: cycles spent handling it.
+  TRACE_PAGE_FAULT,  // a: the address, b: the error code.
+  TRACE_MAP,         // a: vaddr, b: pages.
+  TRACE_UNMAP,       // a: vaddr, b: pages.
+  TRACE_ALLOC_FRAMES,  // a: paddr, b: order.
+  TRACE_FREE_FRAMES,   // a: paddr, b: order.
+  TRACE_MALLOC,      // a: the memory, b: size.
+  TRACE_FREE,        // a: the memory.
+  TRACE_SWITCH,      // a: the new thread's name.
+  TRACE_SYSCALL,     // a: the number, b: the first argument.
+  NUM_TRACE_EVENTS
+} TraceEventType;
+
+typedef struct {
+  // The event's index + 1 once it's completely written, so a reader can tell
+  // it from one that's half written, or has since been written over.
+  unsigned int seq;
+  unsigned short type;
+  unsigned short cpu;
+  unsigned long long tsc;
+  unsigned int a;
+  unsigned int b;
+} TraceEvent;
+
+void trace(TraceEventType type, unsigned int a, unsigned int b);
+
+// Copies out up to max of the most recent events, oldest first, skipping any
+// that are being written right now. Returns how many it copied.
+unsigned int trace_snapshot(TraceEvent* out, unsigned int max);
+
+// Writes everything in the ring to serial, oldest first, straight to the UART
+// (see serial_panic()) and without going through log.h, so it works however
+// broken things are.
+void trace_dump();
+
+#endif  // TRACE_H
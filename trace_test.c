@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "smp.h"
+#include "test.h"
+#include "trace.h"
+
+// What trace.c needs from the rest of the kernel.
+Cpu cpu;
+unsigned long long tsc = 0;
+unsigned int lines_out = 0;
+
+Cpu* this_cpu() {
+  return &cpu;
+}
+
+unsigned long long rdtsc() {
+  return ++tsc;
+}
+
+void serial_panic() {}
+
+void serial_puts(const char* str) {
+  for (; *str; ++str) {
+    if (*str == '\n') {
+      ++lines_out;
+    }
+  }
+}
+
+void int_to_dec(int i, char dec_str[12]) {
+  sprintf(dec_str, "%d", i);
+}
+
+void int_to_hex(unsigned int i, char hex_str[12]) {
+  sprintf(hex_str, "0x%08X", i);
+}
+
+TraceEvent events[TRACE_RING_SIZE];
+
+void test_starts_empty() {
+  EXPECT_TRUE(trace_snapshot(events, TRACE_RING_SIZE) == 0);
+}
+
+void test_events_come_out_in_order() {
+  cpu.index = 2;
+  trace(TRACE_IRQ, 0x20, 100);
+  trace(TRACE_MAP, 0x1000, 3);
+  EXPECT_TRUE(trace_snapshot(events, TRACE_RING_SIZE) == 2);
+  EXPECT_TRUE(events[0].type == TRACE_IRQ);
+  EXPECT_TRUE(events[0].a == 0x20 && events[0].b == 100);
+  EXPECT_TRUE(events[0].cpu == 2);
+  EXPECT_TRUE(events[1].type == TRACE_MAP);
+  EXPECT_TRUE(events[1].a == 0x1000 && events[1].b == 3);
+  EXPECT_TRUE(events[0].tsc < events[1].tsc);
+  // Just the newest, if there's only room for one.
+  EXPECT_TRUE(trace_snapshot(events, 1) == 1);
+  EXPECT_TRUE(events[0].type == TRACE_MAP);
+}
+
+void test_old_events_get_written_over() {
+  for (unsigned int i = 0; i < 2 * TRACE_RING_SIZE; ++i) {
+    trace(TRACE_SYSCALL, i, 0);
+  }
+  EXPECT_TRUE(trace_snapshot(events, TRACE_RING_SIZE) == TRACE_RING_SIZE);
+  EXPECT_TRUE(events[0].a == TRACE_RING_SIZE);
+  EXPECT_TRUE(events[TRACE_RING_SIZE - 1].a == 2 * TRACE_RING_SIZE - 1);
+}
+
+// See trace.c.
+extern TraceEvent trace_ring_[TRACE_RING_SIZE];
+extern unsigned int trace_next_;
+
+void test_half_written_events_are_skipped() {
+  trace(TRACE_FREE, 1, 0);
+  trace(TRACE_FREE, 2, 0);
+  trace(TRACE_FREE, 3, 0);
+  // As if the second one were still being written.
+  TraceEvent* second = &trace_ring_[(trace_next_ - 2) & (TRACE_RING_SIZE - 1)];
+  unsigned int seq = second->seq;
+  second->seq = 0;
+  EXPECT_TRUE(trace_snapshot(events, 3) == 2);
+  EXPECT_TRUE(events[0].a == 1 && events[1].a == 3);
+  second->seq = seq;
+}
+
+void test_dump_writes_every_event() {
+  lines_out = 0;
+  trace_dump();
+  // A header and a footer around them.
+  EXPECT_TRUE(lines_out == TRACE_RING_SIZE + 2);
+}
+
+int main() {
+  test_starts_empty();
+  test_events_come_out_in_order();
+  test_old_events_get_written_over();
+  test_half_written_events_are_skipped();
+  test_dump_writes_every_event();
+  return test_result();
+}
@@ -0,0 +1,105 @@
+#include "user.h"
+
+#include "log.h"
+#include "paging.h"
+#include "string.h"
+#include "syscall.h"
+#include "thread.h"
+
+// # Running a program
+// The program's code (the module, where the bootloader left it) and stack are
+// the only memory mapped with PAGE_USER, so they're all ring 3 can get at. Its
+// thread drops to ring 3 with an iret and from then on only comes back into
+// the kernel for system calls and interrupts, which both land at the top of
+// the thread's own stack (see schedule()). SYS_EXIT, or a fault, ends the
+// thread from in there and wakes whoever is waiting in run_user_program(),
+// which cleans up.
+
+// 16KB of stack, in frames from alloc_frames().
+#define USER_STACK_ORDER 2
+#define USER_STACK_SIZE (0x1000 << USER_STACK_ORDER)
+
+typedef struct {
+  unsigned int entry;
+  unsigned int stack;  // The top of it.
+  unsigned int result;
+  int done;
+  Thread* waiter;
+} UserProgram;
+
+UserProgram* running_program_ = 0;
+
+// See user_asm.s
+extern void enter_user_mode(unsigned int eip, unsigned int esp,
+                            unsigned int eax);
+
+void user_thread(void* arg) {
+  UserProgram* program = (UserProgram*)arg;
+  enter_user_mode(program->entry, program->stack, sysenter_enabled());
+}
+
+int run_user_program(module_t* module, unsigned int* result) {
+  unsigned int code_size = module->mod_end - module->mod_start;
+  void* code = map_physical(module->mod_start, code_size,
+                            PAGE_WRITABLE | PAGE_USER);
+  if (!code) {
+    LOG(ERROR, "Couldn't map the user program.");
+    return 0;
+  }
+  unsigned int stack_paddr = alloc_frames(USER_STACK_ORDER);
+  void* stack = stack_paddr ?
+      map_physical(stack_paddr, USER_STACK_SIZE, PAGE_WRITABLE | PAGE_USER) :
+      0;
+  if (!stack) {
+    LOG(ERROR, "Couldn't allocate a user stack.");
+    if (stack_paddr) {
+      free_frames(stack_paddr, USER_STACK_ORDER);
+    }
+    unmap_physical(code, code_size);
+    return 0;
+  }
+  // Whatever the frames last held is none of the program's business.
+  memset(stack, 0, USER_STACK_SIZE);
+
+  UserProgram program;
+  program.entry = (unsigned int)code;
+  program.stack = (unsigned int)stack + USER_STACK_SIZE;
+  program.result = 0;
+  program.done = 0;
+  program.waiter = current_thread();
+  running_program_ = &program;
+  Thread* thread = thread_create("user program", THREAD_PRIORITY_DEFAULT,
+                                 user_thread, &program);
+  if (thread) {
+    unsigned int eflags = irq_save();
+    while (!program.done) {
+      block();
+    }
+    irq_restore(eflags);
+  } else {
+    LOG(ERROR, "Couldn't start the user program's thread.");
+  }
+  running_program_ = 0;
+
+  unmap_physical(stack, USER_STACK_SIZE);
+  free_frames(stack_paddr, USER_STACK_ORDER);
+  unmap_physical(code, code_size);
+  *result = program.result;
+  return thread != 0;
+}
+
+void user_exit(unsigned int result) {
+  cli();
+  UserProgram* program = running_program_;
+  program->result = result;
+  program->done = 1;
+  unblock(program->waiter);
+  thread_exit();
+}
+
+void user_fault(InterruptFrame* frame) {
+  LOG_HEX(ERROR, "User program faulted, exception#: ", frame->interrupt);
+  LOG_HEX(ERROR, "Error code: ", frame->error_code);
+  LOG_HEX(ERROR, "eip: ", frame->eip);
+  user_exit(USER_FAULT_RESULT);
+}
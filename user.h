@@ -0,0 +1,25 @@
+#ifndef USER_H
+#define USER_H
+
+#include "interrupts.h"
+#include "multiboot.h"
+
+// What run_user_program() gives back for a program killed by a fault.
+#define USER_FAULT_RESULT 0xFFFFFFFF
+
+// Runs the flat binary in a multiboot module in ring 3, in a thread of its
+// own, and waits for it to exit. It starts at its first byte, with a stack and
+// eax = sysenter_enabled() (see syscall.h), and can only touch its own code
+// and stack. Returns 0 if it couldn't be started, or stores what it passed to
+// SYS_EXIT in result and returns 1. Only one program runs at a time, and only
+// from a thread.
+int run_user_program(module_t* module, unsigned int* result);
+
+// Ends the running program with result. For SYS_EXIT. Never returns.
+void user_exit(unsigned int result);
+
+// Kills the running program, which caused the exception in frame. Never
+// returns.
+void user_fault(InterruptFrame* frame);
+
+#endif  // USER_H
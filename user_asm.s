@@ -0,0 +1,34 @@
+global enter_user_mode
+
+USER_CODE_SELECTOR equ 0x18     ; see segmentation.h
+USER_DATA_SELECTOR equ 0x20
+RPL_USER           equ 3
+EFLAGS_IF          equ 0x200
+
+; enter_user_mode - drops to ring 3 at eip with esp and eax set, by making it
+; look like an interrupt from there is returning. Never returns.
+; stack: [esp + 12] eax for the program
+;        [esp + 8] the user esp
+;        [esp + 4] the user eip
+;        [esp    ] return address
+enter_user_mode:
+  mov     ecx, [esp + 4]
+  mov     edx, [esp + 8]
+  mov     eax, [esp + 12]
+  push    dword USER_DATA_SELECTOR | RPL_USER   ; ss
+  push    edx                                   ; esp
+  push    dword EFLAGS_IF | 0x2                 ; eflags (bit 1 is always set)
+  push    dword USER_CODE_SELECTOR | RPL_USER   ; cs
+  push    ecx                                   ; eip
+  mov     cx, USER_DATA_SELECTOR | RPL_USER
+  mov     ds, cx
+  mov     es, cx
+  mov     fs, cx
+  mov     gs, cx
+  xor     ebx, ebx                              ; don't leak anything else
+  xor     ecx, ecx
+  xor     edx, edx
+  xor     esi, esi
+  xor     edi, edi
+  xor     ebp, ebp
+  iret